@@ -2,15 +2,38 @@
 #define __F_MEDIA_BUFFER_H_
 
 #include <atheos/semaphore.h>
+#include <atheos/atomic.h>
 #include <util/thread.h>
 #include <util/locker.h>
-#include <queue>
+
+#include <scheduler.h>
+#include <stats.h>
+
+#include <vector>
+
+/* Size of a CPU cache line.  The producer & consumer indices of the ring are padded to this */
+#define BUFFER_CACHE_LINE	64
+
+/* Number of slots in the packet ring.  Must be a power of two and limits the maximum SetMinMax() */
+#define BUFFER_RING_SIZE	256
+
+/* The most packets the Buffer asks its Stage for at once */
+#define BUFFER_BATCH_SIZE	16
+
+/* An adaptive Buffer can grow its watermarks to 2^BUFFER_MAX_SCALE times what was set */
+#define BUFFER_MAX_SCALE	4
+
+/* An adaptive Buffer halves its watermarks once the consumer has taken this many times the maximum without
+   finding the Buffer empty */
+#define BUFFER_IDLE_LIMIT	4
 
 namespace media
 {
 
 class Packet;
+class PacketInfo;
 class Stage;
+class Pipeline;
 
 class Buffer
 {
@@ -18,14 +41,97 @@ class Buffer
 		Buffer( Stage *pcStage, int nOutput );
 		~Buffer();
 
+		/* The watermarks, in packets.  The producer sleeps once the Buffer holds nMax packets & is woken
+		   when the consumer has taken it below nMin.  GetMinMax() includes any adaptive growth */
 		status_t SetMinMax( unsigned int nMin, unsigned int nMax );
+		void GetMinMax( unsigned int &nMin, unsigned int &nMax );
+
+		/* Watermarks in bytes, which replace the packet watermarks while they are set; 0, 0 clears them.
+		   The number of packets is still limited by BUFFER_RING_SIZE, so with small packets a Buffer may
+		   be full before it reaches either watermark.  It then counts as low only once the consumer has
+		   taken it below BUFFER_RING_SIZE - BUFFER_BATCH_SIZE packets.  The same goes for duration
+		   watermarks */
+		status_t SetByteWatermarks( size_t nLow, size_t nHigh );
+		void GetByteWatermarks( size_t &nLow, size_t &nHigh );
+		/* Watermarks in microseconds, which are turned into byte watermarks from the AudioPacketInfo of
+		   the packets as they arrive.  Until the first audio packet the packet watermarks apply */
+		status_t SetDurationWatermarks( bigtime_t nLow, bigtime_t nHigh );
+
+		/* Double the watermarks each time the consumer finds the Buffer empty, & halve them again once it
+		   hasn't for a while; see BUFFER_IDLE_LIMIT.  They never fall below what was set.  This should be
+		   called before the pipeline is started */
+		void SetAdaptive( bool bAdaptive );
+
+		/* The number of bytes of payload in the Buffer */
+		size_t GetBytes( void ){ return atomic_read( &m_nBytes ); };
+
+		/* Limit the payload held by every Buffer in the process to nBytes, up to 2GB, or 0 for no limit.
+		   Once it is reached no Buffer fills beyond its low watermark, so the Buffers that are below it can
+		   still fill & every pipeline carries on */
+		static void SetMemoryBudget( size_t nBytes );
+		static size_t GetMemoryBudget( void );
+		static size_t GetMemoryUsed( void );
+
+		/* The Stage that fills the Buffer */
+		Stage * GetStage( void ){ return m_pcStage; };
+
+		/* Fill the Buffer from a Scheduler instead of a thread of its own.  Must be called before Start() */
+		status_t SetScheduler( Scheduler *pcScheduler );
+		/* Fill the Buffer on the thread that needs the packets instead of a thread of its own: its consumer,
+		   or the thread that pushes packets into the Buffer it reads from.  Must be called before Start() */
+		status_t SetInline( void );
+
+		/* The Buffer is filled by Push() instead of asking its Stage for packets, E.g. for a source that
+		   receives its packets from the network.  Must be called before Start(); a push source can call it
+		   from Stage::SetOutputBuffer() */
+		status_t SetPushMode( void );
+		/* Add up to nCount packets to a push mode Buffer & then process them on the calling thread, by
+		   filling every downstream Buffer that is empty.  Blocks while the Buffer is full, unless bNoBlock
+		   is set.  Returns how many packets were added; the caller still owns the rest, as it does if the
+		   Buffer is paused.  Only one thread may push at a time */
+		size_t Push( Packet **ppcPackets, size_t nCount, bool bNoBlock = false );
+		/* There are no more packets to push */
+		void PushEnd( void );
+
+		/* Called by the Pipeline when pcBuffer is filled by a Stage which reads this Buffer */
+		void AddDownstream( Buffer *pcBuffer );
+
+		/* Has the stream ended?  A Stage that gets no packets from its upstream Buffer can ask, to tell the
+		   end of the stream from a Buffer that has nothing for it yet */
+		bool IsEnded( void ){ return false == m_bCanFill; };
+		bool IsRunning( void ){ return m_bIsRunning; };
 
 		status_t Start( void );
 		status_t Stop( void );
 
+		/* Used by Pipeline::Seek().  Pause() asks the producer to stop at the next safe point & WaitPaused()
+		   waits until it has.  While a Buffer is paused, the producer of a downstream Buffer that is waiting
+		   for a packet from it gives up, so that it can pause too.  A Buffer that has been stopped can't be
+		   paused & Pause() returns EBUSY.  Pauses nest, & the Buffer carries on after the last Resume() */
+		status_t Pause( void );
+		void WaitPaused( void );
+		/* Free every packet in a paused Buffer, returning how many there were.  The consumer must not be
+		   taking packets at the same time */
+		size_t Flush( Pipeline *pcPipeline );
+		/* Carry on filling, even if the stream had ended.  WaitPaused() must have been called first */
+		status_t Resume( void );
+
 		Packet * GetPacket( bool bNoBlock = false, bool bGet = true );
+		/* Take up to nCount packets at once, returning how many were taken.  Blocks until at least one
+		   packet is available unless bNoBlock is set.  With bGet false the packets are left in the Buffer */
+		size_t GetPackets( Packet **ppcPackets, size_t nCount, bool bNoBlock = false, bool bGet = true );
 		size_t GetCount( void );
 
+		/* Add up to nCount packets, returning how many were added.  The Buffer has a single producer, so
+		   this must only ever be called by whoever fills the Buffer */
+		size_t PutPackets( Packet **ppcPackets, size_t nCount );
+
+		/* Copy the counters.  The copy is taken without stopping the Buffer, so counters that are updated
+		   by the producer & the consumer may be a packet or so apart */
+		void GetStats( buffer_stats *psStats );
+		void GetStageStats( stage_stats *psStats );
+		void ResetStats( void );
+
 	private:
 		class BufferThread : public os::Thread
 		{
@@ -41,20 +147,105 @@ class Buffer
 		};
 		friend class BufferThread;
 
-		BufferThread *m_pcThread;
-		sem_id m_hLock;
-		sem_id m_hWait;
+		/* The Task that fills a Buffer which is driven by a Scheduler */
+		class BufferTask : public Task
+		{
+			public:
+				BufferTask( Buffer *pcParent ){ m_pcParent = pcParent; };
+				void Run( void );
+				void Cancel( void );
 
-		bool m_bIsRunning;
-		std::queue <Packet*> m_vpcQueue;
+			private:
+				Buffer *m_pcParent;
+		};
+		friend class BufferTask;
+
+		size_t GetSpace( void );
+		void PutAll( Packet **ppcPackets, size_t nCount );
+		/* Has the Buffer reached its high watermark, or the memory budget? */
+		bool IsFull( void );
+		/* Has the consumer taken the Buffer below its low watermark? */
+		bool IsLow( void );
+		/* Called by the consumer when it finds the Buffer empty, & when it has taken nCount packets.  These
+		   adapt the watermarks */
+		void Underrun( void );
+		void Adapt( size_t nCount );
+		/* Turn the duration watermarks into bytes for the format of pcInfo.  Called by the producer */
+		void SetFormat( PacketInfo *pcInfo );
+		/* Fill each downstream Buffer that is empty, & then the Buffers downstream of them */
+		void RunDownstream( void );
+		/* Ask the Stage for up to nMax packets, counting the call in m_sStageStats */
+		status_t Produce( Packet **ppcPackets, size_t nMax, size_t *pnCount );
+		/* The upstream Stage has no more packets */
+		void EndOfStream( void );
+		/* Called by the fill thread to wait for Resume() */
+		void Park( void );
+
+		/* Scheduler driven filling */
+		void Fill( void );
+		bool TryFill( void );
+		void RequestFill( void );
+
+		BufferThread *m_pcThread;
+		bool m_bInline;
+		bool m_bPush;
+		std::vector <Buffer*> m_vpcDownstream;
+
+		Scheduler *m_pcScheduler;
+		BufferTask *m_pcTask;
+		atomic_t m_nFilling;	/* Set while somebody is producing packets for the Buffer */
+		atomic_t m_nQueued;		/* Set while m_pcTask is queued on the Scheduler */
+		atomic_t m_nTaskRefs;	/* Non-zero while m_pcTask may still touch the Buffer */
+		sem_id m_hLock;		/* Serialises Start() & Stop() */
+		sem_id m_hWait;		/* The producer sleeps here when the ring is full */
+		sem_id m_hData;		/* The consumer sleeps here when the ring is empty */
+		sem_id m_hParked;	/* Posted by the fill thread each time it parks */
+		sem_id m_hResume;	/* The fill thread sleeps here while it is parked */
+
+		volatile bool m_bIsRunning;
+		volatile bool m_bPaused;
+		int m_nPauses;		/* Protected by m_hLock */
 
 		Stage *m_pcStage;
 		int m_nOutput;
 
 		unsigned int m_nMin, m_nMax;
-		sem_id m_hCount;
-
-		bool m_bCanFill;
+		volatile size_t m_nLowBytes, m_nHighBytes;	/* 0 if the packet watermarks apply */
+		bigtime_t m_nLowTime, m_nHighTime;			/* 0 if there are no duration watermarks */
+		PacketInfo *m_pcLastInfo;					/* Only used for comparison, by the producer */
+
+		bool m_bAdaptive;
+		volatile int m_nScale;		/* The watermarks are shifted left by this.  Only changed by the consumer */
+		unsigned int m_nHealthy;	/* Packets taken since the Buffer was last empty */
+
+		atomic_t m_nBytes;			/* Updated by both the producer & the consumer */
+		size_t m_nLastSize;			/* The size of the last packet added */
+
+		volatile bool m_bCanFill;
+
+		/* A single-producer, single-consumer ring of Packets.  m_nHead is only written by the consumer
+		   and m_nTail only by the producer, so neither needs a lock.  The semaphores are only touched
+		   when one side has to sleep, which is flagged in m_nConsumerWaiting & m_nProducerWaiting.
+
+		   The counters are kept next to the index of the side that updates them, so they stay single
+		   writer and don't share a cache line with the other side */
+		Packet *m_vpcRing[BUFFER_RING_SIZE];
+
+		uint8 m_anPad0[BUFFER_CACHE_LINE];
+		volatile uint32 m_nHead;
+		atomic_t m_nProducerWaiting;
+		uint64 m_nPacketsOut, m_nBytesOut;
+		uint64 m_nUnderruns;
+		bigtime_t m_nConsumerBlocked;
+		Histogram m_cGetLatency;
+		uint8 m_anPad1[BUFFER_CACHE_LINE];
+		volatile uint32 m_nTail;
+		atomic_t m_nConsumerWaiting;
+		uint64 m_nPacketsIn, m_nBytesIn;
+		uint64 m_nOverruns;
+		bigtime_t m_nProducerBlocked;
+		stage_stats m_sStageStats;
+		uint8 m_anPad2[BUFFER_CACHE_LINE];
 };
 
 }
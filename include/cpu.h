@@ -0,0 +1,21 @@
+#ifndef __F_MEDIA_CPU_H_
+#define __F_MEDIA_CPU_H_
+
+#include <atheos/types.h>
+
+namespace media
+{
+
+/* Instruction set extensions that are supported by both the CPU & the OS */
+enum cpu_feature
+{
+	CPU_SSE2 = 0x0001,
+	CPU_AVX2 = 0x0002
+};
+
+/* Return a mask of cpu_feature flags.  The CPU is only probed the first time */
+uint32 get_cpu_features( void );
+
+}
+
+#endif	/* __F_MEDIA_CPU_H_ */
@@ -3,6 +3,8 @@
 
 #include <util/string.h>
 
+#include <packet.h>
+
 namespace media
 {
 
@@ -40,6 +42,40 @@ class SourceInterface : public Interface
 		{
 			return ENOSYS;
 		};
+
+		/* Set the size of the packets produced by the source */
+		virtual status_t SetPacketSize( size_t nSize )
+		{
+			return ENOSYS;
+		};
+
+		/* Let the source choose a packet size between nMin & nMax, depending on how quickly the
+		   downstream Buffer is drained */
+		virtual status_t SetAdaptivePacketSize( size_t nMin, size_t nMax )
+		{
+			return ENOSYS;
+		};
+
+		/* Fill pcPacket with nSize bytes from nOffset, without moving the position of the stream.  A read
+		   that ends past the end of the data returns a short packet, & one that starts there returns an
+		   empty packet; any other failure is an error.  This may be called from several threads at once */
+		virtual status_t GetPacketAt( Packet *pcPacket, uint64 nOffset, size_t nSize )
+		{
+			return ENOSYS;
+		};
+
+		/* The largest nSize GetPacketAt() accepts, or 0 if there is no limit */
+		virtual size_t GetMaxPacketSize( void )
+		{
+			return 0;
+		};
+
+		/* Move the stream so that the next packet starts nOffset bytes from the start of the data.  This
+		   is only called while nothing is reading from the source.  See Pipeline::Seek() */
+		virtual status_t Seek( uint64 nOffset )
+		{
+			return ENOSYS;
+		};
 };
 
 class DemuxInterface : public Interface
@@ -59,6 +95,65 @@ class DemuxInterface : public Interface
 			return;
 		};
 
+		/* For offline processing: read the data in ranges of about nRangeSize bytes, nWorkers at a time,
+		   & deliver them in order.  The ranges are read straight from the source with GetPacketAt(), on
+		   nWorkers threads of the stage's own.  nWorkers == 0 turns batch mode off */
+		virtual status_t SetBatchMode( int nWorkers, size_t nRangeSize = 0 )
+		{
+			return ENOSYS;
+		};
+
+		/* Move the stream so that the next packet starts with the sample nTime microseconds in, by
+		   repositioning the source.  This is only called while nothing is reading from the demuxer.  See
+		   Pipeline::Seek() */
+		virtual status_t Seek( bigtime_t nTime )
+		{
+			return ENOSYS;
+		};
+};
+
+/* How an effect should trade quality for speed */
+typedef enum quality
+{
+	QUALITY_LOW,
+	QUALITY_MEDIUM,
+	QUALITY_HIGH
+} quality_t;
+
+class EffectInterface : public Interface
+{
+	public:
+		EffectInterface(){};
+		virtual ~EffectInterface(){};
+
+		virtual interface_t GetInputInterface( void )
+		{
+			return EFFECT;
+		};
+
+		/* Set the sample format produced by the effect.  The channels & sample rate follow the input */
+		virtual status_t SetOutputFormat( audio_format_t eFormat, uint32 nBitsPerSample )
+		{
+			return ENOSYS;
+		};
+
+		/* Set the sample rate produced by the effect */
+		virtual status_t SetOutputSampleRate( uint32 nSampleRate )
+		{
+			return ENOSYS;
+		};
+
+		virtual status_t SetQuality( quality_t eQuality )
+		{
+			return ENOSYS;
+		};
+
+		/* Set the matrix used to mix nInputs channels to nOutputs channels.  pvMatrix has a row of nInputs
+		   gains for each output channel */
+		virtual status_t SetChannelMatrix( uint32 nOutputs, uint32 nInputs, const float *pvMatrix )
+		{
+			return ENOSYS;
+		};
 };
 
 class DecodeInterface : public Interface
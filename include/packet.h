@@ -2,15 +2,30 @@
 #define __F_MEDIA_PACKET_H_
 
 #include <atheos/kdebug.h>
+#include <atheos/atomic.h>
 #include <string.h>
 
+#include <pool.h>
+
 namespace media
 {
 
+/* PacketInfo is reference counted so that one descriptor can be shared by every packet of a stream */
 class PacketInfo
 {
 	public:
-		PacketInfo(){};
+		PacketInfo(){ atomic_set( &m_nRefCount, 1 ); };
+		virtual ~PacketInfo(){};
+
+		void AddRef( void ){ atomic_inc( &m_nRefCount ); };
+		void Release( void )
+		{
+			if( atomic_dec_and_test( &m_nRefCount ) )
+				delete this;
+		};
+
+	private:
+		atomic_t m_nRefCount;
 };
 
 typedef enum audio_format
@@ -22,6 +37,8 @@ typedef enum audio_format
 	PCM_UNSIGNED_BE,
 	PCM_SIGNED_LE,
 	PCM_SIGNED_BE,
+	PCM_FLOAT_LE,		/* IEEE 754 floats, nominally between -1.0 & 1.0 */
+	PCM_FLOAT_BE,
 	OTHER
 } audio_format_t;
 
@@ -30,10 +47,54 @@ class AudioPacketInfo : public PacketInfo
 	public:
 		AudioPacketInfo(){};
 
+		/* Return the shared descriptor for the given format, with a reference held for the caller.  The
+		   same format always returns the same descriptor, so two formats can be compared by pointer.
+		   Shared descriptors must never be modified.  nValidBits == 0 means every bit is valid */
+		static AudioPacketInfo * Get( audio_format_t eFormat, uint32 nChannels, uint32 nSampleRate, uint32 nBitsPerSample,
+									  uint32 nValidBits = 0, uint32 nChannelMask = 0 );
+
 		audio_format_t eFormat;
 		uint32 nChannels;
 		uint32 nSampleRate;
-		uint32 nBitsPerSample;
+		uint32 nBitsPerSample;	/* The size of each sample: 24bit samples are packed into 3 bytes & 64bit floats are doubles */
+		uint32 nValidBits;		/* How many of the most significant bits of an integer sample are used */
+		uint32 nChannelMask;	/* The speaker of each channel, as in WAVE_FORMAT_EXTENSIBLE, or 0 if unknown */
+};
+
+/* A reference counted block of payload data, which may be shared by more than one Packet.  Blocks are
+   normally allocated from, and returned to, the PacketPool of the Pipeline */
+class PacketData
+{
+	public:
+		/* Allocate a block from the heap that is not associated with any pool */
+		static PacketData * Create( size_t nCapacity );
+		/* Wrap memory that is owned by someone else E.g. a memory mapped file.  pfRelease( pCookie ) is
+		   called when the last reference is released */
+		static PacketData * Wrap( uint8 *pBuffer, size_t nSize, void (*pfRelease)( void *pCookie ), void *pCookie );
+
+		uint8 * GetBuffer( void ){ return m_pBuffer; };
+		size_t GetCapacity( void ){ return m_nCapacity; };
+
+		void AddRef( void ){ atomic_inc( &m_nRefCount ); };
+		void Release( void );
+		bool IsShared( void ){ return atomic_read( &m_nRefCount ) > 1; };
+		/* Wrapped memory belongs to someone else and must not be written to */
+		bool IsWrapped( void ){ return m_pfRelease != NULL; };
+
+	private:
+		friend class PacketPool;
+		PacketData(){};
+		~PacketData(){};
+
+		atomic_t m_nRefCount;
+		PacketPool *m_pcPool;	/* The pool the block belongs to, or NULL if it was allocated from the heap */
+		int m_nClass;			/* Size class within m_pcPool */
+		uint8 *m_pBuffer;
+		size_t m_nCapacity;
+		PacketData *m_pcNext;	/* Free list link */
+
+		void (*m_pfRelease)( void *pCookie );	/* Set for wrapped memory */
+		void *m_pCookie;
 };
 
 class Packet
@@ -48,64 +109,209 @@ class Packet
 			OTHER
 		} PacketType;
 
+		/* Packet flags */
+		enum
+		{
+			FORMAT_CHANGED = 0x0001		/* The PacketInfo differs from that of the previous packet */
+		};
+
 		Packet( void )
 		{
 			m_eType = UNKNOWN;
+			m_nFlags = 0;
 			m_pcInfo = NULL;
-			m_pData = NULL;
+			m_pcData = NULL;
+			m_nOffset = 0;
 			m_nSize = 0;
+			m_pcPool = NULL;
+			m_pcNextFree = NULL;
 		};
 		Packet( const uint8 *pData, const size_t nSize, PacketType eType = UNKNOWN, PacketInfo *pcInfo = NULL )
 		{
 			m_eType = eType;
+			m_nFlags = 0;
 			m_pcInfo = pcInfo;
-			m_pData = NULL;
+			m_pcData = NULL;
+			m_nOffset = 0;
 			m_nSize = 0;
+			m_pcPool = NULL;
+			m_pcNextFree = NULL;
 
 			SetData( pData, nSize );
 		};
 		~Packet( void )
 		{
-			if( m_pcInfo )
-				delete( m_pcInfo );
-
-			if( m_pData )
-				delete m_pData;
+			Reset();
 		};
 
 		PacketType GetType( void ){ return m_eType; };
 		void SetType( PacketType eType ){ m_eType = eType; };
 
+		uint32 GetFlags( void ){ return m_nFlags; };
+		void SetFlags( uint32 nFlags ){ m_nFlags = nFlags; };
+
+		/* The packet takes over the callers reference to pcInfo */
 		PacketInfo * GetInfo( void ){ return m_pcInfo; };
-		void SetInfo( PacketInfo *pcInfo ){ m_pcInfo = pcInfo; };
+		void SetInfo( PacketInfo *pcInfo )
+		{
+			if( m_pcInfo )
+				m_pcInfo->Release();
+			m_pcInfo = pcInfo;
+		};
 
 		size_t GetDataSize( void ){ return m_nSize; };
-		const uint8 * GetData( void ){ return m_pData; };
+		const uint8 * GetData( void ){ return m_pcData ? m_pcData->GetBuffer() + m_nOffset : NULL; };
 		void SetData( const uint8 *pData, const size_t nSize )
 		{
-			if( m_pData )
-				delete m_pData;
+			uint8 *pBuffer = AllocData( nSize );
+			if( pBuffer )
+				memcpy( pBuffer, pData, nSize );
+		};
+
+		/* Make sure the packet has a payload of nSize bytes that only it references and return a pointer
+		   to it, so that a Stage can fill the packet in place.  The contents are undefined.  If the
+		   payload can't be allocated the packet is left empty and NULL is returned */
+		uint8 * AllocData( const size_t nSize )
+		{
+			if( m_pcData && ( m_pcData->IsShared() || m_pcData->IsWrapped() || m_pcData->GetCapacity() < nSize ) )
+			{
+				m_pcData->Release();
+				m_pcData = NULL;
+			}
+
+			m_nOffset = 0;
 			m_nSize = nSize;
-			if( m_nSize > 0 )
+			if( m_nSize == 0 )
+				return NULL;
+
+			if( NULL == m_pcData )
+				m_pcData = m_pcPool ? m_pcPool->AllocData( nSize ) : PacketData::Create( nSize );
+			if( NULL == m_pcData )
 			{
-				m_pData = new uint8[m_nSize];
-				m_pData = (uint8*)memcpy( m_pData, pData, m_nSize );
+				m_nSize = 0;
+				return NULL;
 			}
-			else
-				m_pData = NULL;
+			return m_pcData->GetBuffer();
+		};
+
+		/* The payload, if it is safe to modify in place: no other packet references it and it isn't memory
+		   owned by someone else.  Returns NULL otherwise, in which case the Stage must make a copy */
+		uint8 * GetWritableData( void )
+		{
+			if( NULL == m_pcData || m_pcData->IsShared() || m_pcData->IsWrapped() )
+				return NULL;
+			return m_pcData->GetBuffer() + m_nOffset;
 		};
 
+		/* Attach an existing payload.  The packet takes over the callers reference to pcData */
+		void SetPayload( PacketData *pcData, const size_t nOffset, const size_t nSize )
+		{
+			if( m_pcData )
+				m_pcData->Release();
+
+			m_pcData = pcData;
+			m_nOffset = nOffset;
+			m_nSize = nSize;
+		};
+
+		/* Shrink the payload E.g. after a short read into the buffer returned by AllocData() */
+		status_t SetDataSize( const size_t nSize )
+		{
+			if( nSize > m_nSize )
+				return EINVAL;
+			m_nSize = nSize;
+			return EOK;
+		};
+
+		/* A Packet is a window of m_nSize bytes at m_nOffset into its payload.  Several Packets may share
+		   the same payload, so none of the following ever copy any data */
+
+		/* Drop nFront bytes from the start and nBack bytes from the end of the packet */
+		status_t Trim( const size_t nFront, const size_t nBack = 0 )
+		{
+			if( nFront + nBack > m_nSize )
+				return EINVAL;
+			m_nOffset += nFront;
+			m_nSize -= nFront + nBack;
+			return EOK;
+		};
+
+		/* Make this packet a view of nSize bytes at nOffset into pcSource */
+		status_t Slice( Packet *pcSource, const size_t nOffset, const size_t nSize )
+		{
+			if( NULL == pcSource || nOffset + nSize > pcSource->m_nSize )
+				return EINVAL;
+
+			PacketData *pcData = pcSource->m_pcData;
+			if( pcData )
+				pcData->AddRef();
+			if( m_pcData )
+				m_pcData->Release();
+
+			if( pcSource->m_pcInfo )
+				pcSource->m_pcInfo->AddRef();
+			SetInfo( pcSource->m_pcInfo );
+
+			m_eType = pcSource->m_eType;
+			m_pcData = pcData;
+			m_nOffset = pcSource->m_nOffset + nOffset;
+			m_nSize = nSize;
+			return EOK;
+		};
+
+		/* Split the packet at nOffset.  pcTail becomes everything from nOffset onwards */
+		status_t Split( const size_t nOffset, Packet *pcTail )
+		{
+			if( nOffset > m_nSize )
+				return EINVAL;
+
+			status_t nError = pcTail->Slice( this, nOffset, m_nSize - nOffset );
+			if( nError != EOK )
+				return nError;
+
+			m_nSize = nOffset;
+			return EOK;
+		};
+
+		/* Release the payload & info so that the Packet can be recycled */
+		void Reset( void )
+		{
+			if( m_pcInfo )
+				m_pcInfo->Release();
+			m_pcInfo = NULL;
+
+			if( m_pcData )
+				m_pcData->Release();
+			m_pcData = NULL;
+
+			m_eType = UNKNOWN;
+			m_nFlags = 0;
+			m_nOffset = 0;
+			m_nSize = 0;
+		};
+
+		PacketPool * GetPool( void ){ return m_pcPool; };
+		void SetPool( PacketPool *pcPool ){ m_pcPool = pcPool; };
+
+		/* Assignment shares the payload rather than copying it */
 		Packet & operator=( const Packet &cPacket )
 		{
-			m_eType = cPacket.m_eType;
-			SetData( cPacket.m_pData, cPacket.m_nSize );
+			if( this != &cPacket )
+				Slice( const_cast<Packet*>( &cPacket ), 0, cPacket.m_nSize );
 			return( *this );
 		};
 	private:
+		friend class PacketPool;
+
 		PacketType m_eType;
+		uint32 m_nFlags;
 		PacketInfo *m_pcInfo;
-		uint8 *m_pData;
+		PacketData *m_pcData;
+		size_t m_nOffset;		/* Start of this packet within m_pcData */
 		size_t m_nSize;
+
+		PacketPool *m_pcPool;	/* Payloads are allocated from here if it is set */
+		Packet *m_pcNextFree;	/* Free list link */
 };
 
 }
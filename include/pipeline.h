@@ -2,18 +2,24 @@
 #define __F_MEDIA_PIPELINE_H_
 
 #include <stage.h>
+#include <stats.h>
 
 #include <atheos/areas.h>
 #include <atheos/types.h>
 #include <util/string.h>
 
 #include <list>
+#include <vector>
+#include <string>
+#include <tr1/unordered_map>
 
 namespace media
 {
 
 class Packet;
+class PacketPool;
 class Buffer;
+class Scheduler;
 
 /* We need to keep track of each Stage and it's associated Buffers. */
 class StageNode
@@ -51,6 +57,15 @@ class StageNode
 		/* Return the Buffer associated with the output interface nOutput */
 		Buffer * GetBuffer( int nOutput );
 
+		/* Copy the counters of the Stage & each of its Buffers */
+		void GetStats( stage_snapshot *psSnapshot );
+
+		/* The edges of the pipeline graph.  An edge runs from the stage that owns a Buffer to the stage
+		   that reads it */
+		void AddUpstream( StageNode *pcNode );
+		const std::vector <StageNode*> & GetUpstream( void ){ return m_vpcUpstream; };
+		const std::vector <StageNode*> & GetDownstream( void ){ return m_vpcDownstream; };
+
 	private:
 		Stage *m_pcStage;
 		int m_nBuffers;
@@ -58,6 +73,9 @@ class StageNode
 
 		/* An array of Buffers */
 		Buffer **m_vpcBuffers;
+
+		std::vector <StageNode*> m_vpcUpstream;
+		std::vector <StageNode*> m_vpcDownstream;
 };
 
 class Pipeline
@@ -66,17 +84,45 @@ class Pipeline
 		Pipeline( os::String cIdentifier );
 		virtual ~Pipeline();
 
+		/* Packets & their payloads are recycled through the pool owned by the Pipeline */
 		virtual Packet* AllocPacket( void );
 		virtual status_t FreePacket( Packet *pcPacket );
 
+		PacketPool * GetPool( void ){ return m_pcPool; };
+
+		/* Run the Buffers of any stages added from now on as Tasks on pcScheduler, instead of giving
+		   each Buffer a thread of its own.  The Pipeline does not own the Scheduler, which must not be
+		   deleted before the Pipeline is */
+		void SetScheduler( Scheduler *pcScheduler ){ m_pcScheduler = pcScheduler; };
+		Scheduler * GetScheduler( void ){ return m_pcScheduler; };
+
+		/* Fill the Buffers of any stages added from now on inline, on the thread that reads them or the
+		   thread that pushes packets into the pipeline, instead of giving each Buffer a thread of its own.
+		   A Scheduler takes precedence.  See Buffer::SetInline() & Buffer::Push() */
+		void SetInline( bool bInline ){ m_bInline = bInline; };
+		bool IsInline( void ){ return m_bInline; };
+
 		virtual os::String GetIdentifer( void ){ return m_cIdentifier; };
 
 		/* Start & Stop all of the buffers in the pipeline */
 		virtual status_t Start( void ){ return ENOSYS; };
 		virtual status_t Stop( void ){ return ENOSYS; };
 
+		/* Move every stream in the pipeline to nTime microseconds from the start.  The queued packets are
+		   thrown away & the demuxers reposition their sources, so nothing is read to get there.  This
+		   should be called while the pipeline is running, from the thread that reads the pipeline or
+		   while nothing else is reading it; the packets it has already taken are from the old position */
+		virtual status_t Seek( bigtime_t nTime ){ return ENOSYS; };
+
+		/* Copy the counters of every Stage & Buffer in the pipeline.  This may be called at any time,
+		   while the pipeline is running, and does not stop it.  See pipeline_snapshot::ToJSON() */
+		virtual status_t GetSnapshot( pipeline_snapshot *psSnapshot ){ return ENOSYS; };
+
 	protected:
 		os::String m_cIdentifier;
+		PacketPool *m_pcPool;
+		Scheduler *m_pcScheduler;
+		bool m_bInline;
 };
 
 class InputPipeline : public Pipeline
@@ -95,8 +141,25 @@ class InputPipeline : public Pipeline
 
 		status_t Start( void );
 		status_t Stop( void );
+		status_t Seek( bigtime_t nTime );
+
+		status_t GetSnapshot( pipeline_snapshot *psSnapshot );
 	private:
+		StageNode * FindStage( const os::String &cIdentifier );
+		bool IsUpstream( StageNode *pcNode, StageNode *pcOf );
+		const std::vector <StageNode*> & GetOrder( void );
+		status_t StartNode( StageNode *pcNode );
+
+		/* In the order they were added, which owns them */
 		std::list <StageNode *> m_vpcStages;
+
+		/* Every stage by identifier, & the number of stages added with each name */
+		std::tr1::unordered_map <std::string, StageNode*> m_cIndex;
+		std::tr1::unordered_map <std::string, int> m_cNameCount;
+
+		/* The stages with every upstream stage before the stages it feeds.  Rebuilt after a change */
+		std::vector <StageNode*> m_vpcOrder;
+		bool m_bOrderValid;
 };
 
 }
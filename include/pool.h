@@ -0,0 +1,72 @@
+
+#ifndef __F_MEDIA_POOL_H_
+#define __F_MEDIA_POOL_H_
+
+#include <atheos/types.h>
+#include <util/locker.h>
+
+namespace media
+{
+
+class Packet;
+class PacketData;
+
+/* Payloads are allocated from a fixed set of power-of-four size classes, from 256 bytes up to 1MB.
+   Anything larger than the largest class is allocated directly from the heap */
+#define POOL_CLASS_COUNT	7
+#define POOL_MIN_SHIFT		8
+#define POOL_MAX_SIZE		( 1 << ( POOL_MIN_SHIFT + 2 * ( POOL_CLASS_COUNT - 1 ) ) )
+
+/* Limits on how much memory the per-thread caches & the shared free lists may hold for each size class */
+#define POOL_CACHE_BYTES	( 64 * 1024 )
+#define POOL_FREE_BYTES		( 4 * 1024 * 1024 )
+
+/* How many Packets may be cached per thread, and on the shared free list */
+#define POOL_CACHE_PACKETS	32
+#define POOL_FREE_PACKETS	1024
+
+/* A PacketPool recycles Packets and their payloads.  Each Pipeline owns one.  Allocations are first
+   satisfied from a small cache private to the calling thread, then from the shared free lists and
+   finally from the heap, so in the steady state no allocation touches the heap or takes a lock. */
+class PacketPool
+{
+	public:
+		PacketPool();
+		~PacketPool();
+
+		/* Allocate a payload with room for at least nSize bytes.  The caller holds the only reference */
+		PacketData * AllocData( size_t nSize );
+		/* Called by PacketData::Release() when the last reference to a payload is dropped */
+		void FreeData( PacketData *pcData );
+
+		Packet * AllocPacket( void );
+		void FreePacket( Packet *pcPacket );
+
+		/* Pre-allocate nCount payloads of nSize bytes onto the shared free list */
+		status_t Reserve( size_t nSize, int nCount );
+
+		/* Release everything held in the calling thread's cache.  Threads owned by the library call
+		   this before they exit */
+		static void FlushThreadCache( void );
+
+	private:
+		static int GetClass( size_t nSize );
+		static size_t GetClassSize( int nClass );
+		static int GetCacheDepth( int nClass );
+
+		struct cache_entry * GetCache( void );
+		static void FreeEntry( struct cache_entry *psEntry );
+
+		uint32 m_nGeneration;		/* Unique for each pool; used to match the per-thread caches */
+
+		os::Locker m_cLock;			/* Protects the shared free lists */
+		PacketData *m_apcFree[POOL_CLASS_COUNT];
+		int m_anFree[POOL_CLASS_COUNT];
+		Packet *m_pcFreePackets;
+		int m_nFreePackets;
+};
+
+}
+
+#endif	/* __F_MEDIA_POOL_H_ */
+
@@ -0,0 +1,56 @@
+#ifndef __F_MEDIA_PUSH_H_
+#define __F_MEDIA_PUSH_H_
+
+#include <stage.h>
+
+#include <atheos/types.h>
+
+namespace media
+{
+
+class Packet;
+class Buffer;
+
+/* A source for packets that arrive by themselves, E.g. from a network receiver or a capture device.
+   Whoever receives them allocates each Packet with Pipeline::AllocPacket() & calls Push(), which carries
+   them through the downstream stages on the same thread while their Buffers are empty.  Nothing waits
+   inside GetPacket() for the next packet, so the source doesn't need a thread of its own.  See
+   Buffer::Push() */
+class PushSourceStage : public SourceStage
+{
+	public:
+		/* eInterface is the interface of the packets that are pushed */
+		PushSourceStage( interface_t eInterface = DEMUX );
+		~PushSourceStage();
+
+		os::String GetName( void ){ return "source/push"; };
+
+		interface_t GetInputInterface( void ){ return SOURCE; };
+		interface_t GetOutputInterface( void ){ return m_eInterface; };
+
+		bool Check( Packet *pcPacket ){ return true; };
+
+		int GetOutputCount( void ){ return 1; };
+		void SetOutputBuffer( Buffer *pcBuffer, int nOutput );
+
+		/* Packets are only ever pushed */
+		status_t GetPacket( Packet **ppcPacket, int nInterface ){ return ENOSYS; };
+
+		/* Can't connect us to anything upstream as we are SOURCE */
+		status_t Connect( Buffer *pcBuffer ){ return EINVAL; };
+
+		/* As Buffer::Push().  The caller still owns any packets that were not taken */
+		size_t Push( Packet **ppcPackets, size_t nCount, bool bNoBlock = false );
+		/* Returns EBUSY if the packet was not taken */
+		status_t Push( Packet *pcPacket, bool bNoBlock = false );
+		/* The end of the stream */
+		void End( void );
+
+	private:
+		Buffer *m_pcOutput;
+		interface_t m_eInterface;
+};
+
+}
+
+#endif	/* __F_MEDIA_PUSH_H_ */
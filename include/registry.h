@@ -0,0 +1,84 @@
+#ifndef __F_MEDIA_REGISTRY_H_
+#define __F_MEDIA_REGISTRY_H_
+
+#include <interface.h>
+
+#include <atheos/types.h>
+#include <atheos/image.h>
+#include <util/string.h>
+
+#include <vector>
+#include <string>
+#include <tr1/unordered_map>
+
+namespace media
+{
+
+class Stage;
+class Packet;
+
+/* A plugin may export
+
+	extern "C" int Probe( const void *pData, size_t nSize );
+
+   which looks at the first nSize bytes of a stream & returns how sure it is that it can handle it, without
+   a Stage being created.  It must be quick & must not keep pData */
+#define PROBE_NONE		0
+#define PROBE_LIKELY	50
+#define PROBE_CERTAIN	100
+
+typedef int (*probe_fn)( const void *pData, size_t nSize );
+
+/* What the registry knows about a plugin.  All of it is read once, when the plugin is added */
+struct plugin_info
+{
+	os::String cPath;
+	os::String cName;			/* From Stage::GetName() */
+	os::String cMimeType;		/* From GetInputMimeType(), for DEMUX stages */
+	interface_t eInputInterface;
+	interface_t eOutputInterface;
+
+	image_id hImage;
+	Stage * (*pfGetInstance)( void );
+	probe_fn pfProbe;			/* NULL if the plugin has no Probe() */
+};
+
+/* Finds the plugins in a directory & keeps them loaded, so that stages can be created & streams
+   recognised without loading anything again.  Scan() & AddPlugin() must not be called while another
+   thread is using the registry; everything else only reads it */
+class PluginRegistry
+{
+	public:
+		PluginRegistry();
+		~PluginRegistry();
+
+		/* Add every plugin in cDirectory.  Files that are not plugins are ignored, as are plugins that
+		   have already been added */
+		status_t Scan( os::String cDirectory );
+		status_t AddPlugin( os::String cPath );
+
+		int GetPluginCount( void ){ return m_vpsPlugins.size(); };
+		const plugin_info * GetPlugin( int nIndex );
+
+		const plugin_info * FindByName( const os::String &cName );
+
+		/* The first plugin with the input interface eInterface that takes cMimeType.  eInterface may be NONE
+		   to match any */
+		const plugin_info * FindByMimeType( const os::String &cMimeType, interface_t eInterface = NONE );
+
+		/* Find the plugin with the input interface eInterface that is most sure it can handle the stream
+		   which starts with pcPacket.  Only plugins without a Probe() are created to Check() the packet,
+		   & then only if no Probe() recognised it.  Returns NULL if nothing does */
+		const plugin_info * Probe( Packet *pcPacket, interface_t eInterface = DEMUX );
+
+		Stage * CreateStage( const plugin_info *psInfo );
+		Stage * CreateStage( const os::String &cName );
+
+	private:
+		std::vector <plugin_info*> m_vpsPlugins;
+		std::tr1::unordered_map <std::string, plugin_info*> m_cNames;
+};
+
+}
+
+#endif	/* __F_MEDIA_REGISTRY_H_ */
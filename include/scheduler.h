@@ -0,0 +1,78 @@
+
+#ifndef __F_MEDIA_SCHEDULER_H_
+#define __F_MEDIA_SCHEDULER_H_
+
+#include <atheos/types.h>
+#include <atheos/semaphore.h>
+#include <atheos/atomic.h>
+#include <util/thread.h>
+#include <util/locker.h>
+
+#include <deque>
+
+namespace media
+{
+
+/* A unit of work that can be run by the Scheduler.  The Scheduler does not own the Task */
+class Task
+{
+	public:
+		Task(){};
+		virtual ~Task(){};
+
+		virtual void Run( void ) = 0;
+
+		/* Called instead of Run() if the Scheduler is deleted while the Task is still queued, so that
+		   anything waiting for the Task can be released */
+		virtual void Cancel( void ){};
+};
+
+/* A fixed pool of worker threads that run Tasks.  Each worker has its own queue; a Task scheduled from
+   a worker goes onto that workers queue, and idle workers steal from the other queues.  One Scheduler
+   may be shared by any number of Pipelines, which must all be deleted before the Scheduler is. */
+class Scheduler
+{
+	public:
+		/* nWorkers == 0 creates one worker for each CPU */
+		Scheduler( int nWorkers = 0 );
+		~Scheduler();
+
+		status_t Schedule( Task *pcTask );
+
+		int GetWorkerCount( void ){ return m_nWorkers; };
+
+	private:
+		class Worker : public os::Thread
+		{
+			public:
+				Worker( Scheduler *pcParent, int nIndex );
+				~Worker();
+
+				int32 Run( void );
+
+			private:
+				friend class Scheduler;
+				Scheduler *m_pcParent;
+				int m_nIndex;
+
+				os::Locker m_cLock;		/* Protects m_vpcTasks */
+				std::deque <Task*> m_vpcTasks;
+		};
+		friend class Worker;
+
+		Task * GetTask( int nIndex );
+
+		int m_nWorkers;
+		Worker **m_vpcWorkers;
+
+		sem_id m_hWork;			/* Counts the queued Tasks */
+		sem_id m_hExit;			/* Posted by each worker as it exits */
+		volatile bool m_bQuit;
+
+		atomic_t m_nNext;		/* Round-robin queue for Tasks scheduled from outside the pool */
+};
+
+}
+
+#endif	/* __F_MEDIA_SCHEDULER_H_ */
+
@@ -41,10 +41,32 @@ class Stage
 		/* Return a packet from the output stream nInterface */
 		virtual status_t GetPacket( Packet **ppcPacket, int nInterface );
 
+		/* Return between 1 and nMax packets from the output stream nInterface.  *pnCount is set to the
+		   number returned.  The default returns a single packet from GetPacket() */
+		virtual status_t GetPackets( Packet **ppcPackets, size_t nMax, size_t *pnCount, int nInterface );
+
 		virtual void SetPipeline( Pipeline *pcPipeline )
 		{
 			m_pcPipeline = pcPipeline;
 		};
+		Pipeline * GetPipeline( void ){ return m_pcPipeline; };
+
+		/* Called by the Pipeline with the Buffer it has created for output nOutput */
+		virtual void SetOutputBuffer( Buffer *pcBuffer, int nOutput )
+		{
+		};
+
+		/* Called by Pipeline::Seek() once the Buffers have been paused.  A Stage that can sleep on anything
+		   other than its upstream Buffer must wake up & return from GetPackets() */
+		virtual void Interrupt( void )
+		{
+		};
+
+		/* Called by Pipeline::Seek() while nothing is running.  Drop any packets & state that were left
+		   over from the old position */
+		virtual void Flush( void )
+		{
+		};
 
 	protected:
 		Pipeline *m_pcPipeline;
@@ -81,6 +103,71 @@ class DemuxStage : public InputStage, public DemuxInterface
 		virtual ~DemuxStage(){};
 };
 
+/* The largest unit of samples ProcessUnits() can keep between packets: a frame of 32 float channels */
+#define EFFECT_MAX_UNIT_SIZE	128
+
+/* An EffectStage turns each packet from its upstream Buffer into at most one packet.  The upstream is read
+   in batches & the output is given its format here, so an effect only sets up for a new input format in
+   SetInputFormat() & transforms a packet in Process() */
+class EffectStage : public InputStage, public EffectInterface
+{
+	public:
+		EffectStage();
+		virtual ~EffectStage();
+
+		/* We can only provide a single stream of data */
+		virtual int GetOutputCount( void ){ return 1; };
+		virtual status_t GetPacket( Packet **ppcPacket, int nInterface );
+		virtual status_t GetPackets( Packet **ppcPackets, size_t nMax, size_t *pnCount, int nInterface );
+
+		virtual status_t Connect( Buffer *pcBuffer );
+		virtual void Flush( void ){ m_nCarry = 0; };
+
+	protected:
+		/* Called when a packet has a different info to the last one.  Set up for it & set m_pcOutputInfo to
+		   the format we produce from it */
+		virtual status_t SetInputFormat( PacketInfo *pcInfo )
+		{
+			return ENOSYS;
+		};
+
+		/* Transform pcPacket, which is always consumed.  *ppcOutput is NULL if it produced nothing */
+		virtual status_t Process( Packet *pcPacket, Packet **ppcOutput );
+
+		/* Called once the upstream Buffer has ended, to produce anything that is still held back */
+		virtual status_t Drain( Packet **ppcOutput )
+		{
+			*ppcOutput = NULL;
+			return EOK;
+		};
+
+		/* For Process(): turn the whole units of nInputSize bytes in pcPacket into units of nOutputSize bytes
+		   with TransformUnits().  A unit split between packets is kept until the rest of it arrives.  If
+		   bInPlace the packet is transformed in place when nothing else references it */
+		status_t ProcessUnits( Packet *pcPacket, size_t nInputSize, size_t nOutputSize, bool bInPlace, Packet **ppcOutput );
+		virtual void TransformUnits( const uint8 *pSrc, uint8 *pDst, size_t nCount )
+		{
+		};
+
+		/* Remember the info we are set up for.  We hold a reference to it, as otherwise a new info could be
+		   given its address & be taken for it.  NULL sets up again with the next packet */
+		void SetInputInfo( PacketInfo *pcInfo );
+
+		Buffer *m_pcUpstream;
+		PacketInfo *m_pcInputInfo;			/* The info of the last packet we processed, which we hold */
+		AudioPacketInfo *m_pcOutputInfo;	/* Shared by every packet we produce */
+
+		/* Packets need not end on a unit boundary, so the start of a split unit is kept for the next */
+		uint8 m_anCarry[EFFECT_MAX_UNIT_SIZE];
+		size_t m_nCarry;
+
+	private:
+		status_t ProcessPacket( Packet *pcPacket, Packet **ppcOutput );
+		void SetOutputInfo( Packet *pcOutput );
+
+		AudioPacketInfo *m_pcLastInfo;		/* The info given to the last packet we produced, which we hold */
+};
+
 class DecodeStage : public InputStage, public DecodeInterface
 {
 	public:
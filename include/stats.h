@@ -0,0 +1,110 @@
+#ifndef __F_MEDIA_STATS_H_
+#define __F_MEDIA_STATS_H_
+
+#include <atheos/types.h>
+#include <util/string.h>
+
+#include <vector>
+
+/* Number of buckets in a latency histogram.  Bucket 0 counts times under a microsecond and bucket n
+   counts times from 2^(n-1) up to 2^n microseconds; the last bucket also counts everything longer */
+#define STATS_HISTOGRAM_SIZE	24
+
+namespace media
+{
+
+/* A log2 histogram of times in microseconds.  It is cheap enough to update on every packet but it is not
+   thread safe: each Histogram must only have a single writer */
+class Histogram
+{
+	public:
+		Histogram(){ Reset(); };
+
+		void Add( bigtime_t nTime )
+		{
+			int nBucket = 0;
+			if( nTime > 0 )
+			{
+				nBucket = 64 - __builtin_clzll( (uint64)nTime );
+				if( nBucket >= STATS_HISTOGRAM_SIZE )
+					nBucket = STATS_HISTOGRAM_SIZE - 1;
+			}
+			m_anBuckets[nBucket]++;
+			m_nCount++;
+			m_nTotal += nTime;
+			if( nTime > m_nMax )
+				m_nMax = nTime;
+		};
+
+		void Reset( void );
+		void Merge( const Histogram &cOther );
+
+		/* An upper bound for the given percentile, from the bucket it falls in */
+		bigtime_t GetPercentile( int nPercent ) const;
+
+		os::String ToJSON( void ) const;
+
+		uint64 m_anBuckets[STATS_HISTOGRAM_SIZE];
+		uint64 m_nCount;
+		bigtime_t m_nTotal;
+		bigtime_t m_nMax;
+};
+
+/* A copy of the counters of a Buffer */
+struct buffer_stats
+{
+	int nOutput;
+	unsigned int nCount, nMin, nMax;	/* Fill level & watermarks when the copy was made */
+	size_t nBytes, nLowBytes, nHighBytes;	/* The byte watermarks are 0 unless they are set */
+
+	uint64 nPacketsIn, nBytesIn;		/* Added by the producer */
+	uint64 nPacketsOut, nBytesOut;		/* Taken by the consumer */
+	uint64 nUnderruns;					/* The consumer found the Buffer empty */
+	uint64 nOverruns;					/* The producer found the Buffer full */
+	bigtime_t nConsumerBlocked;			/* Time the consumer has slept waiting for a packet */
+	bigtime_t nProducerBlocked;			/* Time the producer has slept waiting for space */
+
+	Histogram cGetLatency;				/* Time spent in each Buffer::GetPackets() */
+};
+
+/* Counters for the calls a Buffer makes to its Stage */
+struct stage_stats
+{
+	uint64 nCalls;						/* Calls to Stage::GetPackets() */
+	uint64 nPackets, nBytes;			/* Returned by the Stage */
+	uint64 nErrors;						/* Calls which failed, including the end of the stream */
+
+	Histogram cLatency;					/* Time spent in each call */
+
+	stage_stats(){ Reset(); };
+
+	void Reset( void )
+	{
+		nCalls = nPackets = nBytes = nErrors = 0;
+		cLatency.Reset();
+	};
+	void Merge( const stage_stats &sOther );
+};
+
+struct stage_snapshot
+{
+	os::String cIdentifier;
+	os::String cName;
+
+	stage_stats sStage;					/* Summed over all of the outputs of the Stage */
+	std::vector<buffer_stats> vsBuffers;
+};
+
+/* The counters of every Stage & Buffer in a Pipeline at one moment */
+struct pipeline_snapshot
+{
+	os::String cIdentifier;
+	bigtime_t nTime;
+	std::vector<stage_snapshot> vsStages;
+
+	os::String ToJSON( void ) const;
+};
+
+}
+
+#endif	/* __F_MEDIA_STATS_H_ */
@@ -0,0 +1,99 @@
+#ifndef __F_MEDIA_TEE_H_
+#define __F_MEDIA_TEE_H_
+
+#include <stage.h>
+
+#include <atheos/types.h>
+#include <atheos/semaphore.h>
+
+#include <vector>
+
+namespace media
+{
+
+class Packet;
+class Buffer;
+
+/* Packets are kept until every output has taken them.  This is the most the slowest output can fall behind */
+#define TEE_QUEUE_SIZE	64
+
+/* What happens to an output that is TEE_QUEUE_SIZE packets behind when the others want a new packet */
+typedef enum tee_policy
+{
+	TEE_BLOCK,			/* The other outputs wait for it to catch up */
+	TEE_DROP_OLDEST,	/* It skips the oldest packet.  See TeeStage::GetDropped() */
+	TEE_DETACH			/* It reaches the end of its stream & the other outputs carry on without it */
+} tee_policy_t;
+
+/* Delivers every packet from its upstream Buffer to each of its outputs, so that several stages can
+   consume one stream.  Each output gets its own Packet, but they all share the one payload so nothing is
+   copied; a stage that wants to modify a packet must check Packet::GetWritableData() first.
+
+   Each output reads at its own pace.  Every output must be consumed, or it will fall behind & its policy
+   will apply: an unconnected output with the default policy stalls all of the others */
+class TeeStage : public InputStage
+{
+	public:
+		/* eInterface is the interface of the stream, which is the same on both sides */
+		TeeStage( int nOutputs, interface_t eInterface = OUTPUT );
+		~TeeStage();
+
+		os::String GetName( void ){ return "tee"; };
+
+		interface_t GetInputInterface( void ){ return m_eInterface; };
+		interface_t GetOutputInterface( void ){ return m_eInterface; };
+
+		bool Check( Packet *pcPacket ){ return NULL != pcPacket; };
+
+		/* Set the policy of output nOutput, or of every output if nOutput is -1.  The default is TEE_BLOCK */
+		status_t SetPolicy( tee_policy_t ePolicy, int nOutput = -1 );
+
+		/* The number of packets output nOutput has skipped under TEE_DROP_OLDEST */
+		uint64 GetDropped( int nOutput );
+		bool IsDetached( int nOutput );
+
+		int GetOutputCount( void ){ return m_vsOutputs.size(); };
+		status_t GetPacket( Packet **ppcPacket, int nInterface );
+		status_t GetPackets( Packet **ppcPackets, size_t nMax, size_t *pnCount, int nInterface );
+
+		status_t Connect( Buffer *pcBuffer );
+
+		void Interrupt( void );
+		void Flush( void );
+
+	private:
+		struct tee_output
+		{
+			uint32 nCursor;				/* The sequence number of the next packet for this output */
+			tee_policy_t ePolicy;
+			bool bDetached;
+			uint64 nDropped;
+			void *pLastInfo;			/* The PacketInfo of the last packet, only used for comparison */
+			sem_id hWake;				/* The output sleeps here while bWaiting is set */
+			bool bWaiting;
+		};
+
+		bool MakeSpace( void );
+		void Reclaim( void );
+		void Wake( void );
+		Packet * Deliver( struct tee_output *psOutput, Packet *pcSource );
+
+		Buffer *m_pcUpstream;
+		interface_t m_eInterface;
+
+		sem_id m_hLock;			/* Protects everything below */
+
+		/* The packets from m_nOldest to m_nNext - 1, by sequence number */
+		Packet *m_apcQueue[TEE_QUEUE_SIZE];
+		uint32 m_nOldest, m_nNext;
+
+		std::vector <tee_output> m_vsOutputs;
+
+		bool m_bFetching;		/* One output is reading from upstream, without the lock */
+		bool m_bEnded;			/* Upstream has no more packets */
+		bool m_bInterrupted;	/* Waiting outputs give up until Flush() */
+};
+
+}
+
+#endif	/* __F_MEDIA_TEE_H_ */
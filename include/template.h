@@ -0,0 +1,90 @@
+#ifndef __F_MEDIA_TEMPLATE_H_
+#define __F_MEDIA_TEMPLATE_H_
+
+#include <atheos/types.h>
+#include <atheos/image.h>
+#include <util/string.h>
+
+#include <vector>
+
+namespace media
+{
+
+class Stage;
+class InputPipeline;
+class Scheduler;
+
+/* Called by PipelineTemplate::Instantiate() with each new Stage before it is added to the pipeline, so
+   that it can be set up E.g. with SourceInterface::OpenUri().  An error abandons the pipeline */
+typedef status_t (*template_setup_fn)( const os::String &cIdentifier, Stage *pcStage, void *pCookie );
+
+/* Describes a pipeline once, so that copies of it can be made quickly.  Each plugin is loaded when it is
+   first added to the template & stays loaded until the template is deleted.  Every copy runs its Buffers
+   on the Scheduler of the template, whose workers wait for work between copies, so no threads are
+   created for a copy.  The template must outlive every copy */
+class PipelineTemplate
+{
+	public:
+		/* pcScheduler is shared by every copy & is not owned by the template.  If it is NULL the template
+		   creates a Scheduler of its own with nWorkers workers; see Scheduler::Scheduler() */
+		PipelineTemplate( os::String cIdentifier, Scheduler *pcScheduler = NULL, int nWorkers = 0 );
+		~PipelineTemplate();
+
+		/* Add a stage made by the plugin at cPath.  cIdentifier is set to the identifier the stage will
+		   have in every copy */
+		status_t AddStage( os::String cPath, os::String &cIdentifier );
+
+		/* As InputPipeline::Connect().  If bCheck is set the downstream stage must recognise the first
+		   packet from the upstream stage, or the copy is abandoned.  See Stage::Check().  Links may be
+		   added in any order, but the upstream stage of a checked link must be a source or be connected
+		   to one */
+		status_t Connect( os::String cDownstream, os::String cUpstream, int nOutput, bool bCheck = false );
+
+		/* Fill the PacketPool of each copy with nCount payloads of nSize bytes before it starts */
+		status_t SetReserve( size_t nSize, int nCount );
+
+		/* Make a copy of the pipeline.  Returns NULL if a stage could not be set up or connected */
+		InputPipeline * Instantiate( os::String cIdentifier, template_setup_fn pfSetup = NULL, void *pCookie = NULL );
+
+		Scheduler * GetScheduler( void ){ return m_pcScheduler; };
+
+	private:
+		struct template_plugin
+		{
+			os::String cPath;
+			image_id hImage;
+			Stage * (*pfGetInstance)( void );
+		};
+
+		struct template_stage
+		{
+			template_plugin *psPlugin;
+			os::String cName;
+			os::String cIdentifier;
+		};
+
+		struct template_link
+		{
+			size_t nDownstream, nUpstream;	/* Indices into m_vsStages */
+			int nOutput;
+			bool bCheck;
+		};
+
+		template_plugin * LoadPlugin( const os::String &cPath );
+		int FindStage( const os::String &cIdentifier );
+
+		os::String m_cIdentifier;
+		Scheduler *m_pcScheduler;
+		bool m_bOwnScheduler;
+
+		std::vector <template_plugin*> m_vpsPlugins;
+		std::vector <template_stage> m_vsStages;
+		std::vector <template_link> m_vsLinks;
+
+		size_t m_nReserveSize;
+		int m_nReserveCount;
+};
+
+}
+
+#endif	/* __F_MEDIA_TEMPLATE_H_ */
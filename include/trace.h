@@ -0,0 +1,120 @@
+#ifndef __F_MEDIA_TRACE_H_
+#define __F_MEDIA_TRACE_H_
+
+#include <atheos/types.h>
+#include <atheos/tld.h>
+#include <util/string.h>
+
+/* Number of events each thread can hold before it overwrites its oldest.  Must be a power of two */
+#define TRACE_RING_SIZE		16384
+
+namespace media
+{
+
+enum trace_event_t
+{
+	TRACE_STAGE_GET = 0,		/* A Buffer calls Stage::GetPackets() */
+	TRACE_BUFFER_PUSH,			/* Packets are added to a Buffer */
+	TRACE_BUFFER_POP,			/* Packets are taken from a Buffer */
+	TRACE_PRODUCER_SUSPEND,		/* A BufferThread sleeps because its Buffer is full */
+	TRACE_CONSUMER_WAIT,		/* A consumer sleeps because the Buffer is empty */
+	TRACE_PACKET_ALLOC,
+	TRACE_PACKET_FREE,
+	TRACE_EVENT_COUNT
+};
+
+enum trace_phase_t
+{
+	TRACE_BEGIN = 'B',
+	TRACE_END = 'E',
+	TRACE_INSTANT = 'i'
+};
+
+struct trace_event
+{
+	uint64 nTime;				/* CPU timestamp counter */
+	const void *pObject;		/* The Stage, Buffer or Packet */
+	uint32 nArg;				/* Usually a packet count */
+	uint16 nEvent;
+	uint8 nPhase;
+};
+
+/* Each thread records into a ring of its own, so recording needs no locks.  The rings are kept until
+   Clear(), even after their threads have exited, so that they can be exported */
+struct trace_ring
+{
+	struct trace_event asEvents[TRACE_RING_SIZE];
+	volatile uint32 nHead;		/* Number of events ever recorded; only written by the owner */
+	thread_id hThread;
+	bool bExited;
+	struct trace_ring *psNext;
+};
+
+/* An opt-in recorder of packet flow through the pipelines, which can be exported as Chrome trace JSON
+   and loaded into chrome://tracing or Perfetto.  The library only records events if it was built with
+   MEDIA_TRACE defined, and then only between Enable( true ) & Enable( false ) */
+class Trace
+{
+	public:
+		static void Enable( bool bEnable );
+		static bool IsEnabled( void ){ return s_bEnabled; };
+
+		static void Record( trace_event_t eEvent, trace_phase_t ePhase, const void *pObject, uint32 nArg )
+		{
+			if( false == s_bEnabled )
+				return;
+
+			struct trace_ring *psRing = (struct trace_ring*)get_tld( s_hTLD );
+			if( NULL == psRing )
+			{
+				psRing = AttachThread();
+				if( NULL == psRing )
+					return;
+			}
+
+			uint32 nHead = psRing->nHead;
+			struct trace_event *psEvent = &psRing->asEvents[nHead & ( TRACE_RING_SIZE - 1 )];
+			psEvent->nTime = GetTimestamp();
+			psEvent->pObject = pObject;
+			psEvent->nArg = nArg;
+			psEvent->nEvent = eEvent;
+			psEvent->nPhase = ePhase;
+			__asm__ __volatile__( "" : : : "memory" );
+			psRing->nHead = nHead + 1;
+		};
+
+		/* Write every recorded event to cPath.  Recording should be disabled first, or events recorded
+		   while the rings are written out may be torn */
+		static status_t Export( os::String cPath );
+
+		/* Forget every recorded event */
+		static void Clear( void );
+
+		static uint64 GetTimestamp( void )
+		{
+			uint32 nLow, nHigh;
+			__asm__ __volatile__( "rdtsc" : "=a" ( nLow ), "=d" ( nHigh ) );
+			return ( (uint64)nHigh << 32 ) | nLow;
+		};
+
+	private:
+		static struct trace_ring * AttachThread( void );
+		static void DetachThread( void *pRing );
+
+		static volatile bool s_bEnabled;
+		static int s_hTLD;
+};
+
+}
+
+#ifdef MEDIA_TRACE
+# define TRACE_BEGIN_EVENT( event, object )			media::Trace::Record( event, media::TRACE_BEGIN, object, 0 )
+# define TRACE_END_EVENT( event, object, arg )		media::Trace::Record( event, media::TRACE_END, object, arg )
+# define TRACE_EVENT( event, object, arg )			media::Trace::Record( event, media::TRACE_INSTANT, object, arg )
+#else
+# define TRACE_BEGIN_EVENT( event, object )			do {} while( 0 )
+# define TRACE_END_EVENT( event, object, arg )		do {} while( 0 )
+# define TRACE_EVENT( event, object, arg )			do {} while( 0 )
+#endif
+
+#endif	/* __F_MEDIA_TRACE_H_ */
@@ -1,7 +1,16 @@
 #include <buffer.h>
 #include <stage.h>
+#include <packet.h>
+#include <pool.h>
+#include <pipeline.h>
+#include <trace.h>
 
+#include <atheos/kdebug.h>
+
+#include <atheos/time.h>
+#include <atheos/tld.h>
 #include <unistd.h>
+#include <limits.h>
 
 using namespace os;
 using namespace media;
@@ -9,6 +18,39 @@ using namespace media;
 #include <iostream>
 using namespace std;
 
+/* Each ring index has exactly one writer, and x86 keeps stores in order with other stores & loads in
+   order with other loads, so the slot access only needs the compiler kept from moving it past the index
+   update */
+#define barrier() __asm__ __volatile__( "" : : : "memory" )
+
+/* x86 may still let a load pass an earlier store.  A side that updates its index & then looks at the
+   other side's waiting flag needs a full fence in between, or it can miss the flag while the other side
+   misses the new index, and both sleep */
+#define full_barrier() __sync_synchronize()
+
+/* The Buffer the calling thread is producing packets for, if any */
+static int g_hProducerTLD = alloc_tld( NULL );
+
+/* Should a consumer that is waiting for an empty Buffer give up?  Only a producer of another Buffer
+   does, while the Buffer is paused; anybody else waits for the packets that follow Resume() */
+static inline bool abandon_wait( bool bPaused )
+{
+	return bPaused && g_hProducerTLD >= 0 && NULL != get_tld( g_hProducerTLD );
+}
+
+/* The push mode Buffer the calling thread is processing packets for, if any.  That thread is the only
+   one that could add the packets it would wait for, so it never waits for an empty Buffer */
+static int g_hPushTLD = alloc_tld( NULL );
+
+static inline bool is_pushing( void )
+{
+	return g_hPushTLD >= 0 && NULL != get_tld( g_hPushTLD );
+}
+
+/* The payload held by every Buffer, & the most it may be.  See Buffer::SetMemoryBudget() */
+static atomic_t g_nMemoryUsed = ATOMIC_INIT( 0 );
+static volatile size_t g_nMemoryBudget = 0;
+
 Buffer::Buffer( Stage *pcStage, int nOutput )
 {
 	/* We hold a pointer to the associated stage but we do not own it */
@@ -17,31 +59,76 @@ Buffer::Buffer( Stage *pcStage, int nOutput )
 
 	m_nMin = 5;
 	m_nMax = 10;
+	m_nLowBytes = m_nHighBytes = 0;
+	m_nLowTime = m_nHighTime = 0;
+	m_pcLastInfo = NULL;
+
+	m_bAdaptive = false;
+	m_nScale = 0;
+	m_nHealthy = 0;
+
+	atomic_set( &m_nBytes, 0 );
+	m_nLastSize = 0;
 
 	m_hLock = create_semaphore( "buffer_lock", 1, SEMSTYLE_COUNTING );
 	m_hWait = create_semaphore( "buffer_wait", 0, SEMSTYLE_COUNTING );
-	m_hCount = create_semaphore( "buffer_count", 0, SEMSTYLE_COUNTING );
+	m_hData = create_semaphore( "buffer_data", 0, SEMSTYLE_COUNTING );
+	m_hParked = create_semaphore( "buffer_parked", 0, SEMSTYLE_COUNTING );
+	m_hResume = create_semaphore( "buffer_resume", 0, SEMSTYLE_COUNTING );
 
-	m_pcThread = new BufferThread( this );
+	m_nHead = m_nTail = 0;
+	atomic_set( &m_nProducerWaiting, 0 );
+	atomic_set( &m_nConsumerWaiting, 0 );
+
+	/* The thread is created by Start(), unless the Buffer is driven by a Scheduler */
+	m_pcThread = NULL;
+	m_bInline = false;
+	m_bPush = false;
 	m_bIsRunning = false;
+	m_bPaused = false;
+	m_nPauses = 0;
 	m_bCanFill = true;
+
+	m_pcScheduler = NULL;
+	m_pcTask = NULL;
+	atomic_set( &m_nFilling, 0 );
+	atomic_set( &m_nQueued, 0 );
+	atomic_set( &m_nTaskRefs, 0 );
+
+	ResetStats();
 }
 
 Buffer::~Buffer()
 {
-	if( m_bIsRunning )
-		m_pcThread->Stop();
-	/* XXXKV: Can we terminate a thread that has never been started? */
-	m_pcThread->Terminate();
+	if( m_pcThread )
+	{
+		if( m_bIsRunning )
+			m_pcThread->Stop();
+		m_pcThread->Terminate();
+	}
+
+	if( m_pcScheduler || m_bInline || m_bPush )
+	{
+		/* Wait for any fill that is queued or in progress to finish with us */
+		m_bIsRunning = false;
+		while( atomic_read( &m_nTaskRefs ) > 0 || atomic_read( &m_nFilling ) > 0 )
+			snooze( 1000 );
+		delete m_pcTask;
+	}
+
+	/* Whoever frees the packets that are left, they no longer count against the budget */
+	atomic_sub( &g_nMemoryUsed, atomic_read( &m_nBytes ) );
 
-	delete_semaphore( m_hCount );
+	delete_semaphore( m_hResume );
+	delete_semaphore( m_hParked );
+	delete_semaphore( m_hData );
 	delete_semaphore( m_hWait );
 	delete_semaphore( m_hLock );
 }
 
 status_t Buffer::SetMinMax( unsigned int nMin, unsigned int nMax )
 {
-	if( ( nMin < 1 || nMax < 1 ) || ( nMax < nMin ) )
+	if( ( nMin < 1 || nMax < 1 ) || ( nMax < nMin ) || nMax > BUFFER_RING_SIZE )
 		return EINVAL;
 
 	m_nMin = nMin;
@@ -50,14 +137,276 @@ status_t Buffer::SetMinMax( unsigned int nMin, unsigned int nMax )
 	return EOK;
 }
 
+void Buffer::GetMinMax( unsigned int &nMin, unsigned int &nMax )
+{
+	int nScale = m_nScale;
+
+	nMin = m_nMin << nScale;
+	nMax = m_nMax << nScale;
+	if( nMin > BUFFER_RING_SIZE )
+		nMin = BUFFER_RING_SIZE;
+	if( nMax > BUFFER_RING_SIZE )
+		nMax = BUFFER_RING_SIZE;
+}
+
+status_t Buffer::SetByteWatermarks( size_t nLow, size_t nHigh )
+{
+	if( nHigh < nLow || ( nHigh > 0 && nLow == 0 ) || nHigh > INT_MAX )
+		return EINVAL;
+
+	m_nLowTime = m_nHighTime = 0;
+	m_nLowBytes = nLow;
+	m_nHighBytes = nHigh;
+
+	return EOK;
+}
+
+void Buffer::GetByteWatermarks( size_t &nLow, size_t &nHigh )
+{
+	int nScale = m_nScale;
+	uint64 nScaledLow = (uint64)m_nLowBytes << nScale;
+	uint64 nScaledHigh = (uint64)m_nHighBytes << nScale;
+
+	nLow = nScaledLow > INT_MAX ? INT_MAX : nScaledLow;
+	nHigh = nScaledHigh > INT_MAX ? INT_MAX : nScaledHigh;
+}
+
+status_t Buffer::SetDurationWatermarks( bigtime_t nLow, bigtime_t nHigh )
+{
+	if( nHigh < nLow || ( nHigh > 0 && nLow <= 0 ) )
+		return EINVAL;
+
+	m_nLowBytes = m_nHighBytes = 0;
+	m_nLowTime = nLow;
+	m_nHighTime = nHigh;
+
+	/* Work the bytes out again from the next packet */
+	m_pcLastInfo = NULL;
+
+	return EOK;
+}
+
+void Buffer::SetFormat( PacketInfo *pcInfo )
+{
+	m_pcLastInfo = pcInfo;
+
+	AudioPacketInfo *pcAudioInfo = dynamic_cast<AudioPacketInfo*>( pcInfo );
+	if( NULL == pcAudioInfo )
+		return;
+
+	uint64 nBytesPerSecond = (uint64)pcAudioInfo->nSampleRate * pcAudioInfo->nChannels * pcAudioInfo->nBitsPerSample / 8;
+	if( nBytesPerSecond == 0 )
+		return;
+
+	uint64 nLow = m_nLowTime * nBytesPerSecond / 1000000;
+	uint64 nHigh = m_nHighTime * nBytesPerSecond / 1000000;
+	if( nLow == 0 )
+		nLow = 1;
+	if( nHigh > INT_MAX )
+		nHigh = INT_MAX;
+	if( nLow > nHigh )
+		nLow = nHigh;
+
+	/* Make sure the consumer never sees a low watermark above the high one */
+	if( nLow > m_nHighBytes )
+	{
+		m_nHighBytes = nHigh;
+		m_nLowBytes = nLow;
+	}
+	else
+	{
+		m_nLowBytes = nLow;
+		m_nHighBytes = nHigh;
+	}
+}
+
+void Buffer::SetAdaptive( bool bAdaptive )
+{
+	m_bAdaptive = bAdaptive;
+	m_nScale = 0;
+	m_nHealthy = 0;
+}
+
+void Buffer::SetMemoryBudget( size_t nBytes )
+{
+	g_nMemoryBudget = nBytes > INT_MAX ? INT_MAX : nBytes;
+}
+
+size_t Buffer::GetMemoryBudget( void )
+{
+	return g_nMemoryBudget;
+}
+
+size_t Buffer::GetMemoryUsed( void )
+{
+	int nUsed = atomic_read( &g_nMemoryUsed );
+	return nUsed > 0 ? nUsed : 0;
+}
+
+status_t Buffer::SetScheduler( Scheduler *pcScheduler )
+{
+	lock_semaphore( m_hLock );
+
+	if( m_bIsRunning || m_pcThread || m_pcScheduler )
+	{
+		unlock_semaphore( m_hLock );
+		return EBUSY;
+	}
+
+	m_pcScheduler = pcScheduler;
+	if( m_pcScheduler )
+		m_pcTask = new BufferTask( this );
+
+	unlock_semaphore( m_hLock );
+
+	return EOK;
+}
+
+status_t Buffer::SetInline( void )
+{
+	lock_semaphore( m_hLock );
+
+	if( m_bIsRunning || m_pcThread )
+	{
+		unlock_semaphore( m_hLock );
+		return EBUSY;
+	}
+	m_bInline = true;
+
+	unlock_semaphore( m_hLock );
+
+	return EOK;
+}
+
+status_t Buffer::SetPushMode( void )
+{
+	lock_semaphore( m_hLock );
+
+	if( m_bIsRunning || m_pcThread )
+	{
+		unlock_semaphore( m_hLock );
+		return EBUSY;
+	}
+	m_bPush = true;
+
+	unlock_semaphore( m_hLock );
+
+	return EOK;
+}
+
+void Buffer::AddDownstream( Buffer *pcBuffer )
+{
+	lock_semaphore( m_hLock );
+	m_vpcDownstream.push_back( pcBuffer );
+	unlock_semaphore( m_hLock );
+}
+
+size_t Buffer::Push( Packet **ppcPackets, size_t nCount, bool bNoBlock )
+{
+	if( false == m_bPush )
+		return 0;
+
+	void *pPrevious = NULL;
+	if( g_hPushTLD >= 0 )
+	{
+		pPrevious = get_tld( g_hPushTLD );
+		set_tld( g_hPushTLD, this );
+	}
+
+	size_t nPushed = 0;
+	while( nPushed < nCount && m_bIsRunning && m_bCanFill )
+	{
+		/* Claim the Buffer, so that WaitPaused() waits for us.  Pause() may have looked at m_nFilling
+		   before we claimed it */
+		atomic_swap( &m_nFilling, 1 );
+		if( m_bPaused )
+		{
+			atomic_swap( &m_nFilling, 0 );
+			break;
+		}
+
+		size_t nSpace = GetSpace();
+		if( nSpace > nCount - nPushed )
+			nSpace = nCount - nPushed;
+		if( nSpace > 0 )
+			nPushed += PutPackets( ppcPackets + nPushed, nSpace );
+		atomic_swap( &m_nFilling, 0 );
+
+		if( nSpace > 0 )
+			continue;
+
+		/* Give the packets to whoever is downstream before we wait for them to be taken */
+		m_nOverruns++;
+		RunDownstream();
+		if( false == IsFull() )
+			continue;
+		if( bNoBlock )
+			break;
+
+		bigtime_t nBlocked = get_system_time();
+		TRACE_BEGIN_EVENT( TRACE_PRODUCER_SUSPEND, this );
+		atomic_swap( &m_nProducerWaiting, 1 );
+		if( m_bPaused || false == m_bIsRunning )
+		{
+			/* Pause() or Stop() may have cleared the flag already, in which case they also post m_hWait */
+			if( atomic_swap( &m_nProducerWaiting, 0 ) == 0 )
+				lock_semaphore( m_hWait );
+		}
+		else if( false == IsLow() )
+			lock_semaphore( m_hWait );
+		else if( atomic_swap( &m_nProducerWaiting, 0 ) == 0 )
+			lock_semaphore( m_hWait );
+		TRACE_END_EVENT( TRACE_PRODUCER_SUSPEND, this, 0 );
+		m_nProducerBlocked += get_system_time() - nBlocked;
+	}
+
+	if( nPushed > 0 )
+		RunDownstream();
+
+	if( g_hPushTLD >= 0 )
+		set_tld( g_hPushTLD, pPrevious );
+
+	return nPushed;
+}
+
+void Buffer::PushEnd( void )
+{
+	if( false == m_bPush )
+		return;
+
+	EndOfStream();
+
+	/* Nothing waits for us now, so the downstream Buffers see the end of the stream */
+	RunDownstream();
+	PacketPool::FlushThreadCache();
+}
+
+void Buffer::RunDownstream( void )
+{
+	for( size_t i = 0; i < m_vpcDownstream.size(); i++ )
+	{
+		Buffer *pcBuffer = m_vpcDownstream[i];
+		if( pcBuffer->GetCount() == 0 && pcBuffer->TryFill() )
+			pcBuffer->RunDownstream();
+	}
+}
+
 status_t Buffer::Start( void )
 {
 	lock_semaphore( m_hLock );
 
 	if( false == m_bIsRunning )
 	{
-		m_pcThread->Start();
 		m_bIsRunning = true;
+
+		if( m_pcScheduler )
+			RequestFill();
+		else if( false == m_bInline && false == m_bPush )
+		{
+			if( NULL == m_pcThread )
+				m_pcThread = new BufferThread( this );
+			m_pcThread->Start();
+		}
 	}
 	unlock_semaphore( m_hLock );
 
@@ -70,43 +419,549 @@ status_t Buffer::Stop( void )
 
 	if( m_bIsRunning )
 	{
-		m_pcThread->Stop();
+		/* A scheduled fill sees m_bIsRunning and stops by itself */
+		if( m_pcThread )
+			m_pcThread->Stop();
 		m_bIsRunning = false;
+
+		/* Don't leave anybody pushing waiting for space */
+		if( m_bPush && atomic_swap( &m_nProducerWaiting, 0 ) == 1 )
+			unlock_semaphore( m_hWait );
 	}
 	unlock_semaphore( m_hLock );
 
 	return EOK;
 }
 
-Packet * Buffer::GetPacket( bool bNoBlock, bool bGet )
+status_t Buffer::Pause( void )
 {
-	if( ( bNoBlock || ( m_bCanFill == false ) ) && GetCount() == 0  )
-		return NULL;
+	lock_semaphore( m_hLock );
 
-	/* Wait for a packet */
-	lock_semaphore( m_hCount );
+	/* A stopped fill thread may be anywhere, so we can't know when it would be safe */
+	if( m_pcThread && false == m_bIsRunning )
+	{
+		unlock_semaphore( m_hLock );
+		return EBUSY;
+	}
 
-	/* Take the oldest packet from the front of the queue */
-	lock_semaphore( m_hLock );
+	if( m_nPauses++ == 0 )
+	{
+		m_bPaused = true;
 
-	Packet *pcPacket = m_vpcQueue.front();
-	if( bGet )
-		m_vpcQueue.pop();
-	else
-		unlock_semaphore( m_hCount );
+		/* Wake both sides, so that the producer can park & a producer waiting for us can give up.  The
+		   atomic_swap() is also the barrier that makes m_bPaused visible before we look at m_nFilling */
+		if( atomic_swap( &m_nProducerWaiting, 0 ) == 1 )
+			unlock_semaphore( m_hWait );
+		if( atomic_swap( &m_nConsumerWaiting, 0 ) == 1 )
+			unlock_semaphore( m_hData );
+	}
 
-	/* If we're below the threshold, start re-filling the buffer */
-	if( GetCount() < m_nMin )
-		wakeup_sem( m_hWait, true );
+	unlock_semaphore( m_hLock );
+
+	return EOK;
+}
+
+void Buffer::WaitPaused( void )
+{
+	if( false == m_bPaused )
+		return;
+
+	/* A scheduled, inline or pushed fill sees m_bPaused and stops by itself */
+	if( m_pcScheduler || m_bInline || m_bPush )
+	{
+		while( atomic_read( &m_nFilling ) > 0 )
+			snooze( 1000 );
+	}
+	else if( m_pcThread )
+	{
+		/* Leave the semaphore posted for anybody else who has paused us; Resume() takes it back */
+		lock_semaphore( m_hParked );
+		unlock_semaphore( m_hParked );
+	}
+}
+
+size_t Buffer::Flush( Pipeline *pcPipeline )
+{
+	uint32 nHead = m_nHead;
+	size_t nCount = m_nTail - nHead;
+	barrier();
+
+	/* The flushed packets count as taken, so that the difference between the counters is still the
+	   number of packets in the Buffer */
+	size_t nBytes = 0;
+	for( size_t i = 0; i < nCount; i++ )
+	{
+		Packet *pcPacket = m_vpcRing[( nHead + i ) & ( BUFFER_RING_SIZE - 1 )];
+		nBytes += pcPacket->GetDataSize();
+		pcPipeline->FreePacket( pcPacket );
+	}
+	m_nPacketsOut += nCount;
+	m_nBytesOut += nBytes;
+	atomic_sub( &m_nBytes, nBytes );
+	atomic_sub( &g_nMemoryUsed, nBytes );
+
+	barrier();
+	m_nHead = nHead + nCount;
 
+	return nCount;
+}
+
+status_t Buffer::Resume( void )
+{
+	lock_semaphore( m_hLock );
+
+	if( m_nPauses > 0 && --m_nPauses == 0 )
+	{
+		m_bPaused = false;
+		m_bCanFill = true;
+
+		if( m_pcScheduler )
+			RequestFill();
+		else if( m_pcThread )
+		{
+			lock_semaphore( m_hParked );
+			unlock_semaphore( m_hResume );
+		}
+	}
 	unlock_semaphore( m_hLock );
 
+	return EOK;
+}
+
+void Buffer::Park( void )
+{
+	TRACE_BEGIN_EVENT( TRACE_PRODUCER_SUSPEND, this );
+	unlock_semaphore( m_hParked );
+	lock_semaphore( m_hResume );
+	TRACE_END_EVENT( TRACE_PRODUCER_SUSPEND, this, 0 );
+}
+
+Packet * Buffer::GetPacket( bool bNoBlock, bool bGet )
+{
+	Packet *pcPacket;
+
+	if( GetPackets( &pcPacket, 1, bNoBlock, bGet ) == 0 )
+		return NULL;
 	return pcPacket;
 }
 
+size_t Buffer::GetPackets( Packet **ppcPackets, size_t nCount, bool bNoBlock, bool bGet )
+{
+	if( nCount == 0 )
+		return 0;
+
+	/* A thread that is pushing is only processing what it has already pushed, so it can't underrun */
+	bool bPushing = is_pushing();
+
+	if( ( bNoBlock || ( m_bCanFill == false ) || abandon_wait( m_bPaused ) || ( m_bPush && bPushing ) ) && GetCount() == 0  )
+	{
+		if( m_bCanFill && bGet && false == bPushing )
+			Underrun();
+		return 0;
+	}
+
+	bigtime_t nStart = get_system_time();
+
+	if( m_nTail == m_nHead && bGet && false == bPushing )
+		Underrun();
+
+	/* Wait for a packet.  We only sleep if the ring is really empty */
+	while( m_nTail == m_nHead )
+	{
+		/* If nobody is filling a scheduled or inline Buffer we fill it ourselves, rather than wait for a
+		   worker.  While pushing we only take what is already there, or what that made */
+		bool bFilled = TryFill();
+		if( bPushing && m_nTail == m_nHead )
+			return 0;
+		if( bFilled || bPushing )
+			continue;
+
+		/* Flag that we are about to sleep and check again; atomic_swap() is a full barrier so either we
+		   see the new packet or the producer sees our flag and wakes us */
+		atomic_swap( &m_nConsumerWaiting, 1 );
+		if( m_nTail != m_nHead || m_bCanFill == false || abandon_wait( m_bPaused ) )
+		{
+			/* If the producer has already cleared the flag then it will also post m_hData, so absorb it */
+			if( atomic_swap( &m_nConsumerWaiting, 0 ) == 0 )
+				lock_semaphore( m_hData );
+
+			if( m_nTail == m_nHead )
+				return 0;
+			break;
+		}
+
+		bigtime_t nBlocked = get_system_time();
+		TRACE_BEGIN_EVENT( TRACE_CONSUMER_WAIT, this );
+		lock_semaphore( m_hData );
+		TRACE_END_EVENT( TRACE_CONSUMER_WAIT, this, 0 );
+		m_nConsumerBlocked += get_system_time() - nBlocked;
+	}
+
+	/* Take as many of the oldest packets from the front of the queue as we can */
+	uint32 nHead = m_nHead;
+	size_t nAvailable = m_nTail - nHead;
+	if( nCount > nAvailable )
+		nCount = nAvailable;
+	barrier();
+
+	for( size_t i = 0; i < nCount; i++ )
+		ppcPackets[i] = m_vpcRing[( nHead + i ) & ( BUFFER_RING_SIZE - 1 )];
+	if( false == bGet )
+		return nCount;
+
+	barrier();
+	m_nHead = nHead + nCount;
+	full_barrier();
+
+	size_t nBytes = 0;
+	for( size_t i = 0; i < nCount; i++ )
+		nBytes += ppcPackets[i]->GetDataSize();
+	atomic_sub( &m_nBytes, nBytes );
+	atomic_sub( &g_nMemoryUsed, nBytes );
+
+	m_nPacketsOut += nCount;
+	m_nBytesOut += nBytes;
+	m_cGetLatency.Add( get_system_time() - nStart );
+	TRACE_EVENT( TRACE_BUFFER_POP, this, nCount );
+
+	if( m_bAdaptive )
+		Adapt( nCount );
+
+	/* If we're below the threshold, start re-filling the buffer */
+	if( m_pcScheduler && false == m_bPush )
+	{
+		if( IsLow() )
+			RequestFill();
+	}
+	else if( atomic_read( &m_nProducerWaiting ) && IsLow() )
+		if( atomic_swap( &m_nProducerWaiting, 0 ) == 1 )
+			unlock_semaphore( m_hWait );
+
+	return nCount;
+}
+
 size_t Buffer::GetCount( void )
 {
-	return get_semaphore_count( m_hCount );
+	return m_nTail - m_nHead;
+}
+
+size_t Buffer::PutPackets( Packet **ppcPackets, size_t nCount )
+{
+	uint32 nTail = m_nTail;
+	size_t nSpace = BUFFER_RING_SIZE - ( nTail - m_nHead );
+	if( nCount > nSpace )
+		nCount = nSpace;
+
+	/* Count the packets first; once they are in the ring the consumer may free them */
+	size_t nBytes = 0;
+	for( size_t i = 0; i < nCount; i++ )
+	{
+		m_vpcRing[( nTail + i ) & ( BUFFER_RING_SIZE - 1 )] = ppcPackets[i];
+		nBytes += ppcPackets[i]->GetDataSize();
+
+		if( m_nHighTime > 0 && ppcPackets[i]->GetInfo() != m_pcLastInfo )
+			SetFormat( ppcPackets[i]->GetInfo() );
+	}
+	if( nCount > 0 )
+		m_nLastSize = ppcPackets[nCount - 1]->GetDataSize();
+
+	m_nPacketsIn += nCount;
+	m_nBytesIn += nBytes;
+	atomic_add( &m_nBytes, nBytes );
+	atomic_add( &g_nMemoryUsed, nBytes );
+	barrier();
+	m_nTail = nTail + nCount;
+	full_barrier();
+	TRACE_EVENT( TRACE_BUFFER_PUSH, this, nCount );
+
+	/* Wake the consumer if it is waiting for a packet */
+	if( atomic_read( &m_nConsumerWaiting ) && atomic_swap( &m_nConsumerWaiting, 0 ) == 1 )
+		unlock_semaphore( m_hData );
+
+	return nCount;
+}
+
+/* Add packets that were made to fit.  Only this producer adds to the ring, so they always do; anything
+   that doesn't goes back to the pool rather than being lost */
+void Buffer::PutAll( Packet **ppcPackets, size_t nCount )
+{
+	size_t nPut = PutPackets( ppcPackets, nCount );
+	if( nPut == nCount )
+		return;
+
+	dbprintf( "%s: %u packets did not fit\n", __FUNCTION__, (unsigned int)( nCount - nPut ) );
+	Pipeline *pcPipeline = m_pcStage ? m_pcStage->GetPipeline() : NULL;
+	for( size_t i = nPut; pcPipeline && i < nCount; i++ )
+		pcPipeline->FreePacket( ppcPackets[i] );
+}
+
+/* How many packets the producer may add before the Buffer reaches its maximum */
+size_t Buffer::GetSpace( void )
+{
+	if( IsFull() )
+		return 0;
+
+	size_t nCount = GetCount();
+	size_t nSpace;
+
+	if( m_nHighBytes > 0 )
+	{
+		/* Guess from the size of the last packet, so that a batch doesn't overshoot by much */
+		size_t nLow, nHigh, nBytes = GetBytes();
+		GetByteWatermarks( nLow, nHigh );
+		nSpace = nHigh > nBytes && m_nLastSize > 0 ? ( nHigh - nBytes + m_nLastSize - 1 ) / m_nLastSize : 1;
+		if( nSpace > BUFFER_RING_SIZE - nCount )
+			nSpace = BUFFER_RING_SIZE - nCount;
+	}
+	else
+	{
+		unsigned int nMin, nMax;
+		GetMinMax( nMin, nMax );
+		nSpace = nCount < nMax ? nMax - nCount : 0;
+	}
+
+	return nSpace > BUFFER_BATCH_SIZE ? BUFFER_BATCH_SIZE : nSpace;
+}
+
+bool Buffer::IsFull( void )
+{
+	size_t nCount = GetCount();
+	if( nCount >= BUFFER_RING_SIZE )
+		return true;
+
+	bool bFull;
+	if( m_nHighBytes > 0 )
+	{
+		size_t nLow, nHigh;
+		GetByteWatermarks( nLow, nHigh );
+		bFull = GetBytes() >= nHigh;
+	}
+	else
+	{
+		unsigned int nMin, nMax;
+		GetMinMax( nMin, nMax );
+		bFull = nCount >= nMax;
+	}
+
+	/* Over budget we only fill to the low watermark */
+	if( false == bFull && g_nMemoryBudget > 0 && GetMemoryUsed() >= g_nMemoryBudget )
+		bFull = false == IsLow();
+
+	return bFull;
+}
+
+bool Buffer::IsLow( void )
+{
+	if( m_nHighBytes > 0 )
+	{
+		/* With small packets the ring may fill before the bytes reach the low watermark.  The ring then
+		   stands in for it, so that the producer sleeps until there is room for a batch */
+		if( GetCount() > BUFFER_RING_SIZE - BUFFER_BATCH_SIZE )
+			return false;
+
+		size_t nLow, nHigh;
+		GetByteWatermarks( nLow, nHigh );
+		return GetBytes() < nLow;
+	}
+
+	unsigned int nMin, nMax;
+	GetMinMax( nMin, nMax );
+	return GetCount() < nMin;
+}
+
+void Buffer::Underrun( void )
+{
+	m_nUnderruns++;
+	if( false == m_bAdaptive )
+		return;
+
+	/* Don't grow into memory that the other Buffers need */
+	m_nHealthy = 0;
+	if( m_nScale < BUFFER_MAX_SCALE && ( g_nMemoryBudget == 0 || GetMemoryUsed() < g_nMemoryBudget ) )
+		m_nScale++;
+}
+
+void Buffer::Adapt( size_t nCount )
+{
+	if( m_nScale == 0 )
+		return;
+
+	unsigned int nMin, nMax;
+	GetMinMax( nMin, nMax );
+	m_nHealthy += nCount;
+	if( m_nHealthy >= BUFFER_IDLE_LIMIT * nMax )
+	{
+		m_nHealthy = 0;
+		m_nScale--;
+	}
+}
+
+void Buffer::GetStats( buffer_stats *psStats )
+{
+	psStats->nOutput = m_nOutput;
+	psStats->nCount = GetCount();
+	GetMinMax( psStats->nMin, psStats->nMax );
+	psStats->nBytes = GetBytes();
+	GetByteWatermarks( psStats->nLowBytes, psStats->nHighBytes );
+
+	psStats->nPacketsIn = m_nPacketsIn;
+	psStats->nBytesIn = m_nBytesIn;
+	psStats->nPacketsOut = m_nPacketsOut;
+	psStats->nBytesOut = m_nBytesOut;
+	psStats->nUnderruns = m_nUnderruns;
+	psStats->nOverruns = m_nOverruns;
+	psStats->nConsumerBlocked = m_nConsumerBlocked;
+	psStats->nProducerBlocked = m_nProducerBlocked;
+
+	psStats->cGetLatency = m_cGetLatency;
+}
+
+void Buffer::GetStageStats( stage_stats *psStats )
+{
+	*psStats = m_sStageStats;
+}
+
+/* Only safe while the Buffer is stopped; a running producer or consumer may add to a counter as it is cleared */
+void Buffer::ResetStats( void )
+{
+	m_nPacketsOut = m_nBytesOut = 0;
+	m_nUnderruns = 0;
+	m_nConsumerBlocked = 0;
+	m_cGetLatency.Reset();
+
+	m_nPacketsIn = m_nBytesIn = 0;
+	m_nOverruns = 0;
+	m_nProducerBlocked = 0;
+	m_sStageStats.Reset();
+}
+
+status_t Buffer::Produce( Packet **ppcPackets, size_t nMax, size_t *pnCount )
+{
+	bigtime_t nStart = get_system_time();
+	void *pPrevious = NULL;
+	if( g_hProducerTLD >= 0 )
+	{
+		pPrevious = get_tld( g_hProducerTLD );
+		set_tld( g_hProducerTLD, this );
+	}
+	TRACE_BEGIN_EVENT( TRACE_STAGE_GET, m_pcStage );
+	status_t nError = m_pcStage->GetPackets( ppcPackets, nMax, pnCount, m_nOutput );
+	TRACE_END_EVENT( TRACE_STAGE_GET, m_pcStage, nError == EOK ? *pnCount : 0 );
+	if( g_hProducerTLD >= 0 )
+		set_tld( g_hProducerTLD, pPrevious );
+	m_sStageStats.cLatency.Add( get_system_time() - nStart );
+
+	m_sStageStats.nCalls++;
+	if( nError != EOK )
+	{
+		m_sStageStats.nErrors++;
+		return nError;
+	}
+
+	m_sStageStats.nPackets += *pnCount;
+	for( size_t i = 0; i < *pnCount; i++ )
+		m_sStageStats.nBytes += ppcPackets[i]->GetDataSize();
+
+	return EOK;
+}
+
+void Buffer::EndOfStream( void )
+{
+	m_bCanFill = false;
+
+	/* Make sure the consumer doesn't sleep forever waiting for a packet that won't arrive */
+	if( atomic_swap( &m_nConsumerWaiting, 0 ) == 1 )
+		unlock_semaphore( m_hData );
+}
+
+/* Produce packets until the Buffer is full.  The caller must have claimed m_nFilling, which makes it the
+   only producer for as long as it holds it */
+void Buffer::Fill( void )
+{
+	Packet *apcPackets[BUFFER_BATCH_SIZE];
+	size_t nSpace, nCount;
+
+	while( m_bIsRunning && m_bCanFill && false == m_bPaused )
+	{
+		if( ( nSpace = GetSpace() ) == 0 )
+		{
+			m_nOverruns++;
+			break;
+		}
+
+		if( Produce( apcPackets, nSpace, &nCount ) != EOK )
+		{
+			/* An upstream Buffer may have been paused under us, or have nothing yet for the thread that is
+			   pushing into it, neither of which is the end of the stream */
+			if( false == m_bPaused && false == is_pushing() )
+				EndOfStream();
+			break;
+		}
+		PutAll( apcPackets, nCount );
+	}
+}
+
+/* Fill the Buffer on the calling thread if nobody else is */
+bool Buffer::TryFill( void )
+{
+	/* A Buffer with a thread of its own has a single producer, & a push mode Buffer has no Stage to ask */
+	if( ( NULL == m_pcScheduler && false == m_bInline ) || m_bPush )
+		return false;
+
+	if( false == m_bIsRunning || false == m_bCanFill || m_bPaused )
+		return false;
+
+	if( atomic_swap( &m_nFilling, 1 ) == 1 )
+		return false;
+
+	/* Pause() may have looked at m_nFilling before we claimed it */
+	if( m_bPaused )
+	{
+		atomic_swap( &m_nFilling, 0 );
+		return false;
+	}
+
+	Fill();
+	atomic_swap( &m_nFilling, 0 );
+
+	return true;
+}
+
+/* Queue the fill Task, unless it is already queued */
+void Buffer::RequestFill( void )
+{
+	if( NULL == m_pcScheduler || m_bPush )
+		return;
+
+	if( false == m_bIsRunning || false == m_bCanFill || m_bPaused )
+		return;
+
+	if( atomic_swap( &m_nQueued, 1 ) == 0 )
+	{
+		atomic_inc( &m_nTaskRefs );
+		m_pcScheduler->Schedule( m_pcTask );
+	}
+}
+
+void Buffer::BufferTask::Run( void )
+{
+	Buffer *pcBuffer = m_pcParent;
+
+	/* Clear m_nQueued first, so that a consumer that drains the Buffer while we fill it queues us again */
+	atomic_swap( &pcBuffer->m_nQueued, 0 );
+
+	if( pcBuffer->TryFill() && pcBuffer->IsLow() )
+		pcBuffer->RequestFill();
+
+	/* This must be the last time we touch the Buffer */
+	atomic_dec( &pcBuffer->m_nTaskRefs );
+}
+
+void Buffer::BufferTask::Cancel( void )
+{
+	/* Nothing will fill the Buffer now, but it can still be deleted */
+	atomic_swap( &m_pcParent->m_nQueued, 0 );
+	atomic_dec( &m_pcParent->m_nTaskRefs );
 }
 
 Buffer::BufferThread::BufferThread( Buffer *pcParent ) : Thread( "buffer_thread", DISPLAY_PRIORITY, 1024 )
@@ -121,35 +976,66 @@ Buffer::BufferThread::~BufferThread()
 
 int32 Buffer::BufferThread::Run( void )
 {
-	Stage *pcStage = m_pcParent->m_pcStage;
-	int nOutput = m_pcParent->m_nOutput;
-	sem_id hLock = m_pcParent->m_hLock;
 	sem_id hWait = m_pcParent->m_hWait;
 
 	while( true )
 	{
-		Packet *pcPacket;
+		Packet *apcPackets[BUFFER_BATCH_SIZE];
+		size_t nCount, nSpace;
 
-		/* Add a new packet to the end of the queue */
-		if( pcStage->GetPacket( &pcPacket, nOutput ) != EOK )
+		if( m_pcParent->m_bPaused )
 		{
-			m_pcParent->m_bCanFill = false;
-			Terminate();
+			m_pcParent->Park();
+			continue;
 		}
 
-		lock_semaphore( hLock );
-		m_pcParent->m_vpcQueue.push( pcPacket );
+		/* Always make progress, even if SetMinMax() has just lowered the maximum below the count, but
+		   never make a packet that the ring has no room for */
+		nSpace = m_pcParent->GetSpace();
+		if( nSpace == 0 && m_pcParent->GetCount() < BUFFER_RING_SIZE )
+			nSpace = 1;
+
+		/* Add new packets to the end of the queue */
+		if( nSpace == 0 )
+			nCount = 0;
+		else if( m_pcParent->Produce( apcPackets, nSpace, &nCount ) != EOK )
+		{
+			/* An upstream Buffer may have been paused under us, which isn't the end of the stream */
+			if( m_pcParent->m_bPaused )
+				continue;
+
+			m_pcParent->EndOfStream();
+			PacketPool::FlushThreadCache();
+
+			/* Wait in case Pipeline::Seek() restarts the stream */
+			m_pcParent->Park();
+			continue;
+		}
 
-		/* Increment the count */
-		unlock_semaphore( m_pcParent->m_hCount );
+		m_pcParent->PutAll( apcPackets, nCount );
 
-		if( m_pcParent->GetCount() == m_pcParent->m_nMax )
+		/* Sleep once the buffer is full, unless the consumer has already drained it below the minimum */
+		if( m_pcParent->IsFull() )
 		{
-			//cerr << "unlock_and_suspend" << endl;
-			unlock_and_suspend( hWait, hLock );
+			bigtime_t nBlocked = get_system_time();
+
+			m_pcParent->m_nOverruns++;
+			TRACE_BEGIN_EVENT( TRACE_PRODUCER_SUSPEND, m_pcParent );
+			atomic_swap( &m_pcParent->m_nProducerWaiting, 1 );
+			if( m_pcParent->m_bPaused )
+			{
+				/* Pause() may have cleared the flag already, in which case it also posts hWait */
+				if( atomic_swap( &m_pcParent->m_nProducerWaiting, 0 ) == 0 )
+					lock_semaphore( hWait );
+			}
+			else if( false == m_pcParent->IsLow() )
+				lock_semaphore( hWait );
+			else if( atomic_swap( &m_pcParent->m_nProducerWaiting, 0 ) == 0 )
+				lock_semaphore( hWait );
+			TRACE_END_EVENT( TRACE_PRODUCER_SUSPEND, m_pcParent, 0 );
+
+			m_pcParent->m_nProducerBlocked += get_system_time() - nBlocked;
 		}
-		else
-			unlock_semaphore( hLock );
 	}
 
 	return 0;
@@ -0,0 +1,52 @@
+#include <cpu.h>
+
+using namespace media;
+
+static void cpuid( uint32 nLeaf, uint32 anRegs[4] )
+{
+#if defined( __i386__ ) && defined( __PIC__ )
+	/* %ebx holds the GOT pointer */
+	__asm__ __volatile__( "xchgl %%ebx, %1\n\tcpuid\n\txchgl %%ebx, %1"
+						  : "=a" ( anRegs[0] ), "=&r" ( anRegs[1] ), "=c" ( anRegs[2] ), "=d" ( anRegs[3] )
+						  : "a" ( nLeaf ), "c" ( 0 ) );
+#else
+	__asm__ __volatile__( "cpuid"
+						  : "=a" ( anRegs[0] ), "=b" ( anRegs[1] ), "=c" ( anRegs[2] ), "=d" ( anRegs[3] )
+						  : "a" ( nLeaf ), "c" ( 0 ) );
+#endif
+}
+
+static uint32 probe_cpu( void )
+{
+	uint32 anRegs[4], nMaxLeaf, nFeatures = 0;
+
+	cpuid( 0, anRegs );
+	nMaxLeaf = anRegs[0];
+
+	cpuid( 1, anRegs );
+	if( anRegs[3] & ( 1 << 26 ) )
+		nFeatures |= CPU_SSE2;
+
+	/* AVX2 needs the OS to save the AVX registers too (OSXSAVE, then XCR0 bits 1 & 2) */
+	if( nMaxLeaf >= 7 && ( anRegs[2] & ( 1 << 27 ) ) && ( anRegs[2] & ( 1 << 28 ) ) )
+	{
+		uint32 nLow, nHigh;
+		__asm__ __volatile__( ".byte 0x0f, 0x01, 0xd0" : "=a" ( nLow ), "=d" ( nHigh ) : "c" ( 0 ) );	/* xgetbv */
+
+		cpuid( 7, anRegs );
+		if( ( nLow & 6 ) == 6 && ( anRegs[1] & ( 1 << 5 ) ) )
+			nFeatures |= CPU_AVX2;
+	}
+
+	return nFeatures;
+}
+
+uint32 media::get_cpu_features( void )
+{
+	/* Probing twice is harmless, so there is no need for a lock */
+	static volatile int32 nFeatures = -1;
+
+	if( nFeatures < 0 )
+		nFeatures = probe_cpu();
+	return nFeatures;
+}
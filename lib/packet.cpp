@@ -0,0 +1,56 @@
+
+#include <packet.h>
+
+#include <util/locker.h>
+
+#include <list>
+
+using namespace os;
+using namespace media;
+
+/* Every distinct AudioPacketInfo that has been handed out by Get().  The list holds a reference to each
+   so they live for as long as the library */
+static Locker g_cInfoLock( "audio_info" );
+static std::list <AudioPacketInfo*> g_vpcAudioInfo;
+
+AudioPacketInfo * AudioPacketInfo::Get( audio_format_t eFormat, uint32 nChannels, uint32 nSampleRate, uint32 nBitsPerSample,
+									   uint32 nValidBits, uint32 nChannelMask )
+{
+	AudioPacketInfo *pcInfo = NULL;
+
+	if( nValidBits == 0 || nValidBits > nBitsPerSample )
+		nValidBits = nBitsPerSample;
+
+	g_cInfoLock.Lock();
+
+	std::list<AudioPacketInfo*>::iterator i;
+	for( i = g_vpcAudioInfo.begin(); i != g_vpcAudioInfo.end(); i++ )
+	{
+		if( (*i)->eFormat == eFormat && (*i)->nChannels == nChannels &&
+			(*i)->nSampleRate == nSampleRate && (*i)->nBitsPerSample == nBitsPerSample &&
+			(*i)->nValidBits == nValidBits && (*i)->nChannelMask == nChannelMask )
+		{
+			pcInfo = (*i);
+			break;
+		}
+	}
+
+	if( NULL == pcInfo )
+	{
+		pcInfo = new AudioPacketInfo();
+		pcInfo->eFormat = eFormat;
+		pcInfo->nChannels = nChannels;
+		pcInfo->nSampleRate = nSampleRate;
+		pcInfo->nBitsPerSample = nBitsPerSample;
+		pcInfo->nValidBits = nValidBits;
+		pcInfo->nChannelMask = nChannelMask;
+
+		g_vpcAudioInfo.push_back( pcInfo );
+	}
+	pcInfo->AddRef();
+
+	g_cInfoLock.Unlock();
+
+	return pcInfo;
+}
+
@@ -1,9 +1,14 @@
 #include <atheos/kdebug.h>
+#include <atheos/time.h>
 
 #include <pipeline.h>
 #include <stage.h>
 #include <buffer.h>
 #include <packet.h>
+#include <pool.h>
+#include <trace.h>
+
+#include <vector>
 
 using namespace os;
 using namespace media;
@@ -46,13 +51,50 @@ Buffer * StageNode::GetBuffer( int nOutput )
 	return m_vpcBuffers[nOutput];
 }
 
+void StageNode::AddUpstream( StageNode *pcNode )
+{
+	for( size_t i = 0; i < m_vpcUpstream.size(); i++ )
+		if( m_vpcUpstream[i] == pcNode )
+			return;
+
+	m_vpcUpstream.push_back( pcNode );
+	pcNode->m_vpcDownstream.push_back( this );
+}
+
+void StageNode::GetStats( stage_snapshot *psSnapshot )
+{
+	psSnapshot->cIdentifier = m_cIdentifier;
+	psSnapshot->cName = GetName();
+	psSnapshot->sStage.Reset();
+	psSnapshot->vsBuffers.clear();
+
+	for( int i = 0; i < m_nBuffers; i++ )
+	{
+		Buffer *pcBuffer = m_vpcBuffers[i];
+		if( NULL == pcBuffer )
+			continue;
+
+		stage_stats sStage;
+		pcBuffer->GetStageStats( &sStage );
+		psSnapshot->sStage.Merge( sStage );
+
+		buffer_stats sBuffer;
+		pcBuffer->GetStats( &sBuffer );
+		psSnapshot->vsBuffers.push_back( sBuffer );
+	}
+}
+
 Pipeline::Pipeline( String cIdentifier )
 {
 	m_cIdentifier = cIdentifier;
+	m_pcPool = new PacketPool();
+	m_pcScheduler = NULL;
+	m_bInline = false;
 }
 
 Pipeline::~Pipeline()
 {
+	delete m_pcPool;
 }
 
 Packet * Pipeline::AllocPacket( void )
@@ -61,7 +103,8 @@ Packet * Pipeline::AllocPacket( void )
 
 	try
 	{
-		pcPacket = new Packet();
+		pcPacket = m_pcPool->AllocPacket();
+		TRACE_EVENT( TRACE_PACKET_ALLOC, pcPacket, 0 );
 	}
 	catch( std::exception &e )
 	{
@@ -76,13 +119,15 @@ status_t Pipeline::FreePacket( Packet *pcPacket )
 {
 	if( NULL == pcPacket )
 		return EINVAL;
-	delete pcPacket;
+	TRACE_EVENT( TRACE_PACKET_FREE, pcPacket, 0 );
+	m_pcPool->FreePacket( pcPacket );
 
 	return EOK;
 }
 
 InputPipeline::InputPipeline( String cIdentifier ) : Pipeline( cIdentifier )
 {
+	m_bOrderValid = true;
 }
 
 InputPipeline::~InputPipeline()
@@ -130,7 +175,12 @@ status_t InputPipeline::AddStage( InputStage *pcStage, String &cIdentifier )
 		{
 			/* Create a new Buffer and associate it with this Stage */
 			pcBuffer = new Buffer( pcStage, nOutput );
+			if( m_pcScheduler )
+				pcBuffer->SetScheduler( m_pcScheduler );
+			else if( m_bInline )
+				pcBuffer->SetInline();
 			pcNode->AddBuffer( pcBuffer, nOutput );
+			pcStage->SetOutputBuffer( pcBuffer, nOutput );
 
 			/* If this is a SOURCE plugin, start the buffer now */
 			if( pcStage->GetInputInterface() == SOURCE )
@@ -143,14 +193,9 @@ status_t InputPipeline::AddStage( InputStage *pcStage, String &cIdentifier )
 
 	/* Create a unique identifier for this stage */
 	String cName;
-	int nCount = 0;
 
 	cName = pcStage->GetName();
-
-	std::list<StageNode *>::iterator i;
-	for( i = m_vpcStages.begin(); i != m_vpcStages.end(); i++ )
-		if( cName == (*i)->GetName() )
-			nCount++;
+	int nCount = m_cNameCount[cName.str()]++;
 
 	cIdentifier.Format( "%s-%d", cName.c_str(), nCount );
 	pcNode->SetIdentifier( cIdentifier );
@@ -159,6 +204,8 @@ status_t InputPipeline::AddStage( InputStage *pcStage, String &cIdentifier )
 
 	/* The stage has been added to the pipeline.  We now own it. */
 	m_vpcStages.push_back( pcNode );
+	m_cIndex[cIdentifier.str()] = pcNode;
+	m_bOrderValid = false;
 
 	return EOK;
 }
@@ -169,16 +216,8 @@ status_t InputPipeline::AddStage( InputStage *pcStage, String &cIdentifier )
 */
 Buffer * InputPipeline::GetBuffer( String cStage, int nOutput )
 {
-	StageNode *pcStageNode = NULL;
-
 	/* Find the stage */
-	std::list<StageNode *>::iterator i;
-	for( i = m_vpcStages.begin(); i != m_vpcStages.end(); i++ )
-	{
-		if( (*i)->GetIdentifier() == cStage )
-			pcStageNode = (*i);
-	}
-
+	StageNode *pcStageNode = FindStage( cStage );
 	if( NULL == pcStageNode )
 		return NULL;
 
@@ -196,21 +235,17 @@ Buffer * InputPipeline::GetBuffer( String cStage, int nOutput )
 status_t InputPipeline::Connect( String cDownstream, String cUpstream, int nOutput )
 {
 	status_t nError;
-	StageNode *pcStageNode1 = NULL, *pcStageNode2 = NULL;
 
 	/* Find both stages */
-	std::list<StageNode *>::iterator i;
-	for( i = m_vpcStages.begin(); i != m_vpcStages.end(); i++ )
-	{
-		if( (*i)->GetIdentifier() == cDownstream )
-			pcStageNode1 = (*i);
-		if( (*i)->GetIdentifier() == cUpstream )
-			pcStageNode2 = (*i);
-	}
-
+	StageNode *pcStageNode1 = FindStage( cDownstream );
+	StageNode *pcStageNode2 = FindStage( cUpstream );
 	if( NULL == pcStageNode1 || NULL == pcStageNode2 )
 		return ENOENT;
 
+	/* The pipeline must stay a graph without loops, or a stage would end up waiting for itself */
+	if( pcStageNode1 == pcStageNode2 || IsUpstream( pcStageNode1, pcStageNode2 ) )
+		return EINVAL;
+
 	/* Get the buffer from stage2 */
 	Buffer *pcBuffer = pcStageNode2->GetBuffer( nOutput );
 	if( NULL == pcBuffer )
@@ -222,11 +257,87 @@ status_t InputPipeline::Connect( String cDownstream, String cUpstream, int nOutp
 	if( nError != EOK )
 		return nError;
 
+	pcStageNode1->AddUpstream( pcStageNode2 );
+	m_bOrderValid = false;
+
+	/* Packets pushed into the upstream Buffer can then be carried on through stage1 */
+	for( int i = 0; i < pcStageNode1->GetBufferCount(); i++ )
+		if( pcStageNode1->GetBuffer( i ) )
+			pcBuffer->AddDownstream( pcStageNode1->GetBuffer( i ) );
+
 	/* Start the buffers for stage1 */
-	int nBuffers = pcStageNode1->GetBufferCount();
+	return StartNode( pcStageNode1 );
+}
+
+StageNode * InputPipeline::FindStage( const String &cIdentifier )
+{
+	std::tr1::unordered_map<std::string, StageNode*>::iterator i = m_cIndex.find( cIdentifier.str() );
+	return i == m_cIndex.end() ? NULL : i->second;
+}
+
+/* Is pcNode upstream of pcOf, by any path? */
+bool InputPipeline::IsUpstream( StageNode *pcNode, StageNode *pcOf )
+{
+	std::vector<StageNode*> vpcStack( 1, pcOf );
+	std::tr1::unordered_map<StageNode*, bool> cSeen;
+
+	while( false == vpcStack.empty() )
+	{
+		StageNode *pcNext = vpcStack.back();
+		vpcStack.pop_back();
+
+		const std::vector<StageNode*> &vpcUpstream = pcNext->GetUpstream();
+		for( size_t i = 0; i < vpcUpstream.size(); i++ )
+		{
+			if( vpcUpstream[i] == pcNode )
+				return true;
+			if( false == cSeen[vpcUpstream[i]] )
+			{
+				cSeen[vpcUpstream[i]] = true;
+				vpcStack.push_back( vpcUpstream[i] );
+			}
+		}
+	}
+
+	return false;
+}
+
+/* Sort the stages so that each comes after every stage it reads from.  Connect() doesn't allow loops, so
+   every stage is reached.  Stages that don't depend on each other stay in the order they were added */
+const std::vector<StageNode*> & InputPipeline::GetOrder( void )
+{
+	if( m_bOrderValid )
+		return m_vpcOrder;
+
+	std::tr1::unordered_map<StageNode*, size_t> cWaiting;
+	m_vpcOrder.clear();
+
+	std::list<StageNode *>::iterator i;
+	for( i = m_vpcStages.begin(); i != m_vpcStages.end(); i++ )
+	{
+		cWaiting[*i] = (*i)->GetUpstream().size();
+		if( (*i)->GetUpstream().empty() )
+			m_vpcOrder.push_back( *i );
+	}
+
+	for( size_t n = 0; n < m_vpcOrder.size(); n++ )
+	{
+		const std::vector<StageNode*> &vpcDownstream = m_vpcOrder[n]->GetDownstream();
+		for( size_t j = 0; j < vpcDownstream.size(); j++ )
+			if( --cWaiting[vpcDownstream[j]] == 0 )
+				m_vpcOrder.push_back( vpcDownstream[j] );
+	}
+
+	m_bOrderValid = true;
+	return m_vpcOrder;
+}
+
+status_t InputPipeline::StartNode( StageNode *pcNode )
+{
+	int nBuffers = pcNode->GetBufferCount();
 	for( int n = 0; n < nBuffers; n++ )
 	{
-		Buffer *pcBuffer = pcStageNode1->GetBuffer( n );
+		Buffer *pcBuffer = pcNode->GetBuffer( n );
 		if( pcBuffer )
 		{
 			status_t nError = pcBuffer->Start();
@@ -238,18 +349,34 @@ status_t InputPipeline::Connect( String cDownstream, String cUpstream, int nOutp
 	return EOK;
 }
 
+/* The sources are started first, so that a stage never starts before the stages it reads from */
 status_t InputPipeline::Start( void )
 {
-	std::list<StageNode *>::iterator i;
-	for( i = m_vpcStages.begin(); i != m_vpcStages.end(); i++ )
+	const std::vector<StageNode*> &vpcOrder = GetOrder();
+	for( size_t i = 0; i < vpcOrder.size(); i++ )
 	{
-		int nBuffers = (*i)->GetBufferCount();
+		status_t nError = StartNode( vpcOrder[i] );
+		if( nError != EOK )
+			return nError;
+	}
+
+	return EOK;
+}
+
+/* The sources are stopped first, so that nothing new enters the pipeline while the stages below them
+   are being stopped */
+status_t InputPipeline::Stop( void )
+{
+	const std::vector<StageNode*> &vpcOrder = GetOrder();
+	for( size_t i = 0; i < vpcOrder.size(); i++ )
+	{
+		int nBuffers = vpcOrder[i]->GetBufferCount();
 		for( int n = 0; n < nBuffers; n++ )
 		{
-			Buffer *pcBuffer = (*i)->GetBuffer( n );
+			Buffer *pcBuffer = vpcOrder[i]->GetBuffer( n );
 			if( pcBuffer )
 			{
-				status_t nError = pcBuffer->Start();
+				status_t nError = pcBuffer->Stop();
 				if( nError != EOK )
 					return nError;
 			}
@@ -259,8 +386,18 @@ status_t InputPipeline::Start( void )
 	return EOK;
 }
 
-status_t InputPipeline::Stop( void )
+/*
+	Seek in three steps.  First every Buffer is paused, so that nothing is running.  Any Buffer that has
+	been stopped is left alone.  Then the demuxers move their sources.  Finally the packets & state left
+	over from the old position are thrown away before the Buffers carry on.  If no demuxer could seek,
+	the stream carries on from wherever its source had read up to.
+*/
+status_t InputPipeline::Seek( bigtime_t nTime )
 {
+	if( nTime < 0 )
+		return EINVAL;
+
+	std::vector<Buffer *> vpcPaused;
 	std::list<StageNode *>::iterator i;
 	for( i = m_vpcStages.begin(); i != m_vpcStages.end(); i++ )
 	{
@@ -268,16 +405,58 @@ status_t InputPipeline::Stop( void )
 		for( int n = 0; n < nBuffers; n++ )
 		{
 			Buffer *pcBuffer = (*i)->GetBuffer( n );
-			if( pcBuffer )
-			{
-				status_t nError = pcBuffer->Stop();
-				if( nError != EOK )
-					return nError;
-			}
+			if( pcBuffer && pcBuffer->Pause() == EOK )
+				vpcPaused.push_back( pcBuffer );
 		}
 	}
 
-	return EOK;
+	/* A producer waiting for another Buffer gives up by itself, but one sleeping in a Stage must be woken */
+	for( i = m_vpcStages.begin(); i != m_vpcStages.end(); i++ )
+		(*i)->GetStage()->Interrupt();
+	for( size_t n = 0; n < vpcPaused.size(); n++ )
+		vpcPaused[n]->WaitPaused();
+
+	status_t nError = ENOSYS;
+	for( i = m_vpcStages.begin(); i != m_vpcStages.end(); i++ )
+	{
+		DemuxInterface *pcDemux = dynamic_cast<DemuxInterface *>( (*i)->GetStage() );
+		if( NULL == pcDemux )
+			continue;
+
+		status_t nResult = pcDemux->Seek( nTime );
+		if( nResult != ENOSYS && ( nError == ENOSYS || nError == EOK ) )
+			nError = nResult;
+	}
+
+	if( nError != EOK )
+		dbprintf( "%s: failed to seek to %lld\n", __FUNCTION__, (long long)nTime );
+
+	/* Stages may have seen their input stop while we paused, so they are flushed even if nothing moved */
+	for( size_t n = 0; n < vpcPaused.size(); n++ )
+		vpcPaused[n]->Flush( this );
+	for( i = m_vpcStages.begin(); i != m_vpcStages.end(); i++ )
+		(*i)->GetStage()->Flush();
+
+	for( size_t n = 0; n < vpcPaused.size(); n++ )
+		vpcPaused[n]->Resume();
+
+	return nError;
 }
 
+status_t InputPipeline::GetSnapshot( pipeline_snapshot *psSnapshot )
+{
+	if( NULL == psSnapshot )
+		return EINVAL;
+
+	psSnapshot->cIdentifier = m_cIdentifier;
+	psSnapshot->nTime = get_system_time();
+	psSnapshot->vsStages.resize( m_vpcStages.size() );
+
+	int n = 0;
+	std::list<StageNode *>::iterator i;
+	for( i = m_vpcStages.begin(); i != m_vpcStages.end(); i++ )
+		(*i)->GetStats( &psSnapshot->vsStages[n++] );
+
+	return EOK;
+}
 
@@ -0,0 +1,437 @@
+
+#include <pool.h>
+#include <packet.h>
+
+#include <atheos/tld.h>
+#include <atheos/kdebug.h>
+#include <stdlib.h>
+
+using namespace os;
+using namespace media;
+
+/* The payload follows the PacketData header in the same allocation, aligned to 16 bytes */
+#define DATA_HEADER_SIZE	( ( sizeof( PacketData ) + 15 ) & ~15 )
+
+/* Number of pools each thread keeps a cache for */
+#define CACHE_ENTRIES		4
+
+namespace media
+{
+
+/* A thread's private cache of free payloads & Packets for one pool */
+struct cache_entry
+{
+	PacketPool *pcPool;
+	uint32 nGeneration;
+	uint32 nLastUse;
+
+	PacketData *apcData[POOL_CLASS_COUNT];
+	int anData[POOL_CLASS_COUNT];
+
+	Packet *pcPackets;
+	int nPackets;
+};
+
+}
+
+struct thread_cache
+{
+	struct cache_entry asEntries[CACHE_ENTRIES];
+	uint32 nClock;
+};
+
+static int g_hCacheTLD = alloc_tld( NULL );
+
+static Locker g_cGenerationLock( "pool_generation" );
+static uint32 g_nNextGeneration = 1;
+
+void PacketPool::FreeEntry( struct cache_entry *psEntry )
+{
+	/* The pool this entry belonged to may no longer exist, so the contents go back to the heap */
+	for( int i = 0; i < POOL_CLASS_COUNT; i++ )
+	{
+		while( psEntry->apcData[i] )
+		{
+			PacketData *pcData = psEntry->apcData[i];
+			psEntry->apcData[i] = pcData->m_pcNext;
+			free( pcData );
+		}
+		psEntry->anData[i] = 0;
+	}
+
+	while( psEntry->pcPackets )
+	{
+		Packet *pcPacket = psEntry->pcPackets;
+		psEntry->pcPackets = pcPacket->m_pcNextFree;
+		delete pcPacket;
+	}
+	psEntry->nPackets = 0;
+
+	psEntry->pcPool = NULL;
+	psEntry->nGeneration = 0;
+}
+
+PacketData * PacketData::Create( size_t nCapacity )
+{
+	PacketData *pcData = (PacketData*)malloc( DATA_HEADER_SIZE + nCapacity );
+	if( NULL == pcData )
+		return NULL;
+
+	atomic_set( &pcData->m_nRefCount, 1 );
+	pcData->m_pcPool = NULL;
+	pcData->m_nClass = -1;
+	pcData->m_pBuffer = (uint8*)pcData + DATA_HEADER_SIZE;
+	pcData->m_nCapacity = nCapacity;
+	pcData->m_pcNext = NULL;
+	pcData->m_pfRelease = NULL;
+	pcData->m_pCookie = NULL;
+
+	return pcData;
+}
+
+PacketData * PacketData::Wrap( uint8 *pBuffer, size_t nSize, void (*pfRelease)( void *pCookie ), void *pCookie )
+{
+	PacketData *pcData = Create( 0 );
+	if( NULL == pcData )
+		return NULL;
+
+	pcData->m_pBuffer = pBuffer;
+	pcData->m_nCapacity = nSize;
+	pcData->m_pfRelease = pfRelease;
+	pcData->m_pCookie = pCookie;
+
+	return pcData;
+}
+
+void PacketData::Release( void )
+{
+	if( atomic_dec_and_test( &m_nRefCount ) == false )
+		return;
+
+	if( m_pfRelease )
+	{
+		m_pfRelease( m_pCookie );
+		free( this );
+	}
+	else if( m_pcPool )
+		m_pcPool->FreeData( this );
+	else
+		free( this );
+}
+
+PacketPool::PacketPool() : m_cLock( "packet_pool" )
+{
+	g_cGenerationLock.Lock();
+	m_nGeneration = g_nNextGeneration++;
+	g_cGenerationLock.Unlock();
+
+	for( int i = 0; i < POOL_CLASS_COUNT; i++ )
+	{
+		m_apcFree[i] = NULL;
+		m_anFree[i] = 0;
+	}
+	m_pcFreePackets = NULL;
+	m_nFreePackets = 0;
+}
+
+PacketPool::~PacketPool()
+{
+	/* Drop our entry from the calling thread's cache.  Entries held by other threads will no longer
+	   match our generation and are released when they are re-used or flushed */
+	struct thread_cache *psCache = (struct thread_cache*)get_tld( g_hCacheTLD );
+	if( psCache )
+		for( int i = 0; i < CACHE_ENTRIES; i++ )
+			if( psCache->asEntries[i].pcPool == this && psCache->asEntries[i].nGeneration == m_nGeneration )
+				FreeEntry( &psCache->asEntries[i] );
+
+	for( int i = 0; i < POOL_CLASS_COUNT; i++ )
+	{
+		while( m_apcFree[i] )
+		{
+			PacketData *pcData = m_apcFree[i];
+			m_apcFree[i] = pcData->m_pcNext;
+			free( pcData );
+		}
+	}
+
+	while( m_pcFreePackets )
+	{
+		Packet *pcPacket = m_pcFreePackets;
+		m_pcFreePackets = pcPacket->m_pcNextFree;
+		delete pcPacket;
+	}
+}
+
+int PacketPool::GetClass( size_t nSize )
+{
+	int nClass = 0;
+	size_t nClassSize = 1 << POOL_MIN_SHIFT;
+
+	while( nClassSize < nSize )
+	{
+		if( ++nClass == POOL_CLASS_COUNT )
+			return -1;
+		nClassSize <<= 2;
+	}
+	return nClass;
+}
+
+size_t PacketPool::GetClassSize( int nClass )
+{
+	return 1 << ( POOL_MIN_SHIFT + 2 * nClass );
+}
+
+int PacketPool::GetCacheDepth( int nClass )
+{
+	int nDepth = POOL_CACHE_BYTES / GetClassSize( nClass );
+	return nDepth > 0 ? nDepth : 1;
+}
+
+/* Find, or claim, the calling thread's cache entry for this pool */
+struct cache_entry * PacketPool::GetCache( void )
+{
+	if( g_hCacheTLD < 0 )
+		return NULL;
+
+	struct thread_cache *psCache = (struct thread_cache*)get_tld( g_hCacheTLD );
+	if( NULL == psCache )
+	{
+		psCache = (struct thread_cache*)calloc( 1, sizeof( struct thread_cache ) );
+		if( NULL == psCache )
+			return NULL;
+		set_tld( g_hCacheTLD, psCache );
+	}
+
+	psCache->nClock++;
+
+	struct cache_entry *psVictim = &psCache->asEntries[0];
+	for( int i = 0; i < CACHE_ENTRIES; i++ )
+	{
+		struct cache_entry *psEntry = &psCache->asEntries[i];
+		if( psEntry->pcPool == this && psEntry->nGeneration == m_nGeneration )
+		{
+			psEntry->nLastUse = psCache->nClock;
+			return psEntry;
+		}
+		if( psEntry->nLastUse < psVictim->nLastUse )
+			psVictim = psEntry;
+	}
+
+	/* Re-use the least recently used entry */
+	FreeEntry( psVictim );
+	psVictim->pcPool = this;
+	psVictim->nGeneration = m_nGeneration;
+	psVictim->nLastUse = psCache->nClock;
+
+	return psVictim;
+}
+
+PacketData * PacketPool::AllocData( size_t nSize )
+{
+	int nClass = GetClass( nSize );
+	if( nClass < 0 )
+		return PacketData::Create( nSize );
+
+	PacketData *pcData = NULL;
+	struct cache_entry *psEntry = GetCache();
+
+	if( psEntry && psEntry->apcData[nClass] )
+	{
+		pcData = psEntry->apcData[nClass];
+		psEntry->apcData[nClass] = pcData->m_pcNext;
+		psEntry->anData[nClass]--;
+	}
+	else
+	{
+		/* Take one from the shared list, and refill the thread cache with up to half its depth while
+		   we hold the lock */
+		int nBatch = GetCacheDepth( nClass ) / 2;
+
+		m_cLock.Lock();
+		if( m_apcFree[nClass] )
+		{
+			pcData = m_apcFree[nClass];
+			m_apcFree[nClass] = pcData->m_pcNext;
+			m_anFree[nClass]--;
+		}
+		while( psEntry && m_apcFree[nClass] && nBatch-- > 0 )
+		{
+			PacketData *pcFree = m_apcFree[nClass];
+			m_apcFree[nClass] = pcFree->m_pcNext;
+			m_anFree[nClass]--;
+
+			pcFree->m_pcNext = psEntry->apcData[nClass];
+			psEntry->apcData[nClass] = pcFree;
+			psEntry->anData[nClass]++;
+		}
+		m_cLock.Unlock();
+	}
+
+	if( NULL == pcData )
+	{
+		pcData = PacketData::Create( GetClassSize( nClass ) );
+		if( NULL == pcData )
+			return NULL;
+	}
+
+	atomic_set( &pcData->m_nRefCount, 1 );
+	pcData->m_pcPool = this;
+	pcData->m_nClass = nClass;
+	pcData->m_pcNext = NULL;
+	pcData->m_pfRelease = NULL;
+
+	return pcData;
+}
+
+void PacketPool::FreeData( PacketData *pcData )
+{
+	int nClass = pcData->m_nClass;
+	if( nClass < 0 )
+	{
+		free( pcData );
+		return;
+	}
+
+	struct cache_entry *psEntry = GetCache();
+	if( psEntry )
+	{
+		pcData->m_pcNext = psEntry->apcData[nClass];
+		psEntry->apcData[nClass] = pcData;
+		if( ++psEntry->anData[nClass] <= GetCacheDepth( nClass ) )
+			return;
+
+		/* The cache is full; move half of it to the shared list */
+		int nMove = psEntry->anData[nClass] / 2;
+
+		m_cLock.Lock();
+		while( nMove-- > 0 )
+		{
+			pcData = psEntry->apcData[nClass];
+			psEntry->apcData[nClass] = pcData->m_pcNext;
+			psEntry->anData[nClass]--;
+
+			if( ( m_anFree[nClass] + 1 ) * GetClassSize( nClass ) > POOL_FREE_BYTES )
+				free( pcData );
+			else
+			{
+				pcData->m_pcNext = m_apcFree[nClass];
+				m_apcFree[nClass] = pcData;
+				m_anFree[nClass]++;
+			}
+		}
+		m_cLock.Unlock();
+		return;
+	}
+
+	m_cLock.Lock();
+	if( ( m_anFree[nClass] + 1 ) * GetClassSize( nClass ) > POOL_FREE_BYTES )
+		free( pcData );
+	else
+	{
+		pcData->m_pcNext = m_apcFree[nClass];
+		m_apcFree[nClass] = pcData;
+		m_anFree[nClass]++;
+	}
+	m_cLock.Unlock();
+}
+
+Packet * PacketPool::AllocPacket( void )
+{
+	Packet *pcPacket = NULL;
+	struct cache_entry *psEntry = GetCache();
+
+	if( psEntry && psEntry->pcPackets )
+	{
+		pcPacket = psEntry->pcPackets;
+		psEntry->pcPackets = pcPacket->m_pcNextFree;
+		psEntry->nPackets--;
+	}
+	else
+	{
+		m_cLock.Lock();
+		if( m_pcFreePackets )
+		{
+			pcPacket = m_pcFreePackets;
+			m_pcFreePackets = pcPacket->m_pcNextFree;
+			m_nFreePackets--;
+		}
+		m_cLock.Unlock();
+	}
+
+	if( NULL == pcPacket )
+		pcPacket = new Packet();
+
+	pcPacket->m_pcNextFree = NULL;
+	pcPacket->SetPool( this );
+
+	return pcPacket;
+}
+
+void PacketPool::FreePacket( Packet *pcPacket )
+{
+	pcPacket->Reset();
+
+	struct cache_entry *psEntry = GetCache();
+	if( psEntry && psEntry->nPackets < POOL_CACHE_PACKETS )
+	{
+		pcPacket->m_pcNextFree = psEntry->pcPackets;
+		psEntry->pcPackets = pcPacket;
+		psEntry->nPackets++;
+		return;
+	}
+
+	m_cLock.Lock();
+	if( m_nFreePackets < POOL_FREE_PACKETS )
+	{
+		pcPacket->m_pcNextFree = m_pcFreePackets;
+		m_pcFreePackets = pcPacket;
+		m_nFreePackets++;
+		pcPacket = NULL;
+	}
+	m_cLock.Unlock();
+
+	if( pcPacket )
+		delete pcPacket;
+}
+
+status_t PacketPool::Reserve( size_t nSize, int nCount )
+{
+	int nClass = GetClass( nSize );
+	if( nClass < 0 || nCount < 0 )
+		return EINVAL;
+
+	m_cLock.Lock();
+	while( nCount-- > 0 && ( m_anFree[nClass] + 1 ) * GetClassSize( nClass ) <= POOL_FREE_BYTES )
+	{
+		PacketData *pcData = PacketData::Create( GetClassSize( nClass ) );
+		if( NULL == pcData )
+			break;
+
+		/* Touch every page now so that the first real use doesn't fault */
+		memset( pcData->GetBuffer(), 0, pcData->GetCapacity() );
+
+		pcData->m_pcNext = m_apcFree[nClass];
+		m_apcFree[nClass] = pcData;
+		m_anFree[nClass]++;
+	}
+	m_cLock.Unlock();
+
+	return EOK;
+}
+
+void PacketPool::FlushThreadCache( void )
+{
+	if( g_hCacheTLD < 0 )
+		return;
+
+	struct thread_cache *psCache = (struct thread_cache*)get_tld( g_hCacheTLD );
+	if( NULL == psCache )
+		return;
+
+	for( int i = 0; i < CACHE_ENTRIES; i++ )
+		FreeEntry( &psCache->asEntries[i] );
+
+	set_tld( g_hCacheTLD, NULL );
+	free( psCache );
+}
+
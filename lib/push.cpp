@@ -0,0 +1,44 @@
+#include <push.h>
+#include <buffer.h>
+#include <packet.h>
+
+using namespace os;
+using namespace media;
+
+PushSourceStage::PushSourceStage( interface_t eInterface )
+{
+	m_pcOutput = NULL;
+	m_eInterface = eInterface;
+}
+
+PushSourceStage::~PushSourceStage()
+{
+}
+
+/* Called by the Pipeline before the Buffer is started */
+void PushSourceStage::SetOutputBuffer( Buffer *pcBuffer, int nOutput )
+{
+	m_pcOutput = pcBuffer;
+	if( m_pcOutput )
+		m_pcOutput->SetPushMode();
+}
+
+size_t PushSourceStage::Push( Packet **ppcPackets, size_t nCount, bool bNoBlock )
+{
+	if( NULL == m_pcOutput )
+		return 0;
+	return m_pcOutput->Push( ppcPackets, nCount, bNoBlock );
+}
+
+status_t PushSourceStage::Push( Packet *pcPacket, bool bNoBlock )
+{
+	if( NULL == pcPacket )
+		return EINVAL;
+	return Push( &pcPacket, 1, bNoBlock ) == 1 ? EOK : EBUSY;
+}
+
+void PushSourceStage::End( void )
+{
+	if( m_pcOutput )
+		m_pcOutput->PushEnd();
+}
@@ -0,0 +1,204 @@
+#include <atheos/kdebug.h>
+
+#include <registry.h>
+#include <stage.h>
+#include <packet.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+using namespace os;
+using namespace media;
+
+PluginRegistry::PluginRegistry()
+{
+}
+
+PluginRegistry::~PluginRegistry()
+{
+	for( size_t i = 0; i < m_vpsPlugins.size(); i++ )
+	{
+		unload_library( m_vpsPlugins[i]->hImage );
+		delete m_vpsPlugins[i];
+	}
+}
+
+status_t PluginRegistry::Scan( String cDirectory )
+{
+	DIR *hDir = opendir( cDirectory.c_str() );
+	if( NULL == hDir )
+	{
+		dbprintf( "%s: failed to open %s\n", __FUNCTION__, cDirectory.c_str() );
+		return ENOENT;
+	}
+
+	struct dirent *psEntry;
+	while( ( psEntry = readdir( hDir ) ) != NULL )
+	{
+		if( psEntry->d_name[0] == '.' )
+			continue;
+
+		String cPath = cDirectory + "/" + psEntry->d_name;
+
+		struct stat sStat;
+		if( stat( cPath.c_str(), &sStat ) < 0 || false == S_ISREG( sStat.st_mode ) )
+			continue;
+
+		/* Anything that can't be loaded just isn't a plugin */
+		AddPlugin( cPath );
+	}
+	closedir( hDir );
+
+	return EOK;
+}
+
+status_t PluginRegistry::AddPlugin( String cPath )
+{
+	for( size_t i = 0; i < m_vpsPlugins.size(); i++ )
+		if( m_vpsPlugins[i]->cPath == cPath )
+			return EOK;
+
+	image_id hImage = load_library( cPath.c_str(), 0 );
+	if( hImage < 0 )
+		return ENOENT;
+
+	Stage * (*pfGetInstance)( void ) = NULL;
+	if( get_symbol_address( hImage, "GetInstance", -1, (void**)&pfGetInstance ) < 0 )
+	{
+		unload_library( hImage );
+		return EINVAL;
+	}
+
+	probe_fn pfProbe = NULL;
+	if( get_symbol_address( hImage, "Probe", -1, (void**)&pfProbe ) < 0 )
+		pfProbe = NULL;
+
+	/* Everything else comes from the Stage, so make one to ask */
+	Stage *pcStage = pfGetInstance();
+	if( NULL == pcStage )
+	{
+		unload_library( hImage );
+		return ENOMEM;
+	}
+
+	plugin_info *psInfo = new plugin_info;
+	psInfo->cPath = cPath;
+	psInfo->cName = pcStage->GetName();
+	psInfo->eInputInterface = pcStage->GetInputInterface();
+	psInfo->eOutputInterface = pcStage->GetOutputInterface();
+	psInfo->hImage = hImage;
+	psInfo->pfGetInstance = pfGetInstance;
+	psInfo->pfProbe = pfProbe;
+
+	DemuxInterface *pcDemux = dynamic_cast<DemuxInterface *>( pcStage );
+	if( pcDemux )
+		pcDemux->GetInputMimeType( psInfo->cMimeType );
+
+	delete pcStage;
+
+	/* Each Stage should have a unique name, but the first one found wins if not */
+	std::string cName = psInfo->cName.c_str();
+	if( m_cNames.find( cName ) == m_cNames.end() )
+		m_cNames[cName] = psInfo;
+	else
+		dbprintf( "%s: %s is already provided by %s\n", __FUNCTION__, cName.c_str(), m_cNames[cName]->cPath.c_str() );
+
+	m_vpsPlugins.push_back( psInfo );
+
+	return EOK;
+}
+
+const plugin_info * PluginRegistry::GetPlugin( int nIndex )
+{
+	if( nIndex < 0 || nIndex >= GetPluginCount() )
+		return NULL;
+	return m_vpsPlugins[nIndex];
+}
+
+const plugin_info * PluginRegistry::FindByName( const String &cName )
+{
+	std::tr1::unordered_map<std::string, plugin_info*>::iterator i = m_cNames.find( cName.c_str() );
+	if( i == m_cNames.end() )
+		return NULL;
+	return (*i).second;
+}
+
+const plugin_info * PluginRegistry::FindByMimeType( const String &cMimeType, interface_t eInterface )
+{
+	for( size_t i = 0; i < m_vpsPlugins.size(); i++ )
+	{
+		if( eInterface != NONE && m_vpsPlugins[i]->eInputInterface != eInterface )
+			continue;
+		if( m_vpsPlugins[i]->cMimeType != "" && m_vpsPlugins[i]->cMimeType == cMimeType )
+			return m_vpsPlugins[i];
+	}
+	return NULL;
+}
+
+const plugin_info * PluginRegistry::Probe( Packet *pcPacket, interface_t eInterface )
+{
+	if( NULL == pcPacket )
+		return NULL;
+
+	const plugin_info *psBest = NULL;
+	int nBest = PROBE_NONE;
+	bool bUnprobed = false;
+
+	for( size_t i = 0; i < m_vpsPlugins.size(); i++ )
+	{
+		const plugin_info *psInfo = m_vpsPlugins[i];
+		if( psInfo->eInputInterface != eInterface )
+			continue;
+
+		if( NULL == psInfo->pfProbe )
+		{
+			bUnprobed = true;
+			continue;
+		}
+
+		int nScore = psInfo->pfProbe( pcPacket->GetData(), pcPacket->GetDataSize() );
+		if( nScore > nBest )
+		{
+			psBest = psInfo;
+			nBest = nScore;
+			if( nBest >= PROBE_CERTAIN )
+				break;
+		}
+	}
+
+	if( psBest || false == bUnprobed )
+		return psBest;
+
+	/* Fall back to asking each plugin that can't probe.  This is slow, as each one needs a Stage */
+	for( size_t i = 0; i < m_vpsPlugins.size(); i++ )
+	{
+		const plugin_info *psInfo = m_vpsPlugins[i];
+		if( psInfo->eInputInterface != eInterface || psInfo->pfProbe )
+			continue;
+
+		Stage *pcStage = psInfo->pfGetInstance();
+		if( NULL == pcStage )
+			continue;
+
+		bool bRecognised = pcStage->Check( pcPacket );
+		delete pcStage;
+
+		if( bRecognised )
+			return psInfo;
+	}
+
+	return NULL;
+}
+
+Stage * PluginRegistry::CreateStage( const plugin_info *psInfo )
+{
+	if( NULL == psInfo )
+		return NULL;
+	return psInfo->pfGetInstance();
+}
+
+Stage * PluginRegistry::CreateStage( const String &cName )
+{
+	return CreateStage( FindByName( cName ) );
+}
@@ -0,0 +1,152 @@
+
+#include <scheduler.h>
+#include <pool.h>
+
+#include <atheos/kernel.h>
+#include <atheos/atomic.h>
+#include <atheos/tld.h>
+
+using namespace os;
+using namespace media;
+
+/* The Worker that the calling thread belongs to, if any */
+static int g_hWorkerTLD = alloc_tld( NULL );
+
+Scheduler::Scheduler( int nWorkers )
+{
+	if( nWorkers < 1 )
+	{
+		system_info sInfo;
+		if( get_system_info( &sInfo ) == EOK && sInfo.nCPUCount > 0 )
+			nWorkers = sInfo.nCPUCount;
+		else
+			nWorkers = 1;
+	}
+	m_nWorkers = nWorkers;
+
+	m_hWork = create_semaphore( "scheduler_work", 0, SEMSTYLE_COUNTING );
+	m_hExit = create_semaphore( "scheduler_exit", 0, SEMSTYLE_COUNTING );
+	m_bQuit = false;
+	atomic_set( &m_nNext, 0 );
+
+	m_vpcWorkers = new Worker*[m_nWorkers];
+	for( int i = 0; i < m_nWorkers; i++ )
+		m_vpcWorkers[i] = new Worker( this, i );
+	for( int i = 0; i < m_nWorkers; i++ )
+		m_vpcWorkers[i]->Start();
+}
+
+Scheduler::~Scheduler()
+{
+	/* Wake every worker and wait for them to exit */
+	m_bQuit = true;
+	unlock_semaphore_x( m_hWork, m_nWorkers, 0 );
+	for( int i = 0; i < m_nWorkers; i++ )
+		lock_semaphore( m_hExit );
+
+	/* Tasks that are still queued are not run, but they are told so that nothing waits for them */
+	for( int i = 0; i < m_nWorkers; i++ )
+	{
+		std::deque<Task*> &vpcTasks = m_vpcWorkers[i]->m_vpcTasks;
+		while( false == vpcTasks.empty() )
+		{
+			Task *pcTask = vpcTasks.front();
+			vpcTasks.pop_front();
+			pcTask->Cancel();
+		}
+	}
+
+	for( int i = 0; i < m_nWorkers; i++ )
+		delete m_vpcWorkers[i];
+	delete[] m_vpcWorkers;
+
+	delete_semaphore( m_hExit );
+	delete_semaphore( m_hWork );
+}
+
+status_t Scheduler::Schedule( Task *pcTask )
+{
+	if( NULL == pcTask )
+		return EINVAL;
+
+	/* Keep the Task on the scheduling workers queue, where its data is likely to still be in cache */
+	Worker *pcWorker = (Worker*)get_tld( g_hWorkerTLD );
+	if( NULL == pcWorker || pcWorker->m_pcParent != this )
+	{
+		atomic_inc( &m_nNext );
+		pcWorker = m_vpcWorkers[ (unsigned int)atomic_read( &m_nNext ) % m_nWorkers ];
+	}
+
+	pcWorker->m_cLock.Lock();
+	pcWorker->m_vpcTasks.push_back( pcTask );
+	pcWorker->m_cLock.Unlock();
+
+	unlock_semaphore( m_hWork );
+
+	return EOK;
+}
+
+/* Take a Task for worker nIndex.  The caller has already taken a count from m_hWork, so there is a Task
+   queued somewhere; the worker takes the newest from its own queue or steals the oldest from another */
+Task * Scheduler::GetTask( int nIndex )
+{
+	while( true )
+	{
+		for( int n = 0; n < m_nWorkers; n++ )
+		{
+			Worker *pcWorker = m_vpcWorkers[ ( nIndex + n ) % m_nWorkers ];
+			Task *pcTask = NULL;
+
+			pcWorker->m_cLock.Lock();
+			if( false == pcWorker->m_vpcTasks.empty() )
+			{
+				if( n == 0 )
+				{
+					pcTask = pcWorker->m_vpcTasks.back();
+					pcWorker->m_vpcTasks.pop_back();
+				}
+				else
+				{
+					pcTask = pcWorker->m_vpcTasks.front();
+					pcWorker->m_vpcTasks.pop_front();
+				}
+			}
+			pcWorker->m_cLock.Unlock();
+
+			if( pcTask )
+				return pcTask;
+		}
+	}
+}
+
+Scheduler::Worker::Worker( Scheduler *pcParent, int nIndex ) : Thread( "scheduler_worker", DISPLAY_PRIORITY ), m_cLock( "worker_lock" )
+{
+	m_pcParent = pcParent;
+	m_nIndex = nIndex;
+}
+
+Scheduler::Worker::~Worker()
+{
+}
+
+int32 Scheduler::Worker::Run( void )
+{
+	set_tld( g_hWorkerTLD, this );
+
+	while( true )
+	{
+		lock_semaphore( m_pcParent->m_hWork );
+		if( m_pcParent->m_bQuit )
+			break;
+
+		Task *pcTask = m_pcParent->GetTask( m_nIndex );
+		pcTask->Run();
+	}
+
+	set_tld( g_hWorkerTLD, NULL );
+	PacketPool::FlushThreadCache();
+	unlock_semaphore( m_pcParent->m_hExit );
+
+	return 0;
+}
+
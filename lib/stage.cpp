@@ -1,12 +1,14 @@
 #include <stage.h>
 #include <buffer.h>
 #include <packet.h>
+#include <pipeline.h>
 
 using namespace os;
 using namespace media;
 
 Stage::Stage()
 {
+	m_pcPipeline = NULL;
 }
 
 Stage::~Stage()
@@ -23,6 +25,19 @@ status_t Stage::GetPacket( Packet **ppcPacket, int nInterface )
 	return ENOSYS;
 }
 
+status_t Stage::GetPackets( Packet **ppcPackets, size_t nMax, size_t *pnCount, int nInterface )
+{
+	*pnCount = 0;
+	if( nMax == 0 )
+		return EINVAL;
+
+	status_t nError = GetPacket( ppcPackets, nInterface );
+	if( nError == EOK )
+		*pnCount = 1;
+
+	return nError;
+}
+
 InputStage::InputStage()
 {
 }
@@ -41,3 +56,213 @@ status_t InputStage::Connect( Buffer *pcBuffer )
 	return ENOSYS;
 }
 
+
+EffectStage::EffectStage()
+{
+	m_pcUpstream = NULL;
+	m_pcInputInfo = NULL;
+	m_pcOutputInfo = NULL;
+	m_pcLastInfo = NULL;
+	m_nCarry = 0;
+}
+
+EffectStage::~EffectStage()
+{
+	if( m_pcInputInfo )
+		m_pcInputInfo->Release();
+	if( m_pcOutputInfo )
+		m_pcOutputInfo->Release();
+	if( m_pcLastInfo )
+		m_pcLastInfo->Release();
+}
+
+status_t EffectStage::Process( Packet *pcPacket, Packet **ppcOutput )
+{
+	*ppcOutput = NULL;
+	m_pcPipeline->FreePacket( pcPacket );
+	return ENOSYS;
+}
+
+status_t EffectStage::ProcessUnits( Packet *pcPacket, size_t nInputSize, size_t nOutputSize, bool bInPlace, Packet **ppcOutput )
+{
+	*ppcOutput = NULL;
+
+	if( nInputSize == 0 || nInputSize > EFFECT_MAX_UNIT_SIZE )
+	{
+		m_pcPipeline->FreePacket( pcPacket );
+		return EINVAL;
+	}
+
+	size_t nSize = pcPacket->GetDataSize();
+	size_t nUnits = ( m_nCarry + nSize ) / nInputSize;
+
+	uint8 *pInPlace = NULL;
+	if( bInPlace && m_nCarry == 0 && nSize % nInputSize == 0 && nOutputSize <= nInputSize )
+		pInPlace = pcPacket->GetWritableData();
+
+	if( pInPlace )
+	{
+		TransformUnits( pInPlace, pInPlace, nUnits );
+		pcPacket->SetDataSize( nUnits * nOutputSize );
+		*ppcOutput = pcPacket;
+		return EOK;
+	}
+
+	const uint8 *pSrc = pcPacket->GetData();
+
+	if( nUnits == 0 )
+	{
+		memcpy( m_anCarry + m_nCarry, pSrc, nSize );
+		m_nCarry += nSize;
+		m_pcPipeline->FreePacket( pcPacket );
+		return EOK;
+	}
+
+	Packet *pcOutput = m_pcPipeline->AllocPacket();
+	uint8 *pDst = pcOutput ? pcOutput->AllocData( nUnits * nOutputSize ) : NULL;
+	if( NULL == pDst )
+	{
+		if( pcOutput )
+			m_pcPipeline->FreePacket( pcOutput );
+		m_pcPipeline->FreePacket( pcPacket );
+		return ENOMEM;
+	}
+	pcOutput->SetType( pcPacket->GetType() );
+
+	/* Finish the unit left over from the last packet */
+	if( m_nCarry > 0 )
+	{
+		size_t nNeed = nInputSize - m_nCarry;
+		memcpy( m_anCarry + m_nCarry, pSrc, nNeed );
+		TransformUnits( m_anCarry, pDst, 1 );
+
+		pSrc += nNeed;
+		nSize -= nNeed;
+		pDst += nOutputSize;
+		nUnits--;
+	}
+
+	TransformUnits( pSrc, pDst, nUnits );
+
+	m_nCarry = nSize - nUnits * nInputSize;
+	memcpy( m_anCarry, pSrc + nUnits * nInputSize, m_nCarry );
+
+	m_pcPipeline->FreePacket( pcPacket );
+
+	*ppcOutput = pcOutput;
+	return EOK;
+}
+
+void EffectStage::SetInputInfo( PacketInfo *pcInfo )
+{
+	if( pcInfo )
+		pcInfo->AddRef();
+	if( m_pcInputInfo )
+		m_pcInputInfo->Release();
+	m_pcInputInfo = pcInfo;
+}
+
+/* Set up for the format of pcPacket if it has changed, then let the effect transform it */
+status_t EffectStage::ProcessPacket( Packet *pcPacket, Packet **ppcOutput )
+{
+	*ppcOutput = NULL;
+
+	if( pcPacket->GetInfo() != m_pcInputInfo )
+	{
+		status_t nError = SetInputFormat( pcPacket->GetInfo() );
+		if( nError != EOK )
+		{
+			m_pcPipeline->FreePacket( pcPacket );
+			return nError;
+		}
+		SetInputInfo( pcPacket->GetInfo() );
+	}
+
+	status_t nError = Process( pcPacket, ppcOutput );
+	if( *ppcOutput )
+		SetOutputInfo( *ppcOutput );
+
+	return nError;
+}
+
+/* Every packet shares the same format descriptor.  Downstream stages only need to look at it when the
+   packet is flagged as a format change */
+void EffectStage::SetOutputInfo( Packet *pcOutput )
+{
+	m_pcOutputInfo->AddRef();
+	pcOutput->SetInfo( m_pcOutputInfo );
+
+	uint32 nFlags = pcOutput->GetFlags() & ~Packet::FORMAT_CHANGED;
+	if( m_pcOutputInfo != m_pcLastInfo )
+	{
+		nFlags |= Packet::FORMAT_CHANGED;
+		m_pcOutputInfo->AddRef();
+		if( m_pcLastInfo )
+			m_pcLastInfo->Release();
+		m_pcLastInfo = m_pcOutputInfo;
+	}
+	pcOutput->SetFlags( nFlags );
+}
+
+status_t EffectStage::GetPacket( Packet **ppcPacket, int nInterface )
+{
+	size_t nCount;
+	return GetPackets( ppcPacket, 1, &nCount, nInterface );
+}
+
+status_t EffectStage::GetPackets( Packet **ppcPackets, size_t nMax, size_t *pnCount, int nInterface )
+{
+	*pnCount = 0;
+
+	if( nInterface > 0 || NULL == m_pcUpstream || nMax == 0 )
+		return EINVAL;
+
+	Packet *apcInput[BUFFER_BATCH_SIZE];
+	if( nMax > BUFFER_BATCH_SIZE )
+		nMax = BUFFER_BATCH_SIZE;
+
+	/* A packet may not produce anything, so we may need more than one batch */
+	while( *pnCount == 0 )
+	{
+		size_t nCount = m_pcUpstream->GetPackets( apcInput, nMax );
+		if( nCount == 0 )
+		{
+			/* Keep what is held back until the stream has really ended */
+			if( false == m_pcUpstream->IsEnded() )
+				return EIO;
+
+			Packet *pcOutput;
+			status_t nError = Drain( &pcOutput );
+			if( pcOutput )
+			{
+				SetOutputInfo( pcOutput );
+				ppcPackets[(*pnCount)++] = pcOutput;
+				return EOK;
+			}
+			return nError != EOK ? nError : EIO;
+		}
+
+		for( size_t i = 0; i < nCount; i++ )
+		{
+			Packet *pcOutput;
+			status_t nError = ProcessPacket( apcInput[i], &pcOutput );
+			if( nError != EOK )
+			{
+				for( i++; i < nCount; i++ )
+					m_pcPipeline->FreePacket( apcInput[i] );
+				return *pnCount > 0 ? EOK : nError;
+			}
+
+			if( pcOutput )
+				ppcPackets[(*pnCount)++] = pcOutput;
+		}
+	}
+
+	return EOK;
+}
+
+status_t EffectStage::Connect( Buffer *pcBuffer )
+{
+	m_pcUpstream = pcBuffer;
+	return EOK;
+}
@@ -0,0 +1,150 @@
+#include <stats.h>
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace os;
+using namespace media;
+
+void Histogram::Reset( void )
+{
+	memset( m_anBuckets, 0, sizeof( m_anBuckets ) );
+	m_nCount = 0;
+	m_nTotal = 0;
+	m_nMax = 0;
+}
+
+void Histogram::Merge( const Histogram &cOther )
+{
+	for( int i = 0; i < STATS_HISTOGRAM_SIZE; i++ )
+		m_anBuckets[i] += cOther.m_anBuckets[i];
+	m_nCount += cOther.m_nCount;
+	m_nTotal += cOther.m_nTotal;
+	if( cOther.m_nMax > m_nMax )
+		m_nMax = cOther.m_nMax;
+}
+
+bigtime_t Histogram::GetPercentile( int nPercent ) const
+{
+	if( m_nCount == 0 )
+		return 0;
+
+	uint64 nRank = ( m_nCount * nPercent + 99 ) / 100, nSeen = 0;
+	for( int i = 0; i < STATS_HISTOGRAM_SIZE - 1; i++ )
+	{
+		nSeen += m_anBuckets[i];
+		if( nSeen >= nRank && nSeen > 0 )
+		{
+			bigtime_t nLimit = (bigtime_t)1 << i;
+			return nLimit < m_nMax ? nLimit : m_nMax;
+		}
+	}
+	return m_nMax;
+}
+
+String Histogram::ToJSON( void ) const
+{
+	String cJSON, cValue;
+
+	cJSON.Format( "{\"count\":%llu,\"total_us\":%lld,\"max_us\":%lld,\"p50_us\":%lld,\"p99_us\":%lld,\"buckets\":[",
+				  (unsigned long long)m_nCount, (long long)m_nTotal, (long long)m_nMax,
+				  (long long)GetPercentile( 50 ), (long long)GetPercentile( 99 ) );
+
+	/* Leave off the empty buckets at the end */
+	int nLast = STATS_HISTOGRAM_SIZE;
+	while( nLast > 0 && m_anBuckets[nLast - 1] == 0 )
+		nLast--;
+
+	for( int i = 0; i < nLast; i++ )
+	{
+		cValue.Format( i > 0 ? ",%llu" : "%llu", (unsigned long long)m_anBuckets[i] );
+		cJSON += cValue;
+	}
+	cJSON += "]}";
+
+	return cJSON;
+}
+
+void stage_stats::Merge( const stage_stats &sOther )
+{
+	nCalls += sOther.nCalls;
+	nPackets += sOther.nPackets;
+	nBytes += sOther.nBytes;
+	nErrors += sOther.nErrors;
+	cLatency.Merge( sOther.cLatency );
+}
+
+/* Identifiers come from Stage names, which may contain anything */
+static String json_string( const String &cString )
+{
+	String cJSON = "\"";
+	char zChar[8];
+
+	for( const char *p = cString.c_str(); *p; p++ )
+	{
+		if( *p == '"' || *p == '\\' )
+		{
+			zChar[0] = '\\';
+			zChar[1] = *p;
+			zChar[2] = '\0';
+		}
+		else if( (uint8)*p < 0x20 )
+			snprintf( zChar, sizeof( zChar ), "\\u%04x", (uint8)*p );
+		else
+		{
+			zChar[0] = *p;
+			zChar[1] = '\0';
+		}
+		cJSON += zChar;
+	}
+	cJSON += "\"";
+
+	return cJSON;
+}
+
+String pipeline_snapshot::ToJSON( void ) const
+{
+	String cJSON, cValue;
+
+	cJSON.Format( "{\"pipeline\":%s,\"time_us\":%lld,\"stages\":[", json_string( cIdentifier ).c_str(), (long long)nTime );
+
+	for( size_t i = 0; i < vsStages.size(); i++ )
+	{
+		const stage_snapshot &sStage = vsStages[i];
+
+		if( i > 0 )
+			cJSON += ",";
+		cValue.Format( "{\"identifier\":%s,\"name\":%s,\"calls\":%llu,\"packets\":%llu,\"bytes\":%llu,\"errors\":%llu,\"latency\":",
+					   json_string( sStage.cIdentifier ).c_str(), json_string( sStage.cName ).c_str(),
+					   (unsigned long long)sStage.sStage.nCalls, (unsigned long long)sStage.sStage.nPackets,
+					   (unsigned long long)sStage.sStage.nBytes, (unsigned long long)sStage.sStage.nErrors );
+		cJSON += cValue;
+		cJSON += sStage.sStage.cLatency.ToJSON();
+		cJSON += ",\"buffers\":[";
+
+		for( size_t j = 0; j < sStage.vsBuffers.size(); j++ )
+		{
+			const buffer_stats &sBuffer = sStage.vsBuffers[j];
+
+			if( j > 0 )
+				cJSON += ",";
+			cValue.Format( "{\"output\":%d,\"count\":%u,\"min\":%u,\"max\":%u,\"bytes\":%lu,\"low_bytes\":%lu,\"high_bytes\":%lu,"
+						   "\"packets_in\":%llu,\"bytes_in\":%llu,\"packets_out\":%llu,\"bytes_out\":%llu,"
+						   "\"underruns\":%llu,\"overruns\":%llu,\"consumer_blocked_us\":%lld,\"producer_blocked_us\":%lld,"
+						   "\"get_latency\":",
+						   sBuffer.nOutput, sBuffer.nCount, sBuffer.nMin, sBuffer.nMax,
+						   (unsigned long)sBuffer.nBytes, (unsigned long)sBuffer.nLowBytes, (unsigned long)sBuffer.nHighBytes,
+						   (unsigned long long)sBuffer.nPacketsIn, (unsigned long long)sBuffer.nBytesIn,
+						   (unsigned long long)sBuffer.nPacketsOut, (unsigned long long)sBuffer.nBytesOut,
+						   (unsigned long long)sBuffer.nUnderruns, (unsigned long long)sBuffer.nOverruns,
+						   (long long)sBuffer.nConsumerBlocked, (long long)sBuffer.nProducerBlocked );
+			cJSON += cValue;
+			cJSON += sBuffer.cGetLatency.ToJSON();
+			cJSON += "}";
+		}
+		cJSON += "]}";
+	}
+	cJSON += "]}";
+
+	return cJSON;
+}
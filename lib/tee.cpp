@@ -0,0 +1,288 @@
+#include <tee.h>
+#include <pipeline.h>
+#include <buffer.h>
+#include <packet.h>
+
+using namespace os;
+using namespace media;
+
+TeeStage::TeeStage( int nOutputs, interface_t eInterface )
+{
+	m_pcUpstream = NULL;
+	m_eInterface = eInterface;
+
+	m_hLock = create_semaphore( "tee_lock", 1, SEMSTYLE_COUNTING );
+
+	m_nOldest = m_nNext = 0;
+
+	tee_output sOutput;
+	sOutput.nCursor = 0;
+	sOutput.ePolicy = TEE_BLOCK;
+	sOutput.bDetached = false;
+	sOutput.nDropped = 0;
+	sOutput.pLastInfo = NULL;
+	sOutput.bWaiting = false;
+	m_vsOutputs.assign( nOutputs > 0 ? nOutputs : 1, sOutput );
+
+	/* Each output sleeps on a semaphore of its own, so that one can't take a wake up meant for another */
+	std::vector<tee_output>::iterator i;
+	for( i = m_vsOutputs.begin(); i != m_vsOutputs.end(); i++ )
+		(*i).hWake = create_semaphore( "tee_wake", 0, SEMSTYLE_COUNTING );
+
+	m_bFetching = false;
+	m_bEnded = false;
+	m_bInterrupted = false;
+}
+
+TeeStage::~TeeStage()
+{
+	for( ; m_nOldest != m_nNext; m_nOldest++ )
+		m_pcPipeline->FreePacket( m_apcQueue[m_nOldest & ( TEE_QUEUE_SIZE - 1 )] );
+
+	std::vector<tee_output>::iterator i;
+	for( i = m_vsOutputs.begin(); i != m_vsOutputs.end(); i++ )
+		delete_semaphore( (*i).hWake );
+	delete_semaphore( m_hLock );
+}
+
+/* This should be called before the pipeline is started */
+status_t TeeStage::SetPolicy( tee_policy_t ePolicy, int nOutput )
+{
+	if( ePolicy < TEE_BLOCK || ePolicy > TEE_DETACH || nOutput < -1 || nOutput >= GetOutputCount() )
+		return EINVAL;
+
+	lock_semaphore( m_hLock );
+	for( int i = 0; i < GetOutputCount(); i++ )
+		if( nOutput == -1 || nOutput == i )
+			m_vsOutputs[i].ePolicy = ePolicy;
+	unlock_semaphore( m_hLock );
+
+	return EOK;
+}
+
+uint64 TeeStage::GetDropped( int nOutput )
+{
+	if( nOutput < 0 || nOutput >= GetOutputCount() )
+		return 0;
+
+	lock_semaphore( m_hLock );
+	uint64 nDropped = m_vsOutputs[nOutput].nDropped;
+	unlock_semaphore( m_hLock );
+
+	return nDropped;
+}
+
+bool TeeStage::IsDetached( int nOutput )
+{
+	if( nOutput < 0 || nOutput >= GetOutputCount() )
+		return false;
+
+	lock_semaphore( m_hLock );
+	bool bDetached = m_vsOutputs[nOutput].bDetached;
+	unlock_semaphore( m_hLock );
+
+	return bDetached;
+}
+
+/* Make room in the queue for at least one more packet by applying the policy of each output that still
+   has to take the oldest packet.  Returns false if one of them blocks us.  Called with the lock held */
+bool TeeStage::MakeSpace( void )
+{
+	if( m_nNext - m_nOldest < TEE_QUEUE_SIZE )
+		return true;
+
+	std::vector<tee_output>::iterator i;
+	for( i = m_vsOutputs.begin(); i != m_vsOutputs.end(); i++ )
+		if( false == (*i).bDetached && (*i).nCursor == m_nOldest && (*i).ePolicy == TEE_BLOCK )
+			return false;
+
+	for( i = m_vsOutputs.begin(); i != m_vsOutputs.end(); i++ )
+	{
+		if( (*i).bDetached || (*i).nCursor != m_nOldest )
+			continue;
+
+		if( (*i).ePolicy == TEE_DROP_OLDEST )
+		{
+			(*i).nCursor++;
+			(*i).nDropped++;
+		}
+		else
+			(*i).bDetached = true;
+	}
+
+	Reclaim();
+	return true;
+}
+
+/* Free the packets that every output has taken.  Called with the lock held */
+void TeeStage::Reclaim( void )
+{
+	while( m_nOldest != m_nNext )
+	{
+		std::vector<tee_output>::iterator i;
+		for( i = m_vsOutputs.begin(); i != m_vsOutputs.end(); i++ )
+			if( false == (*i).bDetached && (*i).nCursor == m_nOldest )
+				return;
+
+		m_pcPipeline->FreePacket( m_apcQueue[m_nOldest & ( TEE_QUEUE_SIZE - 1 )] );
+		m_nOldest++;
+	}
+}
+
+/* Called with the lock held */
+void TeeStage::Wake( void )
+{
+	std::vector<tee_output>::iterator i;
+	for( i = m_vsOutputs.begin(); i != m_vsOutputs.end(); i++ )
+	{
+		if( (*i).bWaiting )
+		{
+			(*i).bWaiting = false;
+			unlock_semaphore( (*i).hWake );
+		}
+	}
+}
+
+/* Return a new Packet that shares the payload of pcSource.  Called with the lock held */
+Packet * TeeStage::Deliver( struct tee_output *psOutput, Packet *pcSource )
+{
+	Packet *pcPacket = m_pcPipeline->AllocPacket();
+	if( NULL == pcPacket )
+		return NULL;
+	pcPacket->Slice( pcSource, 0, pcSource->GetDataSize() );
+
+	/* The output may have skipped the packet that changed the format */
+	uint32 nFlags = pcSource->GetFlags();
+	if( pcSource->GetInfo() != psOutput->pLastInfo )
+	{
+		nFlags |= Packet::FORMAT_CHANGED;
+		psOutput->pLastInfo = pcSource->GetInfo();
+	}
+	pcPacket->SetFlags( nFlags );
+
+	return pcPacket;
+}
+
+status_t TeeStage::GetPacket( Packet **ppcPacket, int nInterface )
+{
+	size_t nCount;
+	return GetPackets( ppcPacket, 1, &nCount, nInterface );
+}
+
+status_t TeeStage::GetPackets( Packet **ppcPackets, size_t nMax, size_t *pnCount, int nInterface )
+{
+	*pnCount = 0;
+
+	if( nInterface < 0 || nInterface >= GetOutputCount() || NULL == m_pcUpstream || nMax == 0 )
+		return EINVAL;
+
+	struct tee_output *psOutput = &m_vsOutputs[nInterface];
+
+	lock_semaphore( m_hLock );
+	while( true )
+	{
+		if( psOutput->bDetached || m_bInterrupted )
+			break;
+
+		/* Take whatever is already queued */
+		if( psOutput->nCursor != m_nNext )
+		{
+			while( *pnCount < nMax && psOutput->nCursor != m_nNext )
+			{
+				Packet *pcPacket = Deliver( psOutput, m_apcQueue[psOutput->nCursor & ( TEE_QUEUE_SIZE - 1 )] );
+				if( NULL == pcPacket )
+					break;
+
+				ppcPackets[(*pnCount)++] = pcPacket;
+				psOutput->nCursor++;
+			}
+
+			/* We may have been the output that the others were waiting for */
+			Reclaim();
+			Wake();
+			unlock_semaphore( m_hLock );
+
+			return *pnCount > 0 ? EOK : ENOMEM;
+		}
+
+		if( m_bEnded )
+			break;
+
+		/* Wait if another output is already reading from upstream, or the slowest has yet to catch up */
+		if( m_bFetching || MakeSpace() == false )
+		{
+			psOutput->bWaiting = true;
+			unlock_semaphore( m_hLock );
+			lock_semaphore( psOutput->hWake );
+			lock_semaphore( m_hLock );
+			continue;
+		}
+
+		/* Read from upstream without the lock, so that the other outputs can take what is queued.  Only the
+		   reader adds to the queue, so the space can only grow until we are done */
+		Packet *apcInput[BUFFER_BATCH_SIZE];
+		size_t nSpace = TEE_QUEUE_SIZE - ( m_nNext - m_nOldest );
+		if( nSpace > BUFFER_BATCH_SIZE )
+			nSpace = BUFFER_BATCH_SIZE;
+
+		m_bFetching = true;
+		unlock_semaphore( m_hLock );
+
+		size_t nCount = m_pcUpstream->GetPackets( apcInput, nSpace );
+
+		lock_semaphore( m_hLock );
+		m_bFetching = false;
+
+		/* Upstream may just have nothing yet, E.g. for the thread that is pushing into it */
+		if( nCount == 0 && false == m_pcUpstream->IsEnded() )
+		{
+			Wake();
+			break;
+		}
+
+		if( nCount == 0 )
+			m_bEnded = true;
+		for( size_t i = 0; i < nCount; i++ )
+			m_apcQueue[m_nNext++ & ( TEE_QUEUE_SIZE - 1 )] = apcInput[i];
+		Wake();
+	}
+	unlock_semaphore( m_hLock );
+
+	/* Detached, interrupted, the end of the stream or nothing yet */
+	return EIO;
+}
+
+status_t TeeStage::Connect( Buffer *pcBuffer )
+{
+	m_pcUpstream = pcBuffer;
+	return EOK;
+}
+
+/* The output we are waiting for may have been paused, so nobody waits until Flush() */
+void TeeStage::Interrupt( void )
+{
+	lock_semaphore( m_hLock );
+	m_bInterrupted = true;
+	Wake();
+	unlock_semaphore( m_hLock );
+}
+
+/* Start again with an empty queue.  Every output is attached again, as it has nothing to catch up on */
+void TeeStage::Flush( void )
+{
+	lock_semaphore( m_hLock );
+	for( ; m_nOldest != m_nNext; m_nOldest++ )
+		m_pcPipeline->FreePacket( m_apcQueue[m_nOldest & ( TEE_QUEUE_SIZE - 1 )] );
+
+	std::vector<tee_output>::iterator i;
+	for( i = m_vsOutputs.begin(); i != m_vsOutputs.end(); i++ )
+	{
+		(*i).nCursor = m_nNext;
+		(*i).bDetached = false;
+		(*i).pLastInfo = NULL;
+	}
+
+	m_bEnded = false;
+	m_bInterrupted = false;
+	unlock_semaphore( m_hLock );
+}
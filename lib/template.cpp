@@ -0,0 +1,250 @@
+#include <atheos/kdebug.h>
+
+#include <template.h>
+#include <pipeline.h>
+#include <stage.h>
+#include <buffer.h>
+#include <packet.h>
+#include <pool.h>
+#include <scheduler.h>
+
+#include <exception>
+
+using namespace os;
+using namespace media;
+
+PipelineTemplate::PipelineTemplate( String cIdentifier, Scheduler *pcScheduler, int nWorkers )
+{
+	m_cIdentifier = cIdentifier;
+
+	m_pcScheduler = pcScheduler;
+	m_bOwnScheduler = false;
+	if( NULL == m_pcScheduler )
+	{
+		m_pcScheduler = new Scheduler( nWorkers );
+		m_bOwnScheduler = true;
+	}
+
+	m_nReserveSize = 0;
+	m_nReserveCount = 0;
+}
+
+PipelineTemplate::~PipelineTemplate()
+{
+	if( m_bOwnScheduler )
+		delete m_pcScheduler;
+
+	for( size_t i = 0; i < m_vpsPlugins.size(); i++ )
+	{
+		unload_library( m_vpsPlugins[i]->hImage );
+		delete m_vpsPlugins[i];
+	}
+}
+
+/* Return the plugin at cPath, loading it if this is the first time it has been used */
+PipelineTemplate::template_plugin * PipelineTemplate::LoadPlugin( const String &cPath )
+{
+	for( size_t i = 0; i < m_vpsPlugins.size(); i++ )
+		if( m_vpsPlugins[i]->cPath == cPath )
+			return m_vpsPlugins[i];
+
+	image_id hImage = load_library( cPath.c_str(), 0 );
+	if( hImage < 0 )
+	{
+		dbprintf( "%s: failed to load %s\n", __FUNCTION__, cPath.c_str() );
+		return NULL;
+	}
+
+	Stage * (*pfGetInstance)( void ) = NULL;
+	if( get_symbol_address( hImage, "GetInstance", -1, (void**)&pfGetInstance ) < 0 )
+	{
+		dbprintf( "%s: %s has no GetInstance()\n", __FUNCTION__, cPath.c_str() );
+		unload_library( hImage );
+		return NULL;
+	}
+
+	template_plugin *psPlugin = new template_plugin;
+	psPlugin->cPath = cPath;
+	psPlugin->hImage = hImage;
+	psPlugin->pfGetInstance = pfGetInstance;
+	m_vpsPlugins.push_back( psPlugin );
+
+	return psPlugin;
+}
+
+int PipelineTemplate::FindStage( const String &cIdentifier )
+{
+	for( size_t i = 0; i < m_vsStages.size(); i++ )
+		if( m_vsStages[i].cIdentifier == cIdentifier )
+			return i;
+	return -1;
+}
+
+status_t PipelineTemplate::AddStage( String cPath, String &cIdentifier )
+{
+	template_plugin *psPlugin = LoadPlugin( cPath );
+	if( NULL == psPlugin )
+		return ENOENT;
+
+	/* The name comes from the Stage, so make one to ask */
+	Stage *pcStage = psPlugin->pfGetInstance();
+	if( NULL == pcStage )
+		return ENOMEM;
+
+	template_stage sStage;
+	sStage.psPlugin = psPlugin;
+	sStage.cName = pcStage->GetName();
+	delete pcStage;
+
+	/* The same identifier that InputPipeline::AddStage() will give it, as the stages are added in order */
+	int nCount = 0;
+	for( size_t i = 0; i < m_vsStages.size(); i++ )
+		if( m_vsStages[i].cName == sStage.cName )
+			nCount++;
+
+	cIdentifier.Format( "%s-%d", sStage.cName.c_str(), nCount );
+	sStage.cIdentifier = cIdentifier;
+	m_vsStages.push_back( sStage );
+
+	return EOK;
+}
+
+status_t PipelineTemplate::Connect( String cDownstream, String cUpstream, int nOutput, bool bCheck )
+{
+	int nDownstream = FindStage( cDownstream );
+	int nUpstream = FindStage( cUpstream );
+	if( nDownstream < 0 || nUpstream < 0 )
+		return ENOENT;
+	if( nDownstream == nUpstream || nOutput < 0 )
+		return EINVAL;
+
+	template_link sLink;
+	sLink.nDownstream = nDownstream;
+	sLink.nUpstream = nUpstream;
+	sLink.nOutput = nOutput;
+	sLink.bCheck = bCheck;
+	m_vsLinks.push_back( sLink );
+
+	return EOK;
+}
+
+status_t PipelineTemplate::SetReserve( size_t nSize, int nCount )
+{
+	if( nCount < 0 || ( nCount > 0 && nSize == 0 ) )
+		return EINVAL;
+
+	m_nReserveSize = nSize;
+	m_nReserveCount = nCount;
+	return EOK;
+}
+
+InputPipeline * PipelineTemplate::Instantiate( String cIdentifier, template_setup_fn pfSetup, void *pCookie )
+{
+	InputPipeline *pcPipeline = new InputPipeline( cIdentifier );
+	pcPipeline->SetScheduler( m_pcScheduler );
+
+	/* Fill the pool before anything starts, so the first packets don't come from the heap */
+	if( m_nReserveCount > 0 )
+		pcPipeline->GetPool()->Reserve( m_nReserveSize, m_nReserveCount );
+
+	std::vector<Stage*> vpcStages( m_vsStages.size() );
+	std::vector<bool> vbConnected( m_vsLinks.size(), false );
+	size_t nConnected = 0;
+	for( size_t i = 0; i < m_vsStages.size(); i++ )
+	{
+		Stage *pcStage = m_vsStages[i].psPlugin->pfGetInstance();
+		if( NULL == pcStage )
+			goto error;
+
+		/* Some stages throw rather than return an error, E.g. if a file can't be opened */
+		status_t nError = EOK;
+		try
+		{
+			if( pfSetup )
+				nError = pfSetup( m_vsStages[i].cIdentifier, pcStage, pCookie );
+		}
+		catch( std::exception &e )
+		{
+			nError = EIO;
+		}
+
+		if( nError != EOK )
+		{
+			delete pcStage;
+			goto error;
+		}
+
+		/* AddStage() only fails before it takes the stage, so until then it is ours */
+		String cStage;
+		if( pcPipeline->AddStage( static_cast<InputStage *>( pcStage ), cStage ) != EOK )
+		{
+			delete pcStage;
+			goto error;
+		}
+		vpcStages[i] = pcStage;
+
+		if( cStage != m_vsStages[i].cIdentifier )
+		{
+			dbprintf( "%s: %s was added as %s\n", __FUNCTION__, m_vsStages[i].cIdentifier.c_str(), cStage.c_str() );
+			goto error;
+		}
+	}
+
+	/* A check waits for the first packet of the upstream Buffer, which only runs once the upstream stage is
+	   a source or has been connected itself.  The links may have been added in any order, so a checked
+	   link is left until its upstream Buffer is running */
+	while( nConnected < m_vsLinks.size() )
+	{
+		size_t nPrevious = nConnected;
+
+		for( size_t i = 0; i < m_vsLinks.size(); i++ )
+		{
+			if( vbConnected[i] )
+				continue;
+
+			const template_link &sLink = m_vsLinks[i];
+			const String &cDownstream = m_vsStages[sLink.nDownstream].cIdentifier;
+			const String &cUpstream = m_vsStages[sLink.nUpstream].cIdentifier;
+
+			if( sLink.bCheck )
+			{
+				Buffer *pcBuffer = pcPipeline->GetBuffer( cUpstream, sLink.nOutput );
+				if( NULL == pcBuffer )
+				{
+					dbprintf( "%s: %s has no output %d\n", __FUNCTION__, cUpstream.c_str(), sLink.nOutput );
+					goto error;
+				}
+				if( false == pcBuffer->IsRunning() )
+					continue;
+
+				if( vpcStages[sLink.nDownstream]->Check( pcBuffer->GetPacket( false, false ) ) == false )
+				{
+					dbprintf( "%s: %s does not recognise the output of %s\n", __FUNCTION__, cDownstream.c_str(), cUpstream.c_str() );
+					goto error;
+				}
+			}
+
+			if( pcPipeline->Connect( cDownstream, cUpstream, sLink.nOutput ) != EOK )
+			{
+				dbprintf( "%s: failed to connect %s to %s\n", __FUNCTION__, cDownstream.c_str(), cUpstream.c_str() );
+				goto error;
+			}
+			vbConnected[i] = true;
+			nConnected++;
+		}
+
+		/* Whatever is left is checked against a Buffer that nothing will ever start */
+		if( nConnected == nPrevious )
+		{
+			dbprintf( "%s: %d checked links have no running input\n", __FUNCTION__, (int)( m_vsLinks.size() - nConnected ) );
+			goto error;
+		}
+	}
+
+	return pcPipeline;
+
+error:
+	pcPipeline->Stop();
+	delete pcPipeline;
+	return NULL;
+}
@@ -0,0 +1,175 @@
+#include <trace.h>
+
+#include <atheos/threads.h>
+#include <atheos/time.h>
+#include <util/locker.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+using namespace os;
+using namespace media;
+
+volatile bool Trace::s_bEnabled = false;
+int Trace::s_hTLD = alloc_tld( (void*)Trace::DetachThread );
+
+/* Every ring that has been attached, whether or not its thread is still alive */
+static Locker g_cLock( "trace_lock" );
+static struct trace_ring *g_psRings = NULL;
+
+/* The timestamp counter & the system time when recording started, used to convert one to the other */
+static uint64 g_nStartTSC = 0;
+static bigtime_t g_nStartTime = 0;
+
+static const char *g_apzNames[TRACE_EVENT_COUNT] =
+{
+	"GetPackets",
+	"push",
+	"pop",
+	"producer suspended",
+	"consumer waiting",
+	"alloc",
+	"free"
+};
+
+static const char *g_apzCategories[TRACE_EVENT_COUNT] =
+{
+	"stage",
+	"buffer",
+	"buffer",
+	"buffer",
+	"buffer",
+	"packet",
+	"packet"
+};
+
+void Trace::Enable( bool bEnable )
+{
+	g_cLock.Lock();
+	if( bEnable && 0 == g_nStartTSC )
+	{
+		g_nStartTime = get_system_time();
+		g_nStartTSC = GetTimestamp();
+	}
+	s_bEnabled = bEnable;
+	g_cLock.Unlock();
+}
+
+/* Called the first time a thread records an event */
+struct trace_ring * Trace::AttachThread( void )
+{
+	if( s_hTLD < 0 )
+		return NULL;
+
+	struct trace_ring *psRing = (struct trace_ring*)malloc( sizeof( struct trace_ring ) );
+	if( NULL == psRing )
+		return NULL;
+
+	psRing->nHead = 0;
+	psRing->hThread = get_thread_id( NULL );
+	psRing->bExited = false;
+
+	g_cLock.Lock();
+	psRing->psNext = g_psRings;
+	g_psRings = psRing;
+	g_cLock.Unlock();
+
+	set_tld( s_hTLD, psRing );
+
+	return psRing;
+}
+
+/* The TLD destructor.  The ring is kept so that its events can still be exported */
+void Trace::DetachThread( void *pRing )
+{
+	struct trace_ring *psRing = (struct trace_ring*)pRing;
+
+	g_cLock.Lock();
+	psRing->bExited = true;
+	g_cLock.Unlock();
+}
+
+void Trace::Clear( void )
+{
+	g_cLock.Lock();
+
+	struct trace_ring **ppsRing = &g_psRings;
+	while( *ppsRing )
+	{
+		struct trace_ring *psRing = *ppsRing;
+		if( psRing->bExited )
+		{
+			*ppsRing = psRing->psNext;
+			free( psRing );
+		}
+		else
+		{
+			/* The owner may still be recording, so the ring can only be emptied */
+			psRing->nHead = 0;
+			ppsRing = &psRing->psNext;
+		}
+	}
+	g_nStartTSC = 0;
+	if( s_bEnabled )
+	{
+		g_nStartTime = get_system_time();
+		g_nStartTSC = GetTimestamp();
+	}
+
+	g_cLock.Unlock();
+}
+
+status_t Trace::Export( String cPath )
+{
+	FILE *hFile = fopen( cPath.c_str(), "w" );
+	if( NULL == hFile )
+		return errno;
+
+	g_cLock.Lock();
+
+	/* Work out how many timestamp ticks there are in a microsecond */
+	bigtime_t nTime = get_system_time();
+	uint64 nTSC = GetTimestamp();
+	double vTicksPerUs = 1.0;
+	if( g_nStartTSC && nTime > g_nStartTime && nTSC > g_nStartTSC )
+		vTicksPerUs = (double)( nTSC - g_nStartTSC ) / ( nTime - g_nStartTime );
+
+	int nPid = getpid();
+	bool bFirst = true;
+
+	fprintf( hFile, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" );
+
+	for( struct trace_ring *psRing = g_psRings; psRing; psRing = psRing->psNext )
+	{
+		uint32 nHead = psRing->nHead;
+		uint32 nFirst = nHead > TRACE_RING_SIZE ? nHead - TRACE_RING_SIZE : 0;
+
+		for( uint32 i = nFirst; i < nHead; i++ )
+		{
+			const struct trace_event *psEvent = &psRing->asEvents[i & ( TRACE_RING_SIZE - 1 )];
+			if( psEvent->nEvent >= TRACE_EVENT_COUNT || psEvent->nTime < g_nStartTSC )
+				continue;
+
+			double vTime = ( psEvent->nTime - g_nStartTSC ) / vTicksPerUs;
+
+			fprintf( hFile, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,",
+					 bFirst ? "" : ",", g_apzNames[psEvent->nEvent], g_apzCategories[psEvent->nEvent],
+					 psEvent->nPhase, vTime, nPid, (int)psRing->hThread );
+			if( psEvent->nPhase == TRACE_INSTANT )
+				fprintf( hFile, "\"s\":\"t\"," );
+			fprintf( hFile, "\"args\":{\"object\":\"%p\",\"count\":%u}}", psEvent->pObject, psEvent->nArg );
+
+			bFirst = false;
+		}
+	}
+
+	g_cLock.Unlock();
+
+	fprintf( hFile, "\n]}\n" );
+	if( fclose( hFile ) != 0 )
+		return errno;
+
+	return EOK;
+}
@@ -0,0 +1,329 @@
+
+#include <pipeline.h>
+#include <stage.h>
+#include <interface.h>
+#include <packet.h>
+#include <buffer.h>
+#include <pool.h>
+
+#include <atheos/semaphore.h>
+#include <util/thread.h>
+#include <util/locker.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace os;
+using namespace media;
+
+#define ASYNC_DEFAULT_PACKET_SIZE	( 64 * 1024 )
+
+/* Number of reader threads, and the most reads that may be in flight at once */
+#define ASYNC_THREADS		4
+#define ASYNC_MAX_DEPTH		64
+
+/* One read.  Requests live in a ring that is indexed by the sequence number of the read */
+struct async_request
+{
+	off_t nOffset;
+	size_t nSize;
+	Packet *pcPacket;
+	status_t nError;
+	volatile bool bDone;
+};
+
+class AsyncStage;
+
+class ReaderThread : public Thread
+{
+	public:
+		ReaderThread( AsyncStage *pcParent ) : Thread( "async_reader", NORMAL_PRIORITY )
+		{
+			m_pcParent = pcParent;
+		};
+
+		int32 Run( void );
+
+	private:
+		AsyncStage *m_pcParent;
+};
+
+/* A source which keeps several reads in flight at once.  The reads are issued by a small pool of
+   reader threads with pread(); GetPacket() hands back the completed reads in file order, so the
+   output Buffer still has a single producer.  The number of reads in flight follows the maximum of
+   the output Buffer. */
+class AsyncStage : public SourceStage
+{
+	public:
+		AsyncStage();
+		~AsyncStage();
+
+		String GetName( void ){ return "source/async"; };
+
+		interface_t GetInputInterface( void ){ return SOURCE; };
+		interface_t GetOutputInterface( void ){ return DEMUX; };
+
+		status_t OpenUri( String cUri );
+		status_t SetPacketSize( size_t nSize );
+
+		/* We can only provide a single stream of data */
+		int GetOutputCount( void ){ return 1; };
+		status_t GetPacket( Packet **ppcPacket, int nInterface );
+
+		void SetOutputBuffer( Buffer *pcBuffer, int nOutput ){ m_pcOutput = pcBuffer; };
+
+		/* Can't connect us to anything upstream as we are SOURCE */
+		status_t Connect( Buffer *pcBuffer ){ return EINVAL; };
+
+	private:
+		friend class ReaderThread;
+
+		void Submit( void );
+		int32 Read( void );
+
+		int m_nFd;
+		off_t m_nFileSize;
+		off_t m_nPosition;			/* Offset of the next read to be submitted */
+		size_t m_nPacketSize;
+
+		Buffer *m_pcOutput;
+
+		struct async_request m_asRequests[ASYNC_MAX_DEPTH];
+		uint32 m_nNextSubmit;		/* Sequence number of the next read to submit */
+		uint32 m_nNextStart;		/* ..to be picked up by a reader */
+		uint32 m_nNextComplete;		/* ..to be returned by GetPacket() */
+
+		Locker m_cLock;				/* Protects m_nNextStart */
+		sem_id m_hWork;				/* Counts submitted reads; the readers wait here */
+		sem_id m_hDone;				/* Posted for every completed read */
+		int m_nCredits;				/* Completions taken from m_hDone ahead of GetPacket() */
+		sem_id m_hExit;				/* Posted by each reader as it exits */
+		volatile bool m_bQuit;
+
+		ReaderThread *m_apcThreads[ASYNC_THREADS];
+		bool m_bStarted;
+};
+
+int32 ReaderThread::Run( void )
+{
+	return m_pcParent->Read();
+}
+
+AsyncStage::AsyncStage() : m_cLock( "async_lock" )
+{
+	m_nFd = -1;
+	m_nFileSize = 0;
+	m_nPosition = 0;
+	m_nPacketSize = ASYNC_DEFAULT_PACKET_SIZE;
+
+	m_pcOutput = NULL;
+
+	m_nNextSubmit = m_nNextStart = m_nNextComplete = 0;
+	m_nCredits = 0;
+
+	m_hWork = create_semaphore( "async_work", 0, SEMSTYLE_COUNTING );
+	m_hDone = create_semaphore( "async_done", 0, SEMSTYLE_COUNTING );
+	m_hExit = create_semaphore( "async_exit", 0, SEMSTYLE_COUNTING );
+	m_bQuit = false;
+
+	for( int i = 0; i < ASYNC_THREADS; i++ )
+		m_apcThreads[i] = new ReaderThread( this );
+	m_bStarted = false;
+}
+
+AsyncStage::~AsyncStage()
+{
+	if( m_bStarted )
+	{
+		/* Wake every reader and wait for them all to exit */
+		m_bQuit = true;
+		unlock_semaphore_x( m_hWork, ASYNC_THREADS, 0 );
+		for( int i = 0; i < ASYNC_THREADS; i++ )
+			lock_semaphore( m_hExit );
+	}
+	for( int i = 0; i < ASYNC_THREADS; i++ )
+		delete m_apcThreads[i];
+
+	/* Free any reads that were never collected */
+	for( ; m_nNextComplete != m_nNextStart; m_nNextComplete++ )
+	{
+		struct async_request *psRequest = &m_asRequests[m_nNextComplete % ASYNC_MAX_DEPTH];
+		if( psRequest->pcPacket )
+			m_pcPipeline->FreePacket( psRequest->pcPacket );
+	}
+
+	delete_semaphore( m_hExit );
+	delete_semaphore( m_hDone );
+	delete_semaphore( m_hWork );
+
+	if( m_nFd >= 0 )
+		close( m_nFd );
+}
+
+#include <iostream>
+
+status_t AsyncStage::OpenUri( String cUri )
+{
+	if( m_nFd >= 0 )
+		return EINVAL;
+
+	m_nFd = open( cUri.c_str(), O_RDONLY );
+	if( m_nFd < 0 )
+	{
+		dbprintf( "%s: failed to open \"%s\"\n", __FUNCTION__, cUri.c_str() );
+		return errno;
+	}
+
+	struct stat sStat;
+	if( fstat( m_nFd, &sStat ) < 0 )
+	{
+		status_t nError = errno;
+		close( m_nFd );
+		m_nFd = -1;
+		return nError;
+	}
+	m_nFileSize = sStat.st_size;
+
+	std::cerr << "opened \"" << cUri.const_str() << "\" for asynchronous reading" << std::endl;
+
+	return EOK;
+}
+
+status_t AsyncStage::SetPacketSize( size_t nSize )
+{
+	if( nSize == 0 )
+		return EINVAL;
+
+	m_nPacketSize = nSize;
+	return EOK;
+}
+
+/* Submit reads until as many are in flight as the output Buffer will hold */
+void AsyncStage::Submit( void )
+{
+	unsigned int nMin = 1, nDepth = ASYNC_MAX_DEPTH / 4;
+	if( m_pcOutput )
+		m_pcOutput->GetMinMax( nMin, nDepth );
+	if( nDepth > ASYNC_MAX_DEPTH )
+		nDepth = ASYNC_MAX_DEPTH;
+
+	int nSubmitted = 0;
+	while( m_nNextSubmit - m_nNextComplete < nDepth && m_nPosition < m_nFileSize )
+	{
+		struct async_request *psRequest = &m_asRequests[m_nNextSubmit % ASYNC_MAX_DEPTH];
+
+		psRequest->nOffset = m_nPosition;
+		psRequest->nSize = m_nPacketSize;
+		if( m_nPosition + (off_t)m_nPacketSize > m_nFileSize )
+			psRequest->nSize = m_nFileSize - m_nPosition;
+		psRequest->pcPacket = NULL;
+		psRequest->nError = EOK;
+		psRequest->bDone = false;
+
+		m_nPosition += psRequest->nSize;
+		m_nNextSubmit++;
+		nSubmitted++;
+	}
+
+	if( nSubmitted > 0 )
+		unlock_semaphore_x( m_hWork, nSubmitted, 0 );
+}
+
+/* The body of each reader thread */
+int32 AsyncStage::Read( void )
+{
+	while( true )
+	{
+		lock_semaphore( m_hWork );
+		if( m_bQuit )
+			break;
+
+		m_cLock.Lock();
+		struct async_request *psRequest = &m_asRequests[m_nNextStart++ % ASYNC_MAX_DEPTH];
+		m_cLock.Unlock();
+
+		Packet *pcPacket = m_pcPipeline->AllocPacket();
+		uint8 *pData = pcPacket ? pcPacket->AllocData( psRequest->nSize ) : NULL;
+		if( NULL == pData )
+			psRequest->nError = ENOMEM;
+		else
+		{
+			ssize_t nSize = pread( m_nFd, pData, psRequest->nSize, psRequest->nOffset );
+			if( nSize <= 0 )
+				psRequest->nError = EIO;
+			else
+				pcPacket->SetDataSize( nSize );
+		}
+		psRequest->pcPacket = pcPacket;
+
+		__asm__ __volatile__( "" : : : "memory" );
+		psRequest->bDone = true;
+		unlock_semaphore( m_hDone );
+	}
+
+	PacketPool::FlushThreadCache();
+	unlock_semaphore( m_hExit );
+
+	return 0;
+}
+
+status_t AsyncStage::GetPacket( Packet **ppcPacket, int nInterface )
+{
+	if( nInterface > 0 || m_nFd < 0 || NULL == m_pcPipeline )
+		return EINVAL;
+
+	if( false == m_bStarted )
+	{
+		for( int i = 0; i < ASYNC_THREADS; i++ )
+			m_apcThreads[i]->Start();
+		m_bStarted = true;
+	}
+
+	/* Keep the readers busy */
+	Submit();
+
+	if( m_nNextComplete == m_nNextSubmit )
+		return EIO;
+
+	/* Wait for the oldest read to complete.  Reads may complete out of order, so any completions we
+	   consume while we wait are credited to the reads after this one */
+	struct async_request *psRequest = &m_asRequests[m_nNextComplete % ASYNC_MAX_DEPTH];
+	while( false == psRequest->bDone )
+	{
+		lock_semaphore( m_hDone );
+		m_nCredits++;
+	}
+	if( m_nCredits > 0 )
+		m_nCredits--;
+	else
+		lock_semaphore( m_hDone );
+	__asm__ __volatile__( "" : : : "memory" );
+
+	Packet *pcPacket = psRequest->pcPacket;
+	status_t nError = psRequest->nError;
+
+	psRequest->pcPacket = NULL;
+	m_nNextComplete++;
+
+	if( nError != EOK )
+	{
+		if( pcPacket )
+			m_pcPipeline->FreePacket( pcPacket );
+		return nError;
+	}
+
+	*ppcPacket = pcPacket;
+
+	return EOK;
+}
+
+extern "C"
+{
+	Stage * GetInstance( void )
+	{
+		return new AsyncStage();
+	}
+
+};
+
@@ -0,0 +1,510 @@
+#include <pipeline.h>
+#include <stage.h>
+#include <interface.h>
+#include <packet.h>
+#include <buffer.h>
+#include <cpu.h>
+
+#include <util/locker.h>
+
+#include "convert.h"
+
+using namespace os;
+using namespace media;
+
+/* Conversions that don't start or end with native floats go through a block of this many floats */
+#define CONVERT_BLOCK_SIZE	1024
+
+/* Number of samples used to check each SIMD kernel against its scalar version */
+#define CONVERT_TEST_SIZE	1027
+
+/* Scalar kernels.  These define the results that every other kernel must reproduce */
+
+static void decode_u8( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	for( size_t i = 0; i < nSamples; i++ )
+		pDst[i] = convert_decode_u8( pSrc[i] );
+}
+
+static void decode_s16le( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const int16 *pnSrc = (const int16*)pSrc;
+	for( size_t i = 0; i < nSamples; i++ )
+		pDst[i] = convert_decode_s16( pnSrc[i] );
+}
+
+static void decode_s16be( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const uint16 *pnSrc = (const uint16*)pSrc;
+	for( size_t i = 0; i < nSamples; i++ )
+		pDst[i] = convert_decode_s16( (int16)convert_swap16( pnSrc[i] ) );
+}
+
+static void decode_u16le( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const uint16 *pnSrc = (const uint16*)pSrc;
+	for( size_t i = 0; i < nSamples; i++ )
+		pDst[i] = convert_decode_s16( (int16)( pnSrc[i] ^ 0x8000 ) );
+}
+
+static void decode_u16be( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const uint16 *pnSrc = (const uint16*)pSrc;
+	for( size_t i = 0; i < nSamples; i++ )
+		pDst[i] = convert_decode_s16( (int16)( convert_swap16( pnSrc[i] ) ^ 0x8000 ) );
+}
+
+static void decode_s32le( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const int32 *pnSrc = (const int32*)pSrc;
+	for( size_t i = 0; i < nSamples; i++ )
+		pDst[i] = convert_decode_s32( pnSrc[i] );
+}
+
+static void decode_s32be( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const uint32 *pnSrc = (const uint32*)pSrc;
+	for( size_t i = 0; i < nSamples; i++ )
+		pDst[i] = convert_decode_s32( (int32)convert_swap32( pnSrc[i] ) );
+}
+
+static void decode_f32le( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	memcpy( pDst, pSrc, nSamples * sizeof( float ) );
+}
+
+static void decode_f32be( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const uint32 *pnSrc = (const uint32*)pSrc;
+	uint32 *pnDst = (uint32*)pDst;
+	for( size_t i = 0; i < nSamples; i++ )
+		pnDst[i] = convert_swap32( pnSrc[i] );
+}
+
+static void decode_s24le( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	for( size_t i = 0; i < nSamples; i++, pSrc += 3 )
+		pDst[i] = convert_decode_s24( pSrc[0], pSrc[1], pSrc[2] );
+}
+
+static void decode_s24be( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	for( size_t i = 0; i < nSamples; i++, pSrc += 3 )
+		pDst[i] = convert_decode_s24( pSrc[2], pSrc[1], pSrc[0] );
+}
+
+static void decode_f64le( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const double *pvSrc = (const double*)pSrc;
+	for( size_t i = 0; i < nSamples; i++ )
+		pDst[i] = (float)pvSrc[i];
+}
+
+static void decode_f64be( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const uint64 *pnSrc = (const uint64*)pSrc;
+	for( size_t i = 0; i < nSamples; i++ )
+	{
+		uint64 n = convert_swap64( pnSrc[i] );
+		double v;
+		memcpy( &v, &n, sizeof( v ) );
+		pDst[i] = (float)v;
+	}
+}
+
+static void encode_u8( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	for( size_t i = 0; i < nSamples; i++ )
+		pDst[i] = convert_encode_u8( pSrc[i] );
+}
+
+static void encode_s16le( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	int16 *pnDst = (int16*)pDst;
+	for( size_t i = 0; i < nSamples; i++ )
+		pnDst[i] = convert_encode_s16( pSrc[i] );
+}
+
+static void encode_s16be( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	uint16 *pnDst = (uint16*)pDst;
+	for( size_t i = 0; i < nSamples; i++ )
+		pnDst[i] = convert_swap16( (uint16)convert_encode_s16( pSrc[i] ) );
+}
+
+static void encode_u16le( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	uint16 *pnDst = (uint16*)pDst;
+	for( size_t i = 0; i < nSamples; i++ )
+		pnDst[i] = (uint16)convert_encode_s16( pSrc[i] ) ^ 0x8000;
+}
+
+static void encode_u16be( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	uint16 *pnDst = (uint16*)pDst;
+	for( size_t i = 0; i < nSamples; i++ )
+		pnDst[i] = convert_swap16( (uint16)convert_encode_s16( pSrc[i] ) ^ 0x8000 );
+}
+
+static void encode_s32le( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	int32 *pnDst = (int32*)pDst;
+	for( size_t i = 0; i < nSamples; i++ )
+		pnDst[i] = convert_encode_s32( pSrc[i] );
+}
+
+static void encode_s32be( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	uint32 *pnDst = (uint32*)pDst;
+	for( size_t i = 0; i < nSamples; i++ )
+		pnDst[i] = convert_swap32( (uint32)convert_encode_s32( pSrc[i] ) );
+}
+
+static void encode_f32le( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	memcpy( pDst, pSrc, nSamples * sizeof( float ) );
+}
+
+static void encode_f32be( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	decode_f32be( (const uint8*)pSrc, (float*)pDst, nSamples );
+}
+
+static void encode_s24le( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	for( size_t i = 0; i < nSamples; i++, pDst += 3 )
+	{
+		int32 n = convert_encode_s24( pSrc[i] );
+		pDst[0] = n;
+		pDst[1] = n >> 8;
+		pDst[2] = n >> 16;
+	}
+}
+
+static void encode_s24be( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	for( size_t i = 0; i < nSamples; i++, pDst += 3 )
+	{
+		int32 n = convert_encode_s24( pSrc[i] );
+		pDst[0] = n >> 16;
+		pDst[1] = n >> 8;
+		pDst[2] = n;
+	}
+}
+
+static void encode_f64le( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	double *pvDst = (double*)pDst;
+	for( size_t i = 0; i < nSamples; i++ )
+		pvDst[i] = pSrc[i];
+}
+
+static void encode_f64be( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	uint64 *pnDst = (uint64*)pDst;
+	for( size_t i = 0; i < nSamples; i++ )
+	{
+		double v = pSrc[i];
+		uint64 n;
+		memcpy( &n, &v, sizeof( n ) );
+		pnDst[i] = convert_swap64( n );
+	}
+}
+
+void get_scalar_kernels( struct convert_kernels *psKernels )
+{
+	psKernels->apfDecode[SAMPLE_U8] = decode_u8;
+	psKernels->apfDecode[SAMPLE_S16LE] = decode_s16le;
+	psKernels->apfDecode[SAMPLE_S16BE] = decode_s16be;
+	psKernels->apfDecode[SAMPLE_U16LE] = decode_u16le;
+	psKernels->apfDecode[SAMPLE_U16BE] = decode_u16be;
+	psKernels->apfDecode[SAMPLE_S32LE] = decode_s32le;
+	psKernels->apfDecode[SAMPLE_S32BE] = decode_s32be;
+	psKernels->apfDecode[SAMPLE_F32LE] = decode_f32le;
+	psKernels->apfDecode[SAMPLE_F32BE] = decode_f32be;
+	psKernels->apfDecode[SAMPLE_S24LE] = decode_s24le;
+	psKernels->apfDecode[SAMPLE_S24BE] = decode_s24be;
+	psKernels->apfDecode[SAMPLE_F64LE] = decode_f64le;
+	psKernels->apfDecode[SAMPLE_F64BE] = decode_f64be;
+
+	psKernels->apfEncode[SAMPLE_U8] = encode_u8;
+	psKernels->apfEncode[SAMPLE_S16LE] = encode_s16le;
+	psKernels->apfEncode[SAMPLE_S16BE] = encode_s16be;
+	psKernels->apfEncode[SAMPLE_U16LE] = encode_u16le;
+	psKernels->apfEncode[SAMPLE_U16BE] = encode_u16be;
+	psKernels->apfEncode[SAMPLE_S32LE] = encode_s32le;
+	psKernels->apfEncode[SAMPLE_S32BE] = encode_s32be;
+	psKernels->apfEncode[SAMPLE_F32LE] = encode_f32le;
+	psKernels->apfEncode[SAMPLE_F32BE] = encode_f32be;
+	psKernels->apfEncode[SAMPLE_S24LE] = encode_s24le;
+	psKernels->apfEncode[SAMPLE_S24BE] = encode_s24be;
+	psKernels->apfEncode[SAMPLE_F64LE] = encode_f64le;
+	psKernels->apfEncode[SAMPLE_F64BE] = encode_f64be;
+}
+
+static const size_t g_anSampleSize[SAMPLE_FORMAT_COUNT] = { 1, 2, 2, 2, 2, 4, 4, 4, 4, 3, 3, 8, 8 };
+
+/* The largest sample */
+#define CONVERT_MAX_SAMPLE_SIZE	8
+
+static bool get_sample_format( audio_format_t eFormat, uint32 nBitsPerSample, sample_format *peFormat )
+{
+	switch( eFormat )
+	{
+		case PCM_UNSIGNED_8:
+			*peFormat = SAMPLE_U8;
+			return nBitsPerSample == 8;
+		case PCM_UNSIGNED_LE:
+			*peFormat = SAMPLE_U16LE;
+			return nBitsPerSample == 16;
+		case PCM_UNSIGNED_BE:
+			*peFormat = SAMPLE_U16BE;
+			return nBitsPerSample == 16;
+		case PCM_SIGNED_LE:
+			*peFormat = nBitsPerSample == 32 ? SAMPLE_S32LE : nBitsPerSample == 24 ? SAMPLE_S24LE : SAMPLE_S16LE;
+			return nBitsPerSample == 16 || nBitsPerSample == 24 || nBitsPerSample == 32;
+		case PCM_SIGNED_BE:
+			*peFormat = nBitsPerSample == 32 ? SAMPLE_S32BE : nBitsPerSample == 24 ? SAMPLE_S24BE : SAMPLE_S16BE;
+			return nBitsPerSample == 16 || nBitsPerSample == 24 || nBitsPerSample == 32;
+		case PCM_FLOAT_LE:
+			*peFormat = nBitsPerSample == 64 ? SAMPLE_F64LE : SAMPLE_F32LE;
+			return nBitsPerSample == 32 || nBitsPerSample == 64;
+		case PCM_FLOAT_BE:
+			*peFormat = nBitsPerSample == 64 ? SAMPLE_F64BE : SAMPLE_F32BE;
+			return nBitsPerSample == 32 || nBitsPerSample == 64;
+		default:
+			return false;
+	}
+}
+
+/* The kernels in use, which are chosen the first time a ConvertStage is created */
+static Locker g_cKernelLock( "convert_kernels" );
+static struct convert_kernels g_sKernels;
+static bool g_bKernelsReady = false;
+
+/* Fill pData with a repeatable mixture of values, including the edge cases */
+static void fill_test_floats( float *pvData, size_t nCount )
+{
+	static const float avSpecial[] = { 0.0f, -0.0f, 1.0f, -1.0f, 0.5f / 32768.0f, 1.5f / 32768.0f, -0.5f / 128.0f,
+									   0.99999f, -1.00001f, 2.0f, -2.0f, 1e30f, -1e30f, INFINITY, -INFINITY, NAN };
+	const size_t nSpecial = sizeof( avSpecial ) / sizeof( avSpecial[0] );
+	uint32 nSeed = 1;
+
+	for( size_t i = 0; i < nCount; i++ )
+	{
+		nSeed = nSeed * 1103515245 + 12345;
+		if( i < nSpecial )
+			pvData[i] = avSpecial[i];
+		else if( i & 1 )
+			/* Exactly half way between two 16bit values, to check the rounding */
+			pvData[i] = ( (int)( nSeed >> 16 ) - 32768 + 0.5f ) / 32768.0f;
+		else
+			pvData[i] = ( (int)( nSeed >> 8 ) - 0x800000 ) / (float)0x700000;
+	}
+}
+
+/* Check that every kernel produces exactly the same results as the scalar kernel it replaces.  Any that
+   don't are replaced by the scalar version */
+static void verify_kernels( struct convert_kernels *psKernels, const struct convert_kernels *psScalar )
+{
+	/* The encoded samples start one byte in, so leave room for it */
+	uint8 anIn[CONVERT_TEST_SIZE * CONVERT_MAX_SAMPLE_SIZE], anOut1[CONVERT_TEST_SIZE * CONVERT_MAX_SAMPLE_SIZE + 1];
+	uint8 anOut2[CONVERT_TEST_SIZE * CONVERT_MAX_SAMPLE_SIZE + 1];
+	float avIn[CONVERT_TEST_SIZE], avOut1[CONVERT_TEST_SIZE], avOut2[CONVERT_TEST_SIZE];
+
+	uint32 nSeed = 1;
+	for( size_t i = 0; i < sizeof( anIn ); i++ )
+	{
+		nSeed = nSeed * 1103515245 + 12345;
+		anIn[i] = nSeed >> 16;
+	}
+	fill_test_floats( avIn, CONVERT_TEST_SIZE );
+
+	for( int i = 0; i < SAMPLE_FORMAT_COUNT; i++ )
+	{
+		if( psKernels->apfDecode[i] != psScalar->apfDecode[i] )
+		{
+			/* Start at an odd address to check that unaligned data is handled */
+			psKernels->apfDecode[i]( anIn + 1, avOut1, CONVERT_TEST_SIZE - 1 );
+			psScalar->apfDecode[i]( anIn + 1, avOut2, CONVERT_TEST_SIZE - 1 );
+			if( memcmp( avOut1, avOut2, ( CONVERT_TEST_SIZE - 1 ) * sizeof( float ) ) != 0 )
+			{
+				dbprintf( "convert: decode kernel %d does not match, using the scalar version\n", i );
+				psKernels->apfDecode[i] = psScalar->apfDecode[i];
+			}
+		}
+
+		if( psKernels->apfEncode[i] != psScalar->apfEncode[i] )
+		{
+			psKernels->apfEncode[i]( avIn, anOut1 + 1, CONVERT_TEST_SIZE );
+			psScalar->apfEncode[i]( avIn, anOut2 + 1, CONVERT_TEST_SIZE );
+			if( memcmp( anOut1 + 1, anOut2 + 1, CONVERT_TEST_SIZE * g_anSampleSize[i] ) != 0 )
+			{
+				dbprintf( "convert: encode kernel %d does not match, using the scalar version\n", i );
+				psKernels->apfEncode[i] = psScalar->apfEncode[i];
+			}
+		}
+	}
+}
+
+static void init_kernels( void )
+{
+	g_cKernelLock.Lock();
+	if( false == g_bKernelsReady )
+	{
+		struct convert_kernels sScalar;
+
+		get_scalar_kernels( &sScalar );
+		g_sKernels = sScalar;
+		if( get_cpu_features() & CPU_SSE2 )
+			get_sse2_kernels( &g_sKernels );
+		if( get_cpu_features() & CPU_AVX2 )
+			get_avx2_kernels( &g_sKernels );
+
+		verify_kernels( &g_sKernels, &sScalar );
+		g_bKernelsReady = true;
+	}
+	g_cKernelLock.Unlock();
+}
+
+/* Converts between any of the PCM sample formats & floats.  Use SetOutputFormat() to choose the format;
+   the default is native floats */
+class ConvertStage : public EffectStage
+{
+	public:
+		ConvertStage();
+		~ConvertStage();
+
+		String GetName( void ){ return "effect/convert"; };
+
+		interface_t GetInputInterface( void ){ return EFFECT; };
+		interface_t GetOutputInterface( void ){ return OUTPUT; };
+
+		bool Check( Packet *pcPacket );
+
+		status_t SetOutputFormat( audio_format_t eFormat, uint32 nBitsPerSample );
+
+	private:
+		status_t SetInputFormat( PacketInfo *pcInfo );
+		status_t Process( Packet *pcPacket, Packet **ppcOutput );
+		void TransformUnits( const uint8 *pSrc, uint8 *pDst, size_t nSamples );
+
+		audio_format_t m_eOutputFormat;
+		uint32 m_nOutputBits;
+
+		sample_format m_eInput, m_eOutput;
+		decode_fn m_pfDecode;
+		encode_fn m_pfEncode;
+};
+
+ConvertStage::ConvertStage()
+{
+	init_kernels();
+
+	m_eOutputFormat = PCM_FLOAT_LE;
+	m_nOutputBits = 32;
+
+	m_eInput = m_eOutput = SAMPLE_F32LE;
+	m_pfDecode = NULL;
+	m_pfEncode = NULL;
+}
+
+ConvertStage::~ConvertStage()
+{
+}
+
+bool ConvertStage::Check( Packet *pcPacket )
+{
+	if( NULL == pcPacket )
+		return false;
+
+	AudioPacketInfo *pcInfo = dynamic_cast<AudioPacketInfo*>( pcPacket->GetInfo() );
+	sample_format eFormat;
+
+	return pcInfo && get_sample_format( pcInfo->eFormat, pcInfo->nBitsPerSample, &eFormat );
+}
+
+/* This should be called before the pipeline is started */
+status_t ConvertStage::SetOutputFormat( audio_format_t eFormat, uint32 nBitsPerSample )
+{
+	sample_format eOutput;
+	if( get_sample_format( eFormat, nBitsPerSample, &eOutput ) == false )
+		return EINVAL;
+
+	m_eOutputFormat = eFormat;
+	m_nOutputBits = nBitsPerSample;
+
+	/* Pick the kernels again with the next packet */
+	SetInputInfo( NULL );
+
+	return EOK;
+}
+
+status_t ConvertStage::SetInputFormat( PacketInfo *pcInfo )
+{
+	AudioPacketInfo *pcAudioInfo = dynamic_cast<AudioPacketInfo*>( pcInfo );
+	if( NULL == pcAudioInfo || get_sample_format( pcAudioInfo->eFormat, pcAudioInfo->nBitsPerSample, &m_eInput ) == false )
+		return EINVAL;
+
+	get_sample_format( m_eOutputFormat, m_nOutputBits, &m_eOutput );
+	m_pfDecode = g_sKernels.apfDecode[m_eInput];
+	m_pfEncode = g_sKernels.apfEncode[m_eOutput];
+
+	if( m_pcOutputInfo )
+		m_pcOutputInfo->Release();
+	/* The precision of the input is only known to survive if the samples are passed through */
+	m_pcOutputInfo = AudioPacketInfo::Get( m_eOutputFormat, pcAudioInfo->nChannels, pcAudioInfo->nSampleRate, m_nOutputBits,
+										   m_eInput == m_eOutput ? pcAudioInfo->nValidBits : 0, pcAudioInfo->nChannelMask );
+
+	/* Part of a sample in the old format is no use to us now */
+	m_nCarry = 0;
+
+	return EOK;
+}
+
+void ConvertStage::TransformUnits( const uint8 *pSrc, uint8 *pDst, size_t nSamples )
+{
+	/* Avoid the intermediate copy if either end is already native floats */
+	if( m_eInput == SAMPLE_F32LE )
+		m_pfEncode( (const float*)pSrc, pDst, nSamples );
+	else if( m_eOutput == SAMPLE_F32LE )
+		m_pfDecode( pSrc, (float*)pDst, nSamples );
+	else
+	{
+		float avBlock[CONVERT_BLOCK_SIZE];
+
+		while( nSamples > 0 )
+		{
+			size_t nCount = nSamples > CONVERT_BLOCK_SIZE ? CONVERT_BLOCK_SIZE : nSamples;
+
+			m_pfDecode( pSrc, avBlock, nCount );
+			m_pfEncode( avBlock, pDst, nCount );
+
+			pSrc += nCount * g_anSampleSize[m_eInput];
+			pDst += nCount * g_anSampleSize[m_eOutput];
+			nSamples -= nCount;
+		}
+	}
+}
+
+/* Convert pcPacket, which is always consumed.  *ppcOutput is NULL if the packet did not complete a sample */
+status_t ConvertStage::Process( Packet *pcPacket, Packet **ppcOutput )
+{
+	/* Nothing to do, so pass the packet on as it is */
+	if( m_eInput == m_eOutput && m_nCarry == 0 )
+	{
+		*ppcOutput = pcPacket;
+		return EOK;
+	}
+
+	return ProcessUnits( pcPacket, g_anSampleSize[m_eInput], g_anSampleSize[m_eOutput], false, ppcOutput );
+}
+
+extern "C"
+{
+	Stage * GetInstance( void )
+	{
+		return new ConvertStage();
+	}
+
+};
@@ -0,0 +1,119 @@
+#ifndef __F_MEDIA_CONVERT_H_
+#define __F_MEDIA_CONVERT_H_
+
+#include <atheos/types.h>
+#include <math.h>
+
+/* Sample formats understood by the convert stage.  Every conversion goes through 32bit native floats, so
+   conversions between integer formats are exact for samples of up to 24 bits.  24bit samples are packed
+   into 3 bytes */
+enum sample_format
+{
+	SAMPLE_U8,
+	SAMPLE_S16LE,
+	SAMPLE_S16BE,
+	SAMPLE_U16LE,
+	SAMPLE_U16BE,
+	SAMPLE_S32LE,
+	SAMPLE_S32BE,
+	SAMPLE_F32LE,
+	SAMPLE_F32BE,
+	SAMPLE_S24LE,
+	SAMPLE_S24BE,
+	SAMPLE_F64LE,
+	SAMPLE_F64BE,
+	SAMPLE_FORMAT_COUNT
+};
+
+/* Decode nSamples samples to floats, or encode floats to samples.  Neither pointer need be aligned */
+typedef void (*decode_fn)( const uint8 *pSrc, float *pDst, size_t nSamples );
+typedef void (*encode_fn)( const float *pSrc, uint8 *pDst, size_t nSamples );
+
+struct convert_kernels
+{
+	decode_fn apfDecode[SAMPLE_FORMAT_COUNT];
+	encode_fn apfEncode[SAMPLE_FORMAT_COUNT];
+};
+
+/* Each fills in the kernels it has & leaves the rest alone.  The SIMD versions must only be called if
+   the CPU supports them */
+void get_scalar_kernels( struct convert_kernels *psKernels );
+void get_sse2_kernels( struct convert_kernels *psKernels );
+void get_avx2_kernels( struct convert_kernels *psKernels );
+
+/* The scalar conversion of a single sample.  The SIMD kernels use these for the samples left over at the
+   end of a block, and must produce exactly the same results for the rest.
+
+   Encoding scales to the integer range, clamps & rounds to nearest even.  The clamps are written so that
+   they behave like the SSE maxps & minps instructions, which return their second operand if either is
+   a NaN, so a NaN encodes as the most negative value */
+#define CONVERT_CLAMP( v, lo, hi )	do { v = ( v > lo ) ? v : lo; v = ( v < hi ) ? v : hi; } while( 0 )
+
+/* The largest float that is less than 2^31 */
+#define CONVERT_S32_MAX		2147483520.0f
+
+static inline uint16 convert_swap16( uint16 n )
+{
+	return ( n << 8 ) | ( n >> 8 );
+}
+
+static inline uint32 convert_swap32( uint32 n )
+{
+	return ( n << 24 ) | ( ( n << 8 ) & 0x00ff0000 ) | ( ( n >> 8 ) & 0x0000ff00 ) | ( n >> 24 );
+}
+
+static inline uint64 convert_swap64( uint64 n )
+{
+	return ( (uint64)convert_swap32( (uint32)n ) << 32 ) | convert_swap32( (uint32)( n >> 32 ) );
+}
+
+static inline float convert_decode_u8( uint8 n )
+{
+	return (float)( (int)n - 128 ) * ( 1.0f / 128.0f );
+}
+
+static inline float convert_decode_s16( int16 n )
+{
+	return (float)n * ( 1.0f / 32768.0f );
+}
+
+static inline float convert_decode_s32( int32 n )
+{
+	return (float)n * ( 1.0f / 2147483648.0f );
+}
+
+/* The bytes of a packed 24bit sample, from the least significant */
+static inline float convert_decode_s24( uint8 n0, uint8 n1, uint8 n2 )
+{
+	return (float)( (int32)( ( (uint32)n2 << 24 ) | ( (uint32)n1 << 16 ) | ( (uint32)n0 << 8 ) ) >> 8 ) * ( 1.0f / 8388608.0f );
+}
+
+static inline uint8 convert_encode_u8( float v )
+{
+	v *= 128.0f;
+	CONVERT_CLAMP( v, -128.0f, 127.0f );
+	return (uint8)( lrintf( v ) + 128 );
+}
+
+static inline int16 convert_encode_s16( float v )
+{
+	v *= 32768.0f;
+	CONVERT_CLAMP( v, -32768.0f, 32767.0f );
+	return (int16)lrintf( v );
+}
+
+static inline int32 convert_encode_s24( float v )
+{
+	v *= 8388608.0f;
+	CONVERT_CLAMP( v, -8388608.0f, 8388607.0f );
+	return (int32)lrintf( v );
+}
+
+static inline int32 convert_encode_s32( float v )
+{
+	v *= 2147483648.0f;
+	CONVERT_CLAMP( v, -2147483648.0f, CONVERT_S32_MAX );
+	return (int32)lrintf( v );
+}
+
+#endif	/* __F_MEDIA_CONVERT_H_ */
@@ -0,0 +1,80 @@
+#include "convert.h"
+
+/* This file is built with -mavx2 if the compiler supports it, and its kernels are only used if the CPU
+   & the OS do.  Only the conversions on the common ingest path have AVX2 versions; the SSE2 versions are
+   used for the rest */
+#ifdef __AVX2__
+
+#include <immintrin.h>
+
+static void decode_u8( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const __m256i nBias = _mm256_set1_epi32( 128 );
+	const __m256 vScale = _mm256_set1_ps( 1.0f / 128.0f );
+	size_t i;
+
+	for( i = 0; i + 8 <= nSamples; i += 8 )
+	{
+		__m256i x = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i*)( pSrc + i ) ) );
+		_mm256_storeu_ps( pDst + i, _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_sub_epi32( x, nBias ) ), vScale ) );
+	}
+	for( ; i < nSamples; i++ )
+		pDst[i] = convert_decode_u8( pSrc[i] );
+}
+
+static void decode_s16le( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const __m256 vScale = _mm256_set1_ps( 1.0f / 32768.0f );
+	const int16 *pnSrc = (const int16*)pSrc;
+	size_t i;
+
+	for( i = 0; i + 16 <= nSamples; i += 16 )
+	{
+		__m256i nLow = _mm256_cvtepi16_epi32( _mm_loadu_si128( (const __m128i*)( pnSrc + i ) ) );
+		__m256i nHigh = _mm256_cvtepi16_epi32( _mm_loadu_si128( (const __m128i*)( pnSrc + i + 8 ) ) );
+
+		_mm256_storeu_ps( pDst + i, _mm256_mul_ps( _mm256_cvtepi32_ps( nLow ), vScale ) );
+		_mm256_storeu_ps( pDst + i + 8, _mm256_mul_ps( _mm256_cvtepi32_ps( nHigh ), vScale ) );
+	}
+	for( ; i < nSamples; i++ )
+		pDst[i] = convert_decode_s16( pnSrc[i] );
+}
+
+static void encode_s16le( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	const __m256 vScale = _mm256_set1_ps( 32768.0f );
+	const __m256 vMin = _mm256_set1_ps( -32768.0f );
+	const __m256 vMax = _mm256_set1_ps( 32767.0f );
+	int16 *pnDst = (int16*)pDst;
+	size_t i;
+
+	for( i = 0; i + 16 <= nSamples; i += 16 )
+	{
+		/* The clamp must match CONVERT_CLAMP() */
+		__m256 vLow = _mm256_mul_ps( _mm256_loadu_ps( pSrc + i ), vScale );
+		__m256 vHigh = _mm256_mul_ps( _mm256_loadu_ps( pSrc + i + 8 ), vScale );
+		vLow = _mm256_min_ps( _mm256_max_ps( vLow, vMin ), vMax );
+		vHigh = _mm256_min_ps( _mm256_max_ps( vHigh, vMin ), vMax );
+
+		/* packs works within each 128bit lane, so put the lanes back in order afterwards */
+		__m256i n = _mm256_packs_epi32( _mm256_cvtps_epi32( vLow ), _mm256_cvtps_epi32( vHigh ) );
+		_mm256_storeu_si256( (__m256i*)( pnDst + i ), _mm256_permute4x64_epi64( n, 0xd8 ) );
+	}
+	for( ; i < nSamples; i++ )
+		pnDst[i] = convert_encode_s16( pSrc[i] );
+}
+
+void get_avx2_kernels( struct convert_kernels *psKernels )
+{
+	psKernels->apfDecode[SAMPLE_U8] = decode_u8;
+	psKernels->apfDecode[SAMPLE_S16LE] = decode_s16le;
+	psKernels->apfEncode[SAMPLE_S16LE] = encode_s16le;
+}
+
+#else
+
+void get_avx2_kernels( struct convert_kernels *psKernels )
+{
+}
+
+#endif	/* __AVX2__ */
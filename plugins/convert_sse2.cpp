@@ -0,0 +1,282 @@
+#include "convert.h"
+
+/* This file is built with -msse2, and its kernels are only used if the CPU has SSE2 */
+#ifdef __SSE2__
+
+#include <emmintrin.h>
+
+/* Swap the bytes of each 16 or 32 bit lane */
+static inline __m128i swap16( __m128i x )
+{
+	return _mm_or_si128( _mm_slli_epi16( x, 8 ), _mm_srli_epi16( x, 8 ) );
+}
+
+static inline __m128i swap32( __m128i x )
+{
+	x = swap16( x );
+	return _mm_or_si128( _mm_slli_epi32( x, 16 ), _mm_srli_epi32( x, 16 ) );
+}
+
+/* Convert eight 16bit samples to floats */
+static inline void decode8_s16( __m128i x, float *pDst )
+{
+	const __m128 vScale = _mm_set1_ps( 1.0f / 32768.0f );
+
+	/* Interleave each sample with itself & shift back down to sign extend it */
+	__m128i nLow = _mm_srai_epi32( _mm_unpacklo_epi16( x, x ), 16 );
+	__m128i nHigh = _mm_srai_epi32( _mm_unpackhi_epi16( x, x ), 16 );
+
+	_mm_storeu_ps( pDst, _mm_mul_ps( _mm_cvtepi32_ps( nLow ), vScale ) );
+	_mm_storeu_ps( pDst + 4, _mm_mul_ps( _mm_cvtepi32_ps( nHigh ), vScale ) );
+}
+
+/* Scale, clamp & round four floats.  The clamp must match CONVERT_CLAMP() */
+static inline __m128i encode4( const float *pSrc, __m128 vScale, __m128 vMin, __m128 vMax )
+{
+	__m128 v = _mm_mul_ps( _mm_loadu_ps( pSrc ), vScale );
+	v = _mm_min_ps( _mm_max_ps( v, vMin ), vMax );
+	return _mm_cvtps_epi32( v );
+}
+
+static void decode_u8( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const __m128i nZero = _mm_setzero_si128();
+	const __m128i nBias = _mm_set1_epi16( 128 );
+	const __m128 vScale = _mm_set1_ps( 1.0f / 128.0f );
+	size_t i;
+
+	for( i = 0; i + 16 <= nSamples; i += 16 )
+	{
+		__m128i x = _mm_loadu_si128( (const __m128i*)( pSrc + i ) );
+		__m128i nLow = _mm_sub_epi16( _mm_unpacklo_epi8( x, nZero ), nBias );
+		__m128i nHigh = _mm_sub_epi16( _mm_unpackhi_epi8( x, nZero ), nBias );
+
+		_mm_storeu_ps( pDst + i, _mm_mul_ps( _mm_cvtepi32_ps( _mm_srai_epi32( _mm_unpacklo_epi16( nLow, nLow ), 16 ) ), vScale ) );
+		_mm_storeu_ps( pDst + i + 4, _mm_mul_ps( _mm_cvtepi32_ps( _mm_srai_epi32( _mm_unpackhi_epi16( nLow, nLow ), 16 ) ), vScale ) );
+		_mm_storeu_ps( pDst + i + 8, _mm_mul_ps( _mm_cvtepi32_ps( _mm_srai_epi32( _mm_unpacklo_epi16( nHigh, nHigh ), 16 ) ), vScale ) );
+		_mm_storeu_ps( pDst + i + 12, _mm_mul_ps( _mm_cvtepi32_ps( _mm_srai_epi32( _mm_unpackhi_epi16( nHigh, nHigh ), 16 ) ), vScale ) );
+	}
+	for( ; i < nSamples; i++ )
+		pDst[i] = convert_decode_u8( pSrc[i] );
+}
+
+static void decode_s16le( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const int16 *pnSrc = (const int16*)pSrc;
+	size_t i;
+
+	for( i = 0; i + 8 <= nSamples; i += 8 )
+		decode8_s16( _mm_loadu_si128( (const __m128i*)( pnSrc + i ) ), pDst + i );
+	for( ; i < nSamples; i++ )
+		pDst[i] = convert_decode_s16( pnSrc[i] );
+}
+
+static void decode_s16be( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const uint16 *pnSrc = (const uint16*)pSrc;
+	size_t i;
+
+	for( i = 0; i + 8 <= nSamples; i += 8 )
+		decode8_s16( swap16( _mm_loadu_si128( (const __m128i*)( pnSrc + i ) ) ), pDst + i );
+	for( ; i < nSamples; i++ )
+		pDst[i] = convert_decode_s16( (int16)convert_swap16( pnSrc[i] ) );
+}
+
+static void decode_u16le( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const __m128i nSign = _mm_set1_epi16( (int16)0x8000 );
+	const uint16 *pnSrc = (const uint16*)pSrc;
+	size_t i;
+
+	for( i = 0; i + 8 <= nSamples; i += 8 )
+		decode8_s16( _mm_xor_si128( _mm_loadu_si128( (const __m128i*)( pnSrc + i ) ), nSign ), pDst + i );
+	for( ; i < nSamples; i++ )
+		pDst[i] = convert_decode_s16( (int16)( pnSrc[i] ^ 0x8000 ) );
+}
+
+static void decode_u16be( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const __m128i nSign = _mm_set1_epi16( (int16)0x8000 );
+	const uint16 *pnSrc = (const uint16*)pSrc;
+	size_t i;
+
+	for( i = 0; i + 8 <= nSamples; i += 8 )
+		decode8_s16( _mm_xor_si128( swap16( _mm_loadu_si128( (const __m128i*)( pnSrc + i ) ) ), nSign ), pDst + i );
+	for( ; i < nSamples; i++ )
+		pDst[i] = convert_decode_s16( (int16)( convert_swap16( pnSrc[i] ) ^ 0x8000 ) );
+}
+
+static void decode_s32le( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const __m128 vScale = _mm_set1_ps( 1.0f / 2147483648.0f );
+	const int32 *pnSrc = (const int32*)pSrc;
+	size_t i;
+
+	for( i = 0; i + 4 <= nSamples; i += 4 )
+		_mm_storeu_ps( pDst + i, _mm_mul_ps( _mm_cvtepi32_ps( _mm_loadu_si128( (const __m128i*)( pnSrc + i ) ) ), vScale ) );
+	for( ; i < nSamples; i++ )
+		pDst[i] = convert_decode_s32( pnSrc[i] );
+}
+
+static void decode_s32be( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const __m128 vScale = _mm_set1_ps( 1.0f / 2147483648.0f );
+	const uint32 *pnSrc = (const uint32*)pSrc;
+	size_t i;
+
+	for( i = 0; i + 4 <= nSamples; i += 4 )
+		_mm_storeu_ps( pDst + i, _mm_mul_ps( _mm_cvtepi32_ps( swap32( _mm_loadu_si128( (const __m128i*)( pnSrc + i ) ) ) ), vScale ) );
+	for( ; i < nSamples; i++ )
+		pDst[i] = convert_decode_s32( (int32)convert_swap32( pnSrc[i] ) );
+}
+
+static void decode_f32be( const uint8 *pSrc, float *pDst, size_t nSamples )
+{
+	const uint32 *pnSrc = (const uint32*)pSrc;
+	uint32 *pnDst = (uint32*)pDst;
+	size_t i;
+
+	for( i = 0; i + 4 <= nSamples; i += 4 )
+		_mm_storeu_si128( (__m128i*)( pnDst + i ), swap32( _mm_loadu_si128( (const __m128i*)( pnSrc + i ) ) ) );
+	for( ; i < nSamples; i++ )
+		pnDst[i] = convert_swap32( pnSrc[i] );
+}
+
+static void encode_u8( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	const __m128 vScale = _mm_set1_ps( 128.0f );
+	const __m128 vMin = _mm_set1_ps( -128.0f );
+	const __m128 vMax = _mm_set1_ps( 127.0f );
+	const __m128i nBias = _mm_set1_epi16( 128 );
+	size_t i;
+
+	for( i = 0; i + 16 <= nSamples; i += 16 )
+	{
+		__m128i nLow = _mm_packs_epi32( encode4( pSrc + i, vScale, vMin, vMax ), encode4( pSrc + i + 4, vScale, vMin, vMax ) );
+		__m128i nHigh = _mm_packs_epi32( encode4( pSrc + i + 8, vScale, vMin, vMax ), encode4( pSrc + i + 12, vScale, vMin, vMax ) );
+
+		nLow = _mm_add_epi16( nLow, nBias );
+		nHigh = _mm_add_epi16( nHigh, nBias );
+		_mm_storeu_si128( (__m128i*)( pDst + i ), _mm_packus_epi16( nLow, nHigh ) );
+	}
+	for( ; i < nSamples; i++ )
+		pDst[i] = convert_encode_u8( pSrc[i] );
+}
+
+/* Encode eight floats as 16bit samples, with the bytes swapped and/or the sign flipped */
+static inline __m128i encode8_s16( const float *pSrc )
+{
+	const __m128 vScale = _mm_set1_ps( 32768.0f );
+	const __m128 vMin = _mm_set1_ps( -32768.0f );
+	const __m128 vMax = _mm_set1_ps( 32767.0f );
+
+	return _mm_packs_epi32( encode4( pSrc, vScale, vMin, vMax ), encode4( pSrc + 4, vScale, vMin, vMax ) );
+}
+
+static void encode_s16le( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	int16 *pnDst = (int16*)pDst;
+	size_t i;
+
+	for( i = 0; i + 8 <= nSamples; i += 8 )
+		_mm_storeu_si128( (__m128i*)( pnDst + i ), encode8_s16( pSrc + i ) );
+	for( ; i < nSamples; i++ )
+		pnDst[i] = convert_encode_s16( pSrc[i] );
+}
+
+static void encode_s16be( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	uint16 *pnDst = (uint16*)pDst;
+	size_t i;
+
+	for( i = 0; i + 8 <= nSamples; i += 8 )
+		_mm_storeu_si128( (__m128i*)( pnDst + i ), swap16( encode8_s16( pSrc + i ) ) );
+	for( ; i < nSamples; i++ )
+		pnDst[i] = convert_swap16( (uint16)convert_encode_s16( pSrc[i] ) );
+}
+
+static void encode_u16le( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	const __m128i nSign = _mm_set1_epi16( (int16)0x8000 );
+	uint16 *pnDst = (uint16*)pDst;
+	size_t i;
+
+	for( i = 0; i + 8 <= nSamples; i += 8 )
+		_mm_storeu_si128( (__m128i*)( pnDst + i ), _mm_xor_si128( encode8_s16( pSrc + i ), nSign ) );
+	for( ; i < nSamples; i++ )
+		pnDst[i] = (uint16)convert_encode_s16( pSrc[i] ) ^ 0x8000;
+}
+
+static void encode_u16be( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	const __m128i nSign = _mm_set1_epi16( (int16)0x8000 );
+	uint16 *pnDst = (uint16*)pDst;
+	size_t i;
+
+	for( i = 0; i + 8 <= nSamples; i += 8 )
+		_mm_storeu_si128( (__m128i*)( pnDst + i ), swap16( _mm_xor_si128( encode8_s16( pSrc + i ), nSign ) ) );
+	for( ; i < nSamples; i++ )
+		pnDst[i] = convert_swap16( (uint16)convert_encode_s16( pSrc[i] ) ^ 0x8000 );
+}
+
+static void encode_s32le( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	const __m128 vScale = _mm_set1_ps( 2147483648.0f );
+	const __m128 vMin = _mm_set1_ps( -2147483648.0f );
+	const __m128 vMax = _mm_set1_ps( CONVERT_S32_MAX );
+	int32 *pnDst = (int32*)pDst;
+	size_t i;
+
+	for( i = 0; i + 4 <= nSamples; i += 4 )
+		_mm_storeu_si128( (__m128i*)( pnDst + i ), encode4( pSrc + i, vScale, vMin, vMax ) );
+	for( ; i < nSamples; i++ )
+		pnDst[i] = convert_encode_s32( pSrc[i] );
+}
+
+static void encode_s32be( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	const __m128 vScale = _mm_set1_ps( 2147483648.0f );
+	const __m128 vMin = _mm_set1_ps( -2147483648.0f );
+	const __m128 vMax = _mm_set1_ps( CONVERT_S32_MAX );
+	uint32 *pnDst = (uint32*)pDst;
+	size_t i;
+
+	for( i = 0; i + 4 <= nSamples; i += 4 )
+		_mm_storeu_si128( (__m128i*)( pnDst + i ), swap32( encode4( pSrc + i, vScale, vMin, vMax ) ) );
+	for( ; i < nSamples; i++ )
+		pnDst[i] = convert_swap32( (uint32)convert_encode_s32( pSrc[i] ) );
+}
+
+static void encode_f32be( const float *pSrc, uint8 *pDst, size_t nSamples )
+{
+	decode_f32be( (const uint8*)pSrc, (float*)pDst, nSamples );
+}
+
+void get_sse2_kernels( struct convert_kernels *psKernels )
+{
+	psKernels->apfDecode[SAMPLE_U8] = decode_u8;
+	psKernels->apfDecode[SAMPLE_S16LE] = decode_s16le;
+	psKernels->apfDecode[SAMPLE_S16BE] = decode_s16be;
+	psKernels->apfDecode[SAMPLE_U16LE] = decode_u16le;
+	psKernels->apfDecode[SAMPLE_U16BE] = decode_u16be;
+	psKernels->apfDecode[SAMPLE_S32LE] = decode_s32le;
+	psKernels->apfDecode[SAMPLE_S32BE] = decode_s32be;
+	psKernels->apfDecode[SAMPLE_F32BE] = decode_f32be;
+
+	psKernels->apfEncode[SAMPLE_U8] = encode_u8;
+	psKernels->apfEncode[SAMPLE_S16LE] = encode_s16le;
+	psKernels->apfEncode[SAMPLE_S16BE] = encode_s16be;
+	psKernels->apfEncode[SAMPLE_U16LE] = encode_u16le;
+	psKernels->apfEncode[SAMPLE_U16BE] = encode_u16be;
+	psKernels->apfEncode[SAMPLE_S32LE] = encode_s32le;
+	psKernels->apfEncode[SAMPLE_S32BE] = encode_s32be;
+	psKernels->apfEncode[SAMPLE_F32BE] = encode_f32be;
+}
+
+#else
+
+void get_sse2_kernels( struct convert_kernels *psKernels )
+{
+}
+
+#endif	/* __SSE2__ */
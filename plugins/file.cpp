@@ -2,12 +2,16 @@
 #include <stage.h>
 #include <interface.h>
 #include <packet.h>
+#include <buffer.h>
 
 #include <storage/file.h>
 
 using namespace os;
 using namespace media;
 
+#define FILE_DEFAULT_PACKET_SIZE	4096
+#define FILE_MAX_PACKET_SIZE		( 16 * 1024 * 1024 )
+
 class FileStage : public SourceStage
 {
 	public:
@@ -20,30 +24,45 @@ class FileStage : public SourceStage
 		interface_t GetOutputInterface( void ){ return DEMUX; };
 
 		status_t OpenUri( String cUri );
+		status_t SetPacketSize( size_t nSize );
+		status_t SetAdaptivePacketSize( size_t nMin, size_t nMax );
 
 		/* We can only provide a single stream of data */
 		int GetOutputCount( void ){ return 1; };
 		status_t GetPacket( Packet **ppcPacket, int nInterface );
+		status_t GetPacketAt( Packet *pcPacket, uint64 nOffset, size_t nSize );
+		size_t GetMaxPacketSize( void ){ return FILE_MAX_PACKET_SIZE; };
+		status_t Seek( uint64 nOffset );
+
+		void SetOutputBuffer( Buffer *pcBuffer, int nOutput ){ m_pcOutput = pcBuffer; };
 
 		/* Can't connect us to anything upstream as we are SOURCE */
 		status_t Connect( Buffer *pcBuffer ){ return EINVAL; };
 
 	private:
+		void Adapt( void );
+
 		File *m_pcFile;
-		uint8 *m_pcData;
+		Buffer *m_pcOutput;
+
+		size_t m_nPacketSize;
+		size_t m_nMinPacketSize, m_nMaxPacketSize;	/* Equal unless the packet size is adaptive */
+		unsigned int m_nHealthy;					/* Packets read since the output Buffer last ran dry */
 };
 
 FileStage::FileStage()
 {
 	m_pcFile = NULL;
-	m_pcData = new uint8[4096];
+	m_pcOutput = NULL;
+
+	m_nPacketSize = m_nMinPacketSize = m_nMaxPacketSize = FILE_DEFAULT_PACKET_SIZE;
+	m_nHealthy = 0;
 }
 
 FileStage::~FileStage()
 {
 	if( m_pcFile )
 		delete m_pcFile;
-	delete m_pcData;
 }
 
 #include <iostream>
@@ -68,25 +87,141 @@ status_t FileStage::OpenUri( String cUri )
 	return EOK;
 }
 
+status_t FileStage::SetPacketSize( size_t nSize )
+{
+	if( nSize == 0 || nSize > FILE_MAX_PACKET_SIZE )
+		return EINVAL;
+
+	m_nPacketSize = m_nMinPacketSize = m_nMaxPacketSize = nSize;
+	return EOK;
+}
+
+status_t FileStage::SetAdaptivePacketSize( size_t nMin, size_t nMax )
+{
+	if( nMin == 0 || nMax < nMin || nMax > FILE_MAX_PACKET_SIZE )
+		return EINVAL;
+
+	m_nMinPacketSize = nMin;
+	m_nMaxPacketSize = nMax;
+	if( m_nPacketSize < nMin )
+		m_nPacketSize = nMin;
+	if( m_nPacketSize > nMax )
+		m_nPacketSize = nMax;
+	m_nHealthy = 0;
+
+	return EOK;
+}
+
+/* If the consumer has emptied the output Buffer it is draining faster than we fill it, so double the
+   read size.  If the Buffer has stayed above its minimum for a while, halve it again to keep latency
+   down */
+void FileStage::Adapt( void )
+{
+	if( m_nMinPacketSize == m_nMaxPacketSize || NULL == m_pcOutput )
+		return;
+
+	unsigned int nMin, nMax;
+	m_pcOutput->GetMinMax( nMin, nMax );
+	size_t nCount = m_pcOutput->GetCount();
+
+	if( nCount == 0 )
+	{
+		m_nHealthy = 0;
+		if( m_nPacketSize < m_nMaxPacketSize )
+		{
+			m_nPacketSize *= 2;
+			if( m_nPacketSize > m_nMaxPacketSize )
+				m_nPacketSize = m_nMaxPacketSize;
+		}
+	}
+	else if( nCount >= nMin && ++m_nHealthy >= 4 * nMax )
+	{
+		m_nHealthy = 0;
+		if( m_nPacketSize > m_nMinPacketSize )
+		{
+			m_nPacketSize /= 2;
+			if( m_nPacketSize < m_nMinPacketSize )
+				m_nPacketSize = m_nMinPacketSize;
+		}
+	}
+}
+
 status_t FileStage::GetPacket( Packet **ppcPacket, int nInterface )
 {
 	if( nInterface > 0 || NULL == m_pcFile || NULL == m_pcPipeline )
 		return EINVAL;
 
+	Adapt();
+
 	Packet *pcPacket = m_pcPipeline->AllocPacket();
 	if( NULL == pcPacket )
 		return ENOMEM;
 
-	size_t nSize = m_pcFile->Read( m_pcData, 4096 );
+	/* Read straight into the packet payload */
+	uint8 *pData = pcPacket->AllocData( m_nPacketSize );
+	if( NULL == pData )
+	{
+		m_pcPipeline->FreePacket( pcPacket );
+		return ENOMEM;
+	}
+
+	ssize_t nSize = m_pcFile->Read( pData, m_nPacketSize );
 	if( nSize <= 0 )
+	{
+		m_pcPipeline->FreePacket( pcPacket );
 		return EIO;
+	}
 
-	pcPacket->SetData( m_pcData, nSize );
+	pcPacket->SetDataSize( nSize );
 	*ppcPacket = pcPacket;
 
 	return EOK;
 }
 
+/* ReadPos() doesn't move the file position, so this can run alongside GetPacket() & itself */
+status_t FileStage::GetPacketAt( Packet *pcPacket, uint64 nOffset, size_t nSize )
+{
+	if( NULL == pcPacket || NULL == m_pcFile || nSize == 0 || nSize > FILE_MAX_PACKET_SIZE )
+		return EINVAL;
+
+	uint8 *pData = pcPacket->AllocData( nSize );
+	if( NULL == pData )
+		return ENOMEM;
+
+	size_t nRead = 0;
+	while( nRead < nSize )
+	{
+		ssize_t nCount = m_pcFile->ReadPos( nOffset + nRead, pData + nRead, nSize - nRead );
+		if( nCount < 0 )
+		{
+			pcPacket->SetDataSize( 0 );
+			return EIO;
+		}
+		if( nCount == 0 )
+			break;
+		nRead += nCount;
+	}
+
+	/* A short or empty packet is the end of the file */
+	pcPacket->SetDataSize( nRead );
+	return EOK;
+}
+
+status_t FileStage::Seek( uint64 nOffset )
+{
+	if( NULL == m_pcFile )
+		return EINVAL;
+
+	if( m_pcFile->Seek( nOffset, SEEK_SET ) < 0 )
+		return EIO;
+
+	/* Start again from the smallest packets, so that the first one arrives quickly */
+	m_nPacketSize = m_nMinPacketSize;
+	m_nHealthy = 0;
+
+	return EOK;
+}
+
 extern "C"
 {
 	Stage * GetInstance( void )
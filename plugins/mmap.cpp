@@ -0,0 +1,335 @@
+
+#include <pipeline.h>
+#include <stage.h>
+#include <interface.h>
+#include <packet.h>
+#include <buffer.h>
+
+#include <atheos/atomic.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace os;
+using namespace media;
+
+/* The file is mapped in windows of this size, so that files larger than the address space can be read */
+#define MMAP_WINDOW_SIZE	( 32 * 1024 * 1024 )
+
+#define MMAP_DEFAULT_PACKET_SIZE	4096
+
+/* A mapped window of the file.  Every packet that points into the window holds a reference to it, so
+   the window is only unmapped once the Stage and all of the packets are finished with it */
+class MappedRegion
+{
+	public:
+		MappedRegion( uint8 *pAddress, off_t nOffset, size_t nSize )
+		{
+			atomic_set( &m_nRefCount, 1 );
+			m_pAddress = pAddress;
+			m_nOffset = nOffset;
+			m_nSize = nSize;
+		};
+
+		void AddRef( void ){ atomic_inc( &m_nRefCount ); };
+		void Release( void )
+		{
+			if( atomic_dec_and_test( &m_nRefCount ) )
+			{
+				munmap( m_pAddress, m_nSize );
+				delete this;
+			}
+		};
+
+		/* Used as the PacketData release hook */
+		static void ReleaseHook( void *pCookie )
+		{
+			static_cast<MappedRegion*>( pCookie )->Release();
+		};
+
+		uint8 *m_pAddress;
+		off_t m_nOffset;		/* Offset of the window within the file */
+		size_t m_nSize;
+
+	private:
+		~MappedRegion(){};
+		atomic_t m_nRefCount;
+};
+
+class MmapStage : public SourceStage
+{
+	public:
+		MmapStage();
+		~MmapStage();
+
+		String GetName( void ){ return "source/mmap"; };
+
+		interface_t GetInputInterface( void ){ return SOURCE; };
+		interface_t GetOutputInterface( void ){ return DEMUX; };
+
+		status_t OpenUri( String cUri );
+		status_t SetPacketSize( size_t nSize );
+
+		/* We can only provide a single stream of data */
+		int GetOutputCount( void ){ return 1; };
+		status_t GetPacket( Packet **ppcPacket, int nInterface );
+		status_t GetPackets( Packet **ppcPackets, size_t nMax, size_t *pnCount, int nInterface );
+		status_t GetPacketAt( Packet *pcPacket, uint64 nOffset, size_t nSize );
+		size_t GetMaxPacketSize( void ){ return MMAP_WINDOW_SIZE; };
+		status_t Seek( uint64 nOffset );
+
+		void SetOutputBuffer( Buffer *pcBuffer, int nOutput ){ m_pcOutput = pcBuffer; };
+
+		/* Can't connect us to anything upstream as we are SOURCE */
+		status_t Connect( Buffer *pcBuffer ){ return EINVAL; };
+
+	private:
+		status_t MapWindow( off_t nPosition );
+		void Advise( void );
+
+		int m_nFd;
+		off_t m_nFileSize;
+		off_t m_nPosition;		/* Offset of the next packet within the file */
+		off_t m_nAdvised;		/* We have asked the kernel to read ahead up to here */
+
+		size_t m_nPacketSize;
+		long m_nPageSize;
+
+		MappedRegion *m_pcRegion;
+		Buffer *m_pcOutput;
+};
+
+MmapStage::MmapStage()
+{
+	m_nFd = -1;
+	m_nFileSize = 0;
+	m_nPosition = 0;
+	m_nAdvised = 0;
+
+	m_nPacketSize = MMAP_DEFAULT_PACKET_SIZE;
+	m_nPageSize = sysconf( _SC_PAGESIZE );
+
+	m_pcRegion = NULL;
+	m_pcOutput = NULL;
+}
+
+MmapStage::~MmapStage()
+{
+	/* Packets that are still in flight keep their window mapped */
+	if( m_pcRegion )
+		m_pcRegion->Release();
+	if( m_nFd >= 0 )
+		close( m_nFd );
+}
+
+#include <iostream>
+
+status_t MmapStage::OpenUri( String cUri )
+{
+	if( m_nFd >= 0 )
+		return EINVAL;
+
+	m_nFd = open( cUri.c_str(), O_RDONLY );
+	if( m_nFd < 0 )
+	{
+		dbprintf( "%s: failed to open \"%s\"\n", __FUNCTION__, cUri.c_str() );
+		return errno;
+	}
+
+	struct stat sStat;
+	if( fstat( m_nFd, &sStat ) < 0 )
+	{
+		status_t nError = errno;
+		close( m_nFd );
+		m_nFd = -1;
+		return nError;
+	}
+	m_nFileSize = sStat.st_size;
+
+	std::cerr << "mapped \"" << cUri.const_str() << "\" for reading" << std::endl;
+
+	return EOK;
+}
+
+status_t MmapStage::SetPacketSize( size_t nSize )
+{
+	if( nSize == 0 || nSize > MMAP_WINDOW_SIZE )
+		return EINVAL;
+
+	m_nPacketSize = nSize;
+	return EOK;
+}
+
+/* Map the window of the file that contains nPosition */
+status_t MmapStage::MapWindow( off_t nPosition )
+{
+	off_t nOffset = nPosition - ( nPosition % MMAP_WINDOW_SIZE );
+	size_t nSize = MMAP_WINDOW_SIZE;
+	if( nOffset + (off_t)nSize > m_nFileSize )
+		nSize = m_nFileSize - nOffset;
+
+	void *pAddress = mmap( NULL, nSize, PROT_READ, MAP_SHARED, m_nFd, nOffset );
+	if( MAP_FAILED == pAddress )
+		return errno;
+
+	madvise( pAddress, nSize, MADV_SEQUENTIAL );
+
+	if( m_pcRegion )
+		m_pcRegion->Release();
+	m_pcRegion = new MappedRegion( (uint8*)pAddress, nOffset, nSize );
+
+	m_nAdvised = nPosition;
+
+	return EOK;
+}
+
+/* Keep the kernel reading ahead of us by as much as the downstream Buffer will hold.  We re-issue the
+   advice whenever less than the Buffers minimum is left in the readahead window */
+void MmapStage::Advise( void )
+{
+	unsigned int nMin = 1, nMax = 1;
+	if( m_pcOutput )
+		m_pcOutput->GetMinMax( nMin, nMax );
+
+	if( m_nAdvised - m_nPosition > (off_t)( nMin * m_nPacketSize ) )
+		return;
+
+	off_t nStart = m_nAdvised > m_nPosition ? m_nAdvised : m_nPosition;
+	off_t nEnd = m_nPosition + (off_t)( nMax * m_nPacketSize );
+	off_t nWindowEnd = m_pcRegion->m_nOffset + m_pcRegion->m_nSize;
+	if( nEnd > nWindowEnd )
+		nEnd = nWindowEnd;
+	if( nEnd <= nStart )
+		return;
+
+	/* madvise() wants a page aligned address */
+	off_t nAligned = nStart - ( ( nStart - m_pcRegion->m_nOffset ) % m_nPageSize );
+	madvise( m_pcRegion->m_pAddress + ( nAligned - m_pcRegion->m_nOffset ), nEnd - nAligned, MADV_WILLNEED );
+
+	m_nAdvised = nEnd;
+}
+
+status_t MmapStage::GetPacket( Packet **ppcPacket, int nInterface )
+{
+	if( nInterface > 0 || m_nFd < 0 || NULL == m_pcPipeline )
+		return EINVAL;
+
+	if( m_nPosition >= m_nFileSize )
+		return EIO;
+
+	if( NULL == m_pcRegion || m_nPosition < m_pcRegion->m_nOffset ||
+		m_nPosition >= m_pcRegion->m_nOffset + (off_t)m_pcRegion->m_nSize )
+	{
+		status_t nError = MapWindow( m_nPosition );
+		if( nError != EOK )
+			return nError;
+	}
+	Advise();
+
+	/* Packets never span two windows, so the last packet of each window may be short */
+	off_t nWindowEnd = m_pcRegion->m_nOffset + m_pcRegion->m_nSize;
+	size_t nSize = m_nPacketSize;
+	if( m_nPosition + (off_t)nSize > nWindowEnd )
+		nSize = nWindowEnd - m_nPosition;
+
+	Packet *pcPacket = m_pcPipeline->AllocPacket();
+	if( NULL == pcPacket )
+		return ENOMEM;
+
+	/* The packet points straight into the mapping */
+	uint8 *pData = m_pcRegion->m_pAddress + ( m_nPosition - m_pcRegion->m_nOffset );
+	PacketData *pcData = PacketData::Wrap( pData, nSize, MappedRegion::ReleaseHook, m_pcRegion );
+	if( NULL == pcData )
+	{
+		m_pcPipeline->FreePacket( pcPacket );
+		return ENOMEM;
+	}
+	m_pcRegion->AddRef();
+
+	pcPacket->SetPayload( pcData, 0, nSize );
+	m_nPosition += nSize;
+
+	*ppcPacket = pcPacket;
+
+	return EOK;
+}
+
+/* Mapping a packet costs next to nothing, so hand back as many as the Buffer wants */
+status_t MmapStage::GetPackets( Packet **ppcPackets, size_t nMax, size_t *pnCount, int nInterface )
+{
+	status_t nError = EOK;
+	size_t nCount;
+
+	for( nCount = 0; nCount < nMax; nCount++ )
+	{
+		nError = GetPacket( &ppcPackets[nCount], nInterface );
+		if( nError != EOK )
+			break;
+	}
+
+	*pnCount = nCount;
+	return nCount > 0 ? EOK : nError;
+}
+
+/* Map just the range, so that this can run alongside GetPacket() & itself.  The packet holds the only
+   reference to the mapping */
+status_t MmapStage::GetPacketAt( Packet *pcPacket, uint64 nOffset, size_t nSize )
+{
+	if( NULL == pcPacket || m_nFd < 0 || nSize == 0 || nSize > MMAP_WINDOW_SIZE )
+		return EINVAL;
+
+	if( (off_t)nOffset >= m_nFileSize )
+	{
+		pcPacket->SetDataSize( 0 );
+		return EOK;
+	}
+	if( (off_t)( nOffset + nSize ) > m_nFileSize )
+		nSize = m_nFileSize - nOffset;
+
+	off_t nStart = nOffset - ( nOffset % m_nPageSize );
+	size_t nLength = nOffset + nSize - nStart;
+
+	void *pAddress = mmap( NULL, nLength, PROT_READ, MAP_SHARED, m_nFd, nStart );
+	if( MAP_FAILED == pAddress )
+		return errno;
+	madvise( pAddress, nLength, MADV_WILLNEED );
+
+	MappedRegion *pcRegion = new MappedRegion( (uint8*)pAddress, nStart, nLength );
+	PacketData *pcData = PacketData::Wrap( (uint8*)pAddress + ( nOffset - nStart ), nSize, MappedRegion::ReleaseHook, pcRegion );
+	if( NULL == pcData )
+	{
+		pcRegion->Release();
+		return ENOMEM;
+	}
+
+	pcPacket->SetPayload( pcData, 0, nSize );
+	return EOK;
+}
+
+/* Nothing is read until the next packet, which maps the window it falls in if that isn't the current one */
+status_t MmapStage::Seek( uint64 nOffset )
+{
+	if( m_nFd < 0 )
+		return EINVAL;
+
+	/* Past the end is the end of the stream */
+	if( nOffset > (uint64)m_nFileSize )
+		nOffset = m_nFileSize;
+
+	m_nPosition = nOffset;
+	m_nAdvised = nOffset;
+
+	return EOK;
+}
+
+extern "C"
+{
+	Stage * GetInstance( void )
+	{
+		return new MmapStage();
+	}
+
+};
+
@@ -0,0 +1,254 @@
+#include <pipeline.h>
+#include <stage.h>
+#include <interface.h>
+#include <packet.h>
+#include <buffer.h>
+#include <cpu.h>
+
+#include "remix.h"
+
+using namespace os;
+using namespace media;
+
+/* Scalar kernels.  Every kernel sums the inputs in the same order, so they all produce the same results */
+
+static void remix_scalar( const struct remix_matrix *psMatrix, const float *pvSrc, float *pvDst, size_t nFrames )
+{
+	const uint32 nInputs = psMatrix->nInputs, nOutputs = psMatrix->nOutputs;
+	float avFrame[REMIX_MAX_CHANNELS];
+
+	for( size_t f = 0; f < nFrames; f++ )
+	{
+		memcpy( avFrame, pvSrc, nInputs * sizeof( float ) );
+
+		for( uint32 o = 0; o < nOutputs; o++ )
+		{
+			const float *pvRow = psMatrix->avRows + o * nInputs;
+			float v = pvRow[0] * avFrame[0];
+
+			for( uint32 i = 1; i < nInputs; i++ )
+				v += pvRow[i] * avFrame[i];
+			pvDst[o] = v;
+		}
+
+		pvSrc += nInputs;
+		pvDst += nOutputs;
+	}
+}
+
+/* Reordering, picking or duplicating channels is only a copy */
+static void remix_permute( const struct remix_matrix *psMatrix, const float *pvSrc, float *pvDst, size_t nFrames )
+{
+	const uint32 nInputs = psMatrix->nInputs, nOutputs = psMatrix->nOutputs;
+	float avFrame[REMIX_MAX_CHANNELS + 1];
+
+	/* The extra sample is the silence for outputs with no input */
+	avFrame[nInputs] = 0.0f;
+
+	for( size_t f = 0; f < nFrames; f++ )
+	{
+		memcpy( avFrame, pvSrc, nInputs * sizeof( float ) );
+
+		for( uint32 o = 0; o < nOutputs; o++ )
+		{
+			int32 nSource = psMatrix->anSources[o];
+			pvDst[o] = avFrame[nSource < 0 ? nInputs : nSource];
+		}
+
+		pvSrc += nInputs;
+		pvDst += nOutputs;
+	}
+}
+
+/* The common layouts, where the compiler knows the size of the matrix & can unroll everything */
+template<int I, int O>
+static void remix_fixed( const struct remix_matrix *psMatrix, const float *pvSrc, float *pvDst, size_t nFrames )
+{
+	float avGains[O * I];
+	memcpy( avGains, psMatrix->avRows, sizeof( avGains ) );
+
+	for( size_t f = 0; f < nFrames; f++ )
+	{
+		float avFrame[I];
+		for( int i = 0; i < I; i++ )
+			avFrame[i] = pvSrc[i];
+
+		for( int o = 0; o < O; o++ )
+		{
+			float v = avGains[o * I] * avFrame[0];
+			for( int i = 1; i < I; i++ )
+				v += avGains[o * I + i] * avFrame[i];
+			pvDst[o] = v;
+		}
+
+		pvSrc += I;
+		pvDst += O;
+	}
+}
+
+static const struct
+{
+	uint32 nInputs, nOutputs;
+	remix_fn pfKernel;
+} g_asFixedKernels[] =
+{
+	{ 1, 2, remix_fixed<1, 2> },	/* Mono to stereo */
+	{ 2, 1, remix_fixed<2, 1> },	/* Stereo to mono */
+	{ 2, 2, remix_fixed<2, 2> },	/* Stereo to stereo E.g. swap or widen */
+	{ 4, 2, remix_fixed<4, 2> },	/* Quad to stereo */
+	{ 6, 1, remix_fixed<6, 1> },	/* 5.1 to mono */
+	{ 6, 2, remix_fixed<6, 2> },	/* 5.1 to stereo */
+	{ 8, 2, remix_fixed<8, 2> }		/* 7.1 to stereo */
+};
+
+/* Applies a channel matrix to native float samples.  Use SetChannelMatrix() to set it; packets are passed
+   on untouched until it is.  Packets are remixed in place when nothing else references them & the mix
+   doesn't add channels.  Use the convert stage in front of this one for other formats */
+class RemixStage : public EffectStage
+{
+	public:
+		RemixStage();
+		~RemixStage();
+
+		String GetName( void ){ return "effect/remix"; };
+
+		interface_t GetInputInterface( void ){ return EFFECT; };
+		interface_t GetOutputInterface( void ){ return OUTPUT; };
+
+		bool Check( Packet *pcPacket );
+
+		status_t SetChannelMatrix( uint32 nOutputs, uint32 nInputs, const float *pvMatrix );
+
+	private:
+		status_t SetInputFormat( PacketInfo *pcInfo );
+		status_t Process( Packet *pcPacket, Packet **ppcOutput );
+		void TransformUnits( const uint8 *pSrc, uint8 *pDst, size_t nFrames );
+
+		struct remix_matrix m_sMatrix;
+		bool m_bHaveMatrix;
+		remix_fn m_pfKernel;
+};
+
+RemixStage::RemixStage()
+{
+	memset( &m_sMatrix, 0, sizeof( m_sMatrix ) );
+	m_bHaveMatrix = false;
+	m_pfKernel = NULL;
+}
+
+RemixStage::~RemixStage()
+{
+}
+
+bool RemixStage::Check( Packet *pcPacket )
+{
+	if( NULL == pcPacket )
+		return false;
+
+	AudioPacketInfo *pcInfo = dynamic_cast<AudioPacketInfo*>( pcPacket->GetInfo() );
+	if( NULL == pcInfo || pcInfo->eFormat != PCM_FLOAT_LE || pcInfo->nBitsPerSample != 32 )
+		return false;
+
+	return m_bHaveMatrix ? pcInfo->nChannels == m_sMatrix.nInputs : pcInfo->nChannels > 0;
+}
+
+/* This should be called before the pipeline is started */
+status_t RemixStage::SetChannelMatrix( uint32 nOutputs, uint32 nInputs, const float *pvMatrix )
+{
+	if( NULL == pvMatrix || nOutputs == 0 || nOutputs > REMIX_MAX_CHANNELS || nInputs == 0 || nInputs > REMIX_MAX_CHANNELS )
+		return EINVAL;
+
+	struct remix_matrix *psMatrix = &m_sMatrix;
+	memset( psMatrix, 0, sizeof( *psMatrix ) );
+
+	psMatrix->nInputs = nInputs;
+	psMatrix->nOutputs = nOutputs;
+	psMatrix->nPadded = ( nOutputs + 3 ) & ~3;
+	memcpy( psMatrix->avRows, pvMatrix, nOutputs * nInputs * sizeof( float ) );
+
+	psMatrix->bPermute = true;
+	for( uint32 o = 0; o < nOutputs; o++ )
+	{
+		psMatrix->anSources[o] = -1;
+		for( uint32 i = 0; i < nInputs; i++ )
+		{
+			float vGain = pvMatrix[o * nInputs + i];
+
+			psMatrix->avColumns[i * psMatrix->nPadded + o] = vGain;
+			if( vGain == 1.0f && psMatrix->anSources[o] < 0 )
+				psMatrix->anSources[o] = i;
+			else if( vGain != 0.0f )
+				psMatrix->bPermute = false;
+		}
+	}
+
+	/* Use the most specific kernel we have */
+	m_pfKernel = NULL;
+	if( psMatrix->bPermute )
+		m_pfKernel = remix_permute;
+	for( size_t i = 0; NULL == m_pfKernel && i < sizeof( g_asFixedKernels ) / sizeof( g_asFixedKernels[0] ); i++ )
+		if( g_asFixedKernels[i].nInputs == nInputs && g_asFixedKernels[i].nOutputs == nOutputs )
+			m_pfKernel = g_asFixedKernels[i].pfKernel;
+	if( NULL == m_pfKernel && ( get_cpu_features() & CPU_SSE2 ) )
+		m_pfKernel = get_sse2_remix();
+	if( NULL == m_pfKernel )
+		m_pfKernel = remix_scalar;
+
+	m_bHaveMatrix = true;
+
+	/* Set up again with the next packet */
+	SetInputInfo( NULL );
+
+	return EOK;
+}
+
+status_t RemixStage::SetInputFormat( PacketInfo *pcInfo )
+{
+	AudioPacketInfo *pcAudioInfo = dynamic_cast<AudioPacketInfo*>( pcInfo );
+	if( NULL == pcAudioInfo || pcAudioInfo->eFormat != PCM_FLOAT_LE || pcAudioInfo->nBitsPerSample != 32 )
+		return EINVAL;
+	if( m_bHaveMatrix && pcAudioInfo->nChannels != m_sMatrix.nInputs )
+		return EINVAL;
+
+	if( m_pcOutputInfo )
+		m_pcOutputInfo->Release();
+	if( m_bHaveMatrix )
+		m_pcOutputInfo = AudioPacketInfo::Get( PCM_FLOAT_LE, m_sMatrix.nOutputs, pcAudioInfo->nSampleRate, 32 );
+	else
+	{
+		pcAudioInfo->AddRef();
+		m_pcOutputInfo = pcAudioInfo;
+	}
+
+	/* Part of a frame in the old format is no use to us now */
+	m_nCarry = 0;
+
+	return EOK;
+}
+
+/* Remix pcPacket, which is always consumed.  *ppcOutput is NULL if the packet did not complete a frame */
+status_t RemixStage::Process( Packet *pcPacket, Packet **ppcOutput )
+{
+	/* Nothing to do, so pass the packet on as it is */
+	if( false == m_bHaveMatrix )
+	{
+		*ppcOutput = pcPacket;
+		return EOK;
+	}
+
+	return ProcessUnits( pcPacket, m_sMatrix.nInputs * sizeof( float ), m_sMatrix.nOutputs * sizeof( float ), true, ppcOutput );
+}
+
+void RemixStage::TransformUnits( const uint8 *pSrc, uint8 *pDst, size_t nFrames )
+{
+	m_pfKernel( &m_sMatrix, (const float*)pSrc, (float*)pDst, nFrames );
+}
+
+extern "C"
+{
+	Stage * GetInstance( void )
+	{
+		return new RemixStage();
+	}
+
+};
@@ -0,0 +1,32 @@
+#ifndef __F_MEDIA_REMIX_H_
+#define __F_MEDIA_REMIX_H_
+
+#include <atheos/types.h>
+
+/* The most channels the remix stage will take or produce */
+#define REMIX_MAX_CHANNELS	32
+
+struct remix_matrix
+{
+	uint32 nInputs, nOutputs;
+	float avRows[REMIX_MAX_CHANNELS * REMIX_MAX_CHANNELS];		/* A row of nInputs gains for each output */
+
+	/* The same gains a column of nPadded outputs at a time, for each input.  nPadded is nOutputs rounded up
+	   to a multiple of four, and the padding is zero */
+	float avColumns[REMIX_MAX_CHANNELS * REMIX_MAX_CHANNELS];
+	uint32 nPadded;
+
+	/* If every output is a copy of a single input, or silent, this is the input for each output or -1 */
+	bool bPermute;
+	int32 anSources[REMIX_MAX_CHANNELS];
+};
+
+/* Remix nFrames interleaved frames.  The kernels read all of a frame before they write any of it, so pvDst
+   may be the same as pvSrc if there are no more outputs than inputs.  Neither pointer need be aligned */
+typedef void (*remix_fn)( const struct remix_matrix *psMatrix, const float *pvSrc, float *pvDst, size_t nFrames );
+
+/* Return the SSE2 version of the kernel for any matrix, or NULL if the plugin was built without it.  It
+   must only be used if the CPU has SSE2 */
+remix_fn get_sse2_remix( void );
+
+#endif	/* __F_MEDIA_REMIX_H_ */
@@ -0,0 +1,48 @@
+#include "remix.h"
+
+#include <string.h>
+
+/* This file is built with -msse2 */
+#ifdef __SSE2__
+
+#include <emmintrin.h>
+
+/* Each input sample is broadcast & multiplied by its column of gains, which gives four outputs at a time */
+static void remix_sse2( const struct remix_matrix *psMatrix, const float *pvSrc, float *pvDst, size_t nFrames )
+{
+	const uint32 nInputs = psMatrix->nInputs, nOutputs = psMatrix->nOutputs, nPadded = psMatrix->nPadded;
+	float avFrame[REMIX_MAX_CHANNELS], avOutput[REMIX_MAX_CHANNELS];
+
+	for( size_t f = 0; f < nFrames; f++ )
+	{
+		memcpy( avFrame, pvSrc, nInputs * sizeof( float ) );
+
+		for( uint32 o = 0; o < nPadded; o += 4 )
+		{
+			const float *pvColumn = psMatrix->avColumns + o;
+			__m128 vSum = _mm_mul_ps( _mm_set1_ps( avFrame[0] ), _mm_loadu_ps( pvColumn ) );
+
+			for( uint32 i = 1; i < nInputs; i++ )
+				vSum = _mm_add_ps( vSum, _mm_mul_ps( _mm_set1_ps( avFrame[i] ), _mm_loadu_ps( pvColumn + i * nPadded ) ) );
+			_mm_storeu_ps( avOutput + o, vSum );
+		}
+
+		memcpy( pvDst, avOutput, nOutputs * sizeof( float ) );
+		pvSrc += nInputs;
+		pvDst += nOutputs;
+	}
+}
+
+remix_fn get_sse2_remix( void )
+{
+	return remix_sse2;
+}
+
+#else
+
+remix_fn get_sse2_remix( void )
+{
+	return NULL;
+}
+
+#endif	/* __SSE2__ */
@@ -0,0 +1,731 @@
+#include <pipeline.h>
+#include <stage.h>
+#include <interface.h>
+#include <packet.h>
+#include <buffer.h>
+#include <cpu.h>
+
+#include <util/locker.h>
+
+#include <list>
+#include <new>
+#include <math.h>
+
+#include "resample.h"
+
+using namespace os;
+using namespace media;
+
+/* Ratios that reduce to no more than this many output samples for a whole number of input samples are
+   resampled exactly, with one filter for every phase */
+#define RESAMPLE_MAX_PHASES		1024
+
+/* Any other ratio uses a bank of this many phases, and interpolates between the two nearest */
+#define RESAMPLE_ARBITRARY_SHIFT	8
+#define RESAMPLE_ARBITRARY_PHASES	( 1 << RESAMPLE_ARBITRARY_SHIFT )
+
+/* The longest filter we'll build when decimating */
+#define RESAMPLE_MAX_TAPS		512
+
+/* The windowed sinc filter used for each quality.  The number of taps is for a ratio of at least 1:1, and
+   grows in proportion when decimating so that the transition band stays the same width */
+struct resample_quality
+{
+	int nTaps;
+	double vCutoff;		/* As a fraction of the lower Nyquist frequency */
+	double vBeta;		/* Of the Kaiser window */
+};
+
+static const struct resample_quality g_asQuality[] =
+{
+	{ 2, 1.0, 0.0 },	/* QUALITY_LOW is linear interpolation, and doesn't use a filter bank */
+	{ 16, 0.90, 6.0 },	/* QUALITY_MEDIUM */
+	{ 64, 0.95, 9.0 }	/* QUALITY_HIGH */
+};
+
+static double bessel_i0( double x )
+{
+	double vSum = 1.0, vTerm = 1.0;
+
+	for( int k = 1; k < 50; k++ )
+	{
+		vTerm *= ( x / ( 2.0 * k ) ) * ( x / ( 2.0 * k ) );
+		vSum += vTerm;
+		if( vTerm < vSum * 1e-12 )
+			break;
+	}
+	return vSum;
+}
+
+/* A polyphase filter bank.  Phase n holds the taps for a position n / nPhases of the way from one input
+   sample to the next, with an extra phase at the end that is phase 0 moved on by one sample.  Banks
+   depend only on the ratio & the quality, so they are cached & shared between every ResampleStage */
+class FilterBank
+{
+	public:
+		static FilterBank * Get( int nPhases, int nTaps, double vCutoff, double vBeta );
+		void Release( void );
+
+		const float * GetPhase( int nPhase ){ return m_pvCoeffs + nPhase * m_nTaps; };
+
+	private:
+		FilterBank( int nPhases, int nTaps, double vCutoff, double vBeta );
+		~FilterBank();
+
+		int m_nPhases, m_nTaps;
+		double m_vCutoff, m_vBeta;
+
+		int m_nRefCount;	/* Protected by g_cBankLock */
+		float *m_pvCoeffs;
+};
+
+static Locker g_cBankLock( "resample_banks" );
+static std::list<FilterBank*> g_vpcBanks;
+
+FilterBank::FilterBank( int nPhases, int nTaps, double vCutoff, double vBeta )
+{
+	m_nPhases = nPhases;
+	m_nTaps = nTaps;
+	m_vCutoff = vCutoff;
+	m_vBeta = vBeta;
+	m_nRefCount = 1;
+
+	m_pvCoeffs = new float[( nPhases + 1 ) * nTaps];
+
+	double vCentre = nTaps / 2 - 1, vHalf = nTaps / 2, vNorm = bessel_i0( vBeta );
+
+	for( int p = 0; p <= nPhases; p++ )
+	{
+		float *pvPhase = m_pvCoeffs + p * nTaps;
+		double vSum = 0.0;
+
+		for( int k = 0; k < nTaps; k++ )
+		{
+			double x = k - vCentre - (double)p / nPhases;
+			double vSinc = x == 0.0 ? 1.0 : sin( M_PI * vCutoff * x ) / ( M_PI * vCutoff * x );
+			double r = x / vHalf;
+			double vWindow = r * r < 1.0 ? bessel_i0( vBeta * sqrt( 1.0 - r * r ) ) / vNorm : 0.0;
+
+			pvPhase[k] = vSinc * vWindow;
+			vSum += pvPhase[k];
+		}
+
+		/* Unity gain at DC for every phase */
+		for( int k = 0; k < nTaps; k++ )
+			pvPhase[k] /= vSum;
+	}
+}
+
+FilterBank::~FilterBank()
+{
+	delete[] m_pvCoeffs;
+}
+
+FilterBank * FilterBank::Get( int nPhases, int nTaps, double vCutoff, double vBeta )
+{
+	FilterBank *pcBank = NULL;
+	std::list<FilterBank*>::iterator i;
+
+	g_cBankLock.Lock();
+	for( i = g_vpcBanks.begin(); i != g_vpcBanks.end(); i++ )
+		if( (*i)->m_nPhases == nPhases && (*i)->m_nTaps == nTaps && (*i)->m_vCutoff == vCutoff && (*i)->m_vBeta == vBeta )
+		{
+			pcBank = *i;
+			pcBank->m_nRefCount++;
+			break;
+		}
+	g_cBankLock.Unlock();
+
+	if( pcBank )
+		return pcBank;
+
+	/* Build it without the lock; if another stage raced us to it we'll use theirs */
+	FilterBank *pcNew = new FilterBank( nPhases, nTaps, vCutoff, vBeta );
+
+	g_cBankLock.Lock();
+	for( i = g_vpcBanks.begin(); i != g_vpcBanks.end(); i++ )
+		if( (*i)->m_nPhases == nPhases && (*i)->m_nTaps == nTaps && (*i)->m_vCutoff == vCutoff && (*i)->m_vBeta == vBeta )
+		{
+			pcBank = *i;
+			pcBank->m_nRefCount++;
+			break;
+		}
+	if( NULL == pcBank )
+	{
+		g_vpcBanks.push_back( pcNew );
+		pcBank = pcNew;
+		pcNew = NULL;
+	}
+	g_cBankLock.Unlock();
+
+	delete pcNew;
+	return pcBank;
+}
+
+void FilterBank::Release( void )
+{
+	bool bDelete = false;
+
+	g_cBankLock.Lock();
+	if( --m_nRefCount == 0 )
+	{
+		g_vpcBanks.remove( this );
+		bDelete = true;
+	}
+	g_cBankLock.Unlock();
+
+	if( bDelete )
+		delete this;
+}
+
+static float dot_scalar( const float *pvSamples, const float *pvCoeffs, size_t nTaps )
+{
+	float vSum0 = 0.0f, vSum1 = 0.0f, vSum2 = 0.0f, vSum3 = 0.0f;
+
+	for( size_t i = 0; i < nTaps; i += 4 )
+	{
+		vSum0 += pvSamples[i] * pvCoeffs[i];
+		vSum1 += pvSamples[i + 1] * pvCoeffs[i + 1];
+		vSum2 += pvSamples[i + 2] * pvCoeffs[i + 2];
+		vSum3 += pvSamples[i + 3] * pvCoeffs[i + 3];
+	}
+	return ( vSum0 + vSum1 ) + ( vSum2 + vSum3 );
+}
+
+static uint32 gcd( uint32 a, uint32 b )
+{
+	while( b != 0 )
+	{
+		uint32 t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Changes the sample rate of native float samples.  Use SetOutputSampleRate() to choose the rate; packets
+   are passed on untouched until it is set.  Use the convert stage in front of this one for other formats */
+class ResampleStage : public EffectStage
+{
+	public:
+		ResampleStage();
+		~ResampleStage();
+
+		String GetName( void ){ return "effect/resample"; };
+
+		interface_t GetInputInterface( void ){ return EFFECT; };
+		interface_t GetOutputInterface( void ){ return OUTPUT; };
+
+		bool Check( Packet *pcPacket );
+
+		status_t SetOutputSampleRate( uint32 nSampleRate );
+		status_t SetQuality( quality_t eQuality );
+
+		void Flush( void );
+
+	private:
+		enum resample_mode
+		{
+			MODE_COPY,			/* The rates match */
+			MODE_LINEAR,
+			MODE_POLYPHASE,		/* One filter for each phase of an exact ratio */
+			MODE_ARBITRARY		/* Interpolate between the two nearest filters */
+		};
+
+		status_t SetInputFormat( PacketInfo *pcInfo );
+		status_t Reset( void );
+		bool Reserve( size_t nFrames );
+		void Append( const uint8 *pData, size_t nSize );
+		void AppendSilence( size_t nFrames );
+		size_t Produce( float *pvDst, size_t nMax, bool bEnd );
+		size_t ProduceLinear( float *pvDst, size_t nMax, size_t nEnd );
+		size_t ProducePolyphase( float *pvDst, size_t nMax, size_t nEnd );
+		size_t ProduceArbitrary( float *pvDst, size_t nMax, size_t nEnd );
+		status_t Output( Packet::PacketType eType, bool bEnd, Packet **ppcOutput );
+		status_t Process( Packet *pcPacket, Packet **ppcOutput );
+		status_t Drain( Packet **ppcOutput );
+
+		uint32 m_nOutputRate;
+		quality_t m_eQuality;
+
+		Packet::PacketType m_eLastType;
+
+		resample_mode m_eMode;
+		uint32 m_nInputRate, m_nChannels;
+		FilterBank *m_pcBank;
+		int m_nTaps;
+		dot_fn m_pfDot;
+
+		/* The position of the next output sample is m_nIndex plus a fraction of an input sample.  It is
+		   m_nPhase / m_nPhases for MODE_POLYPHASE, & m_nFraction / 2^32 for the other modes */
+		size_t m_nIndex;
+		uint32 m_nPhase, m_nPhases, m_nPhaseStep, m_nIndexStep;
+		uint32 m_nFraction;
+		uint64 m_nStep;		/* 32.32 fixed point */
+
+		/* The input that the next output samples are made from, one row per channel.  The first taps / 2 - 1
+		   samples are silence, so that the first output sample lines up with the first input sample */
+		float *m_pvHistory;
+		size_t m_nCapacity, m_nFrames;
+		uint32 m_nChannel;		/* Of the next sample, if a packet ended part way through a frame */
+
+		uint64 m_nInputFrames, m_nOutputFrames;
+		bool m_bFlushed;
+};
+
+ResampleStage::ResampleStage()
+{
+	m_nOutputRate = 0;
+	m_eQuality = QUALITY_MEDIUM;
+
+	m_eLastType = Packet::UNKNOWN;
+
+	m_eMode = MODE_COPY;
+	m_nInputRate = m_nChannels = 0;
+	m_pcBank = NULL;
+	m_nTaps = 0;
+	m_pfDot = dot_scalar;
+	if( ( get_cpu_features() & CPU_SSE2 ) && get_sse2_dot() )
+		m_pfDot = get_sse2_dot();
+
+	m_nIndex = 0;
+	m_nPhase = m_nPhases = m_nPhaseStep = m_nIndexStep = 0;
+	m_nFraction = 0;
+	m_nStep = 0;
+
+	m_pvHistory = NULL;
+	m_nCapacity = m_nFrames = 0;
+	m_nChannel = 0;
+
+	m_nInputFrames = m_nOutputFrames = 0;
+	m_bFlushed = false;
+}
+
+ResampleStage::~ResampleStage()
+{
+	if( m_pcBank )
+		m_pcBank->Release();
+	delete[] m_pvHistory;
+}
+
+bool ResampleStage::Check( Packet *pcPacket )
+{
+	if( NULL == pcPacket )
+		return false;
+
+	AudioPacketInfo *pcInfo = dynamic_cast<AudioPacketInfo*>( pcPacket->GetInfo() );
+	return pcInfo && pcInfo->eFormat == PCM_FLOAT_LE && pcInfo->nBitsPerSample == 32 && pcInfo->nChannels > 0 && pcInfo->nSampleRate > 0;
+}
+
+/* These should be called before the pipeline is started */
+status_t ResampleStage::SetOutputSampleRate( uint32 nSampleRate )
+{
+	if( nSampleRate == 0 )
+		return EINVAL;
+
+	m_nOutputRate = nSampleRate;
+	SetInputInfo( NULL );
+	return EOK;
+}
+
+status_t ResampleStage::SetQuality( quality_t eQuality )
+{
+	if( eQuality < QUALITY_LOW || eQuality > QUALITY_HIGH )
+		return EINVAL;
+
+	m_eQuality = eQuality;
+	SetInputInfo( NULL );
+	return EOK;
+}
+
+/* Set up for a new input format.  Whatever is left of the old stream is dropped */
+status_t ResampleStage::SetInputFormat( PacketInfo *pcInfo )
+{
+	AudioPacketInfo *pcAudioInfo = dynamic_cast<AudioPacketInfo*>( pcInfo );
+	if( NULL == pcAudioInfo || pcAudioInfo->eFormat != PCM_FLOAT_LE || pcAudioInfo->nBitsPerSample != 32 ||
+		pcAudioInfo->nChannels == 0 || pcAudioInfo->nSampleRate == 0 )
+		return EINVAL;
+
+	m_nInputRate = pcAudioInfo->nSampleRate;
+	m_nChannels = pcAudioInfo->nChannels;
+	uint32 nOutputRate = m_nOutputRate ? m_nOutputRate : m_nInputRate;
+
+	if( m_pcBank )
+	{
+		m_pcBank->Release();
+		m_pcBank = NULL;
+	}
+
+	uint32 nDivisor = gcd( m_nInputRate, nOutputRate );
+	uint32 nUp = nOutputRate / nDivisor, nDown = m_nInputRate / nDivisor;
+
+	if( nOutputRate == m_nInputRate )
+		m_eMode = MODE_COPY;
+	else if( m_eQuality == QUALITY_LOW )
+	{
+		m_eMode = MODE_LINEAR;
+		m_nTaps = 2;
+	}
+	else
+	{
+		const struct resample_quality *psQuality = &g_asQuality[m_eQuality];
+		double vRatio = nOutputRate < m_nInputRate ? (double)nOutputRate / m_nInputRate : 1.0;
+
+		/* Keep the number of taps a multiple of four for the dot product */
+		m_nTaps = ( (int)ceil( psQuality->nTaps / vRatio ) + 3 ) & ~3;
+		if( m_nTaps > RESAMPLE_MAX_TAPS )
+			m_nTaps = RESAMPLE_MAX_TAPS;
+
+		if( nUp <= RESAMPLE_MAX_PHASES )
+		{
+			m_eMode = MODE_POLYPHASE;
+			m_nPhases = nUp;
+			m_nIndexStep = nDown / nUp;
+			m_nPhaseStep = nDown % nUp;
+		}
+		else
+		{
+			m_eMode = MODE_ARBITRARY;
+			m_nPhases = RESAMPLE_ARBITRARY_PHASES;
+		}
+
+		m_pcBank = FilterBank::Get( m_nPhases, m_nTaps, psQuality->vCutoff * vRatio, psQuality->vBeta );
+	}
+	m_nStep = ( (uint64)m_nInputRate << 32 ) / nOutputRate;
+
+	if( m_pcOutputInfo )
+		m_pcOutputInfo->Release();
+	m_pcOutputInfo = AudioPacketInfo::Get( PCM_FLOAT_LE, m_nChannels, nOutputRate, 32, 0, pcAudioInfo->nChannelMask );
+
+	return Reset();
+}
+
+/* Start again with the silence that lines the filter up with the first sample */
+status_t ResampleStage::Reset( void )
+{
+	m_nIndex = 0;
+	m_nPhase = 0;
+	m_nFraction = 0;
+	m_nFrames = 0;
+	m_nChannel = 0;
+	m_nInputFrames = m_nOutputFrames = 0;
+	m_bFlushed = false;
+	m_nCarry = 0;
+
+	if( m_eMode != MODE_COPY )
+	{
+		if( Reserve( m_nTaps ) == false )
+			return ENOMEM;
+		AppendSilence( m_nTaps / 2 - 1 );
+	}
+
+	return EOK;
+}
+
+/* Make room for nFrames more frames of history.  The buffer only ever grows, so once a stream is under
+   way it is not reallocated */
+bool ResampleStage::Reserve( size_t nFrames )
+{
+	/* Leave room for a partial frame */
+	size_t nNeed = m_nFrames + nFrames + 1;
+	if( nNeed <= m_nCapacity )
+		return true;
+
+	size_t nCapacity = m_nCapacity ? m_nCapacity * 2 : 1024;
+	while( nCapacity < nNeed )
+		nCapacity *= 2;
+
+	float *pvHistory = new( std::nothrow ) float[nCapacity * m_nChannels];
+	if( NULL == pvHistory )
+		return false;
+
+	if( m_pvHistory )
+	{
+		for( uint32 c = 0; c < m_nChannels; c++ )
+			memcpy( pvHistory + c * nCapacity, m_pvHistory + c * m_nCapacity, ( m_nFrames + 1 ) * sizeof( float ) );
+		delete[] m_pvHistory;
+	}
+
+	m_pvHistory = pvHistory;
+	m_nCapacity = nCapacity;
+	return true;
+}
+
+/* Split interleaved samples into the history.  There must be room for them */
+void ResampleStage::Append( const uint8 *pData, size_t nSize )
+{
+	const float *pvSrc = (const float*)pData;
+	size_t nSamples = nSize / sizeof( float );
+
+	/* Finish a partial frame one sample at a time */
+	while( m_nChannel != 0 && nSamples > 0 )
+	{
+		m_pvHistory[m_nChannel * m_nCapacity + m_nFrames] = *pvSrc++;
+		nSamples--;
+		if( ++m_nChannel == m_nChannels )
+		{
+			m_nChannel = 0;
+			m_nFrames++;
+			m_nInputFrames++;
+		}
+	}
+
+	size_t nFrames = nSamples / m_nChannels;
+	if( m_nChannels == 2 )
+	{
+		float *pvLeft = m_pvHistory + m_nFrames, *pvRight = pvLeft + m_nCapacity;
+		for( size_t i = 0; i < nFrames; i++ )
+		{
+			pvLeft[i] = pvSrc[i * 2];
+			pvRight[i] = pvSrc[i * 2 + 1];
+		}
+	}
+	else
+	{
+		for( uint32 c = 0; c < m_nChannels; c++ )
+		{
+			float *pvDst = m_pvHistory + c * m_nCapacity + m_nFrames;
+			for( size_t i = 0; i < nFrames; i++ )
+				pvDst[i] = pvSrc[i * m_nChannels + c];
+		}
+	}
+	pvSrc += nFrames * m_nChannels;
+	nSamples -= nFrames * m_nChannels;
+	m_nFrames += nFrames;
+	m_nInputFrames += nFrames;
+
+	for( ; nSamples > 0; nSamples-- )
+		m_pvHistory[m_nChannel++ * m_nCapacity + m_nFrames] = *pvSrc++;
+}
+
+void ResampleStage::AppendSilence( size_t nFrames )
+{
+	for( uint32 c = 0; c < m_nChannels; c++ )
+		memset( m_pvHistory + c * m_nCapacity + m_nFrames, 0, nFrames * sizeof( float ) );
+	m_nFrames += nFrames;
+}
+
+size_t ResampleStage::ProduceLinear( float *pvDst, size_t nMax, size_t nEnd )
+{
+	size_t n;
+
+	for( n = 0; n < nMax && m_nIndex + 2 <= nEnd; n++ )
+	{
+		float vFraction = m_nFraction * ( 1.0f / 4294967296.0f );
+		for( uint32 c = 0; c < m_nChannels; c++ )
+		{
+			const float *pvSrc = m_pvHistory + c * m_nCapacity + m_nIndex;
+			*pvDst++ = pvSrc[0] + ( pvSrc[1] - pvSrc[0] ) * vFraction;
+		}
+
+		uint64 nNext = (uint64)m_nFraction + m_nStep;
+		m_nIndex += nNext >> 32;
+		m_nFraction = (uint32)nNext;
+	}
+	return n;
+}
+
+size_t ResampleStage::ProducePolyphase( float *pvDst, size_t nMax, size_t nEnd )
+{
+	size_t n;
+
+	for( n = 0; n < nMax && m_nIndex + m_nTaps <= nEnd; n++ )
+	{
+		const float *pvCoeffs = m_pcBank->GetPhase( m_nPhase );
+		for( uint32 c = 0; c < m_nChannels; c++ )
+			*pvDst++ = m_pfDot( m_pvHistory + c * m_nCapacity + m_nIndex, pvCoeffs, m_nTaps );
+
+		m_nIndex += m_nIndexStep;
+		m_nPhase += m_nPhaseStep;
+		if( m_nPhase >= m_nPhases )
+		{
+			m_nPhase -= m_nPhases;
+			m_nIndex++;
+		}
+	}
+	return n;
+}
+
+size_t ResampleStage::ProduceArbitrary( float *pvDst, size_t nMax, size_t nEnd )
+{
+	size_t n;
+
+	for( n = 0; n < nMax && m_nIndex + m_nTaps <= nEnd; n++ )
+	{
+		uint32 nPhase = m_nFraction >> ( 32 - RESAMPLE_ARBITRARY_SHIFT );
+		float vFraction = ( m_nFraction & ( 0xffffffff >> RESAMPLE_ARBITRARY_SHIFT ) ) * ( 1.0f / ( 1 << ( 32 - RESAMPLE_ARBITRARY_SHIFT ) ) );
+		const float *pvCoeffs0 = m_pcBank->GetPhase( nPhase ), *pvCoeffs1 = m_pcBank->GetPhase( nPhase + 1 );
+
+		for( uint32 c = 0; c < m_nChannels; c++ )
+		{
+			const float *pvSrc = m_pvHistory + c * m_nCapacity + m_nIndex;
+			float v0 = m_pfDot( pvSrc, pvCoeffs0, m_nTaps ), v1 = m_pfDot( pvSrc, pvCoeffs1, m_nTaps );
+			*pvDst++ = v0 + ( v1 - v0 ) * vFraction;
+		}
+
+		uint64 nNext = (uint64)m_nFraction + m_nStep;
+		m_nIndex += nNext >> 32;
+		m_nFraction = (uint32)nNext;
+	}
+	return n;
+}
+
+/* Produce up to nMax frames from the history.  Once the input has ended the output stops at the sample
+   that matches the end of the input */
+size_t ResampleStage::Produce( float *pvDst, size_t nMax, bool bEnd )
+{
+	if( bEnd )
+	{
+		uint64 nTotal = ( m_nInputFrames * m_pcOutputInfo->nSampleRate + m_nInputRate - 1 ) / m_nInputRate;
+		if( m_nOutputFrames + nMax > nTotal )
+			nMax = nTotal > m_nOutputFrames ? nTotal - m_nOutputFrames : 0;
+	}
+
+	size_t nCount;
+	switch( m_eMode )
+	{
+		case MODE_LINEAR:
+			nCount = ProduceLinear( pvDst, nMax, m_nFrames );
+			break;
+		case MODE_POLYPHASE:
+			nCount = ProducePolyphase( pvDst, nMax, m_nFrames );
+			break;
+		case MODE_ARBITRARY:
+			nCount = ProduceArbitrary( pvDst, nMax, m_nFrames );
+			break;
+		default:
+			nCount = 0;
+			break;
+	}
+	m_nOutputFrames += nCount;
+
+	/* Move what is still needed, including any partial frame, back to the start */
+	size_t nShift = m_nIndex < m_nFrames ? m_nIndex : m_nFrames;
+	if( nShift > 0 )
+	{
+		for( uint32 c = 0; c < m_nChannels; c++ )
+		{
+			float *pvRow = m_pvHistory + c * m_nCapacity;
+			memmove( pvRow, pvRow + nShift, ( m_nFrames - nShift + 1 ) * sizeof( float ) );
+		}
+		m_nFrames -= nShift;
+		m_nIndex -= nShift;
+	}
+
+	return nCount;
+}
+
+/* Produce a packet from whatever is in the history.  *ppcOutput is NULL if there wasn't enough */
+status_t ResampleStage::Output( Packet::PacketType eType, bool bEnd, Packet **ppcOutput )
+{
+	*ppcOutput = NULL;
+
+	/* An upper bound on what the history can produce */
+	size_t nMax = (size_t)( ( (uint64)m_nFrames * m_pcOutputInfo->nSampleRate ) / m_nInputRate ) + 2;
+
+	Packet *pcOutput = m_pcPipeline->AllocPacket();
+	float *pvDst = pcOutput ? (float*)pcOutput->AllocData( nMax * m_nChannels * sizeof( float ) ) : NULL;
+	if( NULL == pvDst )
+	{
+		if( pcOutput )
+			m_pcPipeline->FreePacket( pcOutput );
+		return ENOMEM;
+	}
+
+	size_t nCount = Produce( pvDst, nMax, bEnd );
+	if( nCount == 0 )
+	{
+		m_pcPipeline->FreePacket( pcOutput );
+		return EOK;
+	}
+
+	pcOutput->SetDataSize( nCount * m_nChannels * sizeof( float ) );
+	pcOutput->SetType( eType );
+	*ppcOutput = pcOutput;
+	return EOK;
+}
+
+/* Resample pcPacket, which is always consumed.  *ppcOutput is NULL if the packet did not complete an
+   output sample */
+status_t ResampleStage::Process( Packet *pcPacket, Packet **ppcOutput )
+{
+	*ppcOutput = NULL;
+	m_eLastType = pcPacket->GetType();
+
+	/* Nothing to do, so pass the packet on as it is */
+	if( m_eMode == MODE_COPY )
+	{
+		*ppcOutput = pcPacket;
+		return EOK;
+	}
+
+	const uint8 *pSrc = pcPacket->GetData();
+	size_t nSize = pcPacket->GetDataSize();
+
+	if( Reserve( ( m_nCarry + nSize ) / ( sizeof( float ) * m_nChannels ) + 1 ) == false )
+	{
+		m_pcPipeline->FreePacket( pcPacket );
+		return ENOMEM;
+	}
+
+	/* Finish the sample left over from the last packet */
+	if( m_nCarry > 0 )
+	{
+		size_t nNeed = sizeof( float ) - m_nCarry;
+		if( nNeed > nSize )
+			nNeed = nSize;
+		memcpy( m_anCarry + m_nCarry, pSrc, nNeed );
+		m_nCarry += nNeed;
+		pSrc += nNeed;
+		nSize -= nNeed;
+
+		if( m_nCarry == sizeof( float ) )
+		{
+			Append( m_anCarry, sizeof( float ) );
+			m_nCarry = 0;
+		}
+	}
+
+	size_t nWhole = nSize & ~( sizeof( float ) - 1 );
+	Append( pSrc, nWhole );
+	memcpy( m_anCarry + m_nCarry, pSrc + nWhole, nSize - nWhole );
+	m_nCarry += nSize - nWhole;
+
+	m_pcPipeline->FreePacket( pcPacket );
+
+	return Output( m_eLastType, false, ppcOutput );
+}
+
+/* The input has ended, so run the filter over enough silence to produce the last samples */
+status_t ResampleStage::Drain( Packet **ppcOutput )
+{
+	*ppcOutput = NULL;
+
+	if( m_bFlushed || m_eMode == MODE_COPY || NULL == m_pcInputInfo )
+		return EOK;
+	m_bFlushed = true;
+
+	/* Drop any partial frame */
+	m_nChannel = 0;
+	if( Reserve( m_nTaps ) == false )
+		return ENOMEM;
+	AppendSilence( m_nTaps );
+
+	return Output( m_eLastType, true, ppcOutput );
+}
+
+/* Forget the input we have so far, as the stream has moved */
+void ResampleStage::Flush( void )
+{
+	if( m_pcInputInfo )
+		Reset();
+}
+
+extern "C"
+{
+	Stage * GetInstance( void )
+	{
+		return new ResampleStage();
+	}
+
+};
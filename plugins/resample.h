@@ -0,0 +1,14 @@
+#ifndef __F_MEDIA_RESAMPLE_H_
+#define __F_MEDIA_RESAMPLE_H_
+
+#include <atheos/types.h>
+
+/* The dot product of nTaps samples & filter coefficients.  nTaps is always a multiple of four, and
+   neither pointer need be aligned */
+typedef float (*dot_fn)( const float *pvSamples, const float *pvCoeffs, size_t nTaps );
+
+/* Return the SSE2 version, or NULL if the plugin was built without it.  It must only be used if the CPU
+   has SSE2 */
+dot_fn get_sse2_dot( void );
+
+#endif	/* __F_MEDIA_RESAMPLE_H_ */
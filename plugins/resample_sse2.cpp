@@ -0,0 +1,41 @@
+#include "resample.h"
+
+/* This file is built with -msse2 */
+#ifdef __SSE2__
+
+#include <emmintrin.h>
+
+static float dot_sse2( const float *pvSamples, const float *pvCoeffs, size_t nTaps )
+{
+	__m128 vSum0 = _mm_setzero_ps(), vSum1 = _mm_setzero_ps();
+	size_t i;
+
+	/* Two independent sums hide the latency of the adds */
+	for( i = 0; i + 8 <= nTaps; i += 8 )
+	{
+		vSum0 = _mm_add_ps( vSum0, _mm_mul_ps( _mm_loadu_ps( pvSamples + i ), _mm_loadu_ps( pvCoeffs + i ) ) );
+		vSum1 = _mm_add_ps( vSum1, _mm_mul_ps( _mm_loadu_ps( pvSamples + i + 4 ), _mm_loadu_ps( pvCoeffs + i + 4 ) ) );
+	}
+	if( i < nTaps )
+		vSum0 = _mm_add_ps( vSum0, _mm_mul_ps( _mm_loadu_ps( pvSamples + i ), _mm_loadu_ps( pvCoeffs + i ) ) );
+
+	vSum0 = _mm_add_ps( vSum0, vSum1 );
+	vSum0 = _mm_add_ps( vSum0, _mm_movehl_ps( vSum0, vSum0 ) );
+	vSum0 = _mm_add_ss( vSum0, _mm_shuffle_ps( vSum0, vSum0, 1 ) );
+
+	return _mm_cvtss_f32( vSum0 );
+}
+
+dot_fn get_sse2_dot( void )
+{
+	return dot_sse2;
+}
+
+#else
+
+dot_fn get_sse2_dot( void )
+{
+	return NULL;
+}
+
+#endif	/* __SSE2__ */
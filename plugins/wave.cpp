@@ -3,13 +3,41 @@
 #include <interface.h>
 #include <packet.h>
 #include <buffer.h>
+#include <scheduler.h>
+#include <registry.h>
+
+#include <atheos/semaphore.h>
+#include <atheos/atomic.h>
+
+#include <vector>
+#include <algorithm>
 
 using namespace os;
 using namespace media;
 
+/* The default size of the ranges read in batch mode */
+#define WAVE_BATCH_RANGE_SIZE	( 1024 * 1024 )
+
+/* The number of ranges in flight for each worker, so that a slow range doesn't leave the others idle */
+#define WAVE_BATCH_DEPTH		2
+
+/* The chunks we read from the header are collected whole, up to this size.  Anything past it is skipped */
+#define WAVE_MAX_CHUNK_SIZE		256
+
+/* A chunk we don't read with more than this left in it is skipped by moving the source, rather than reading it */
+#define WAVE_SEEK_THRESHOLD		( 64 * 1024 )
+
+/* The formats we understand.  An extensible file gives the real format in the first two bytes of its sub format */
+#define WAVE_FORMAT_PCM			0x0001
+#define WAVE_FORMAT_IEEE_FLOAT	0x0003
+#define WAVE_FORMAT_EXTENSIBLE	0xfffe
+
+/* The rest of the sub format GUID of an extensible file */
+static const uint8 g_anSubFormatSuffix[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
+
 struct wave_header
 {
-	char anID[4];		/* "RIFF" */
+	char anID[4];		/* "RIFF", "RIFX" for a Big Endian file, or "RF64" or "BW64" for a file with 64 bit sizes */
 	uint32 nSize;		/* Size of the file, minus 8 bytes */
 	char anFormat[4];	/* "WAVE" */
 };
@@ -17,14 +45,30 @@ struct wave_header
 struct fmt_chunk
 {
 	char anID[4];			/* "fmt " */
-	uint32 nSize;			/* Size of the chunk: we expect 18 for a PCM file (Although some docs say 16..) */
-	uint16 nFormat;			/* Data format: 1 = PCM, any other value indicates some form of compression */
+	uint32 nSize;			/* Size of the chunk: 16 or 18 for a PCM file, or 40 for an extensible file */
+	uint16 nFormat;			/* Data format: one of the WAVE_FORMAT_ values, or some form of compression */
 	uint16 nChannels;		/* Number of audio channels */
 	uint32 nSampleRate;
 	uint32 nByteRate;		/* sample rate * channels * bits per sample / 8 */
-	uint16 nBlockAlign;		/* channels * bits per sample / 8 */
-	uint16 nBitsPerSample;	/* 8 bit, 16 bit etc. */
-	uint16 nExtraSize; 		/* Size of any extra data in this chunk; not used for PCM files */
+	uint16 nBlockAlign;		/* channels * bytes per sample */
+	uint16 nBitsPerSample;	/* 8 bit, 16 bit etc.  May be less than the size of the sample, E.g. 20 bits in 3 bytes */
+	uint16 nExtraSize; 		/* Size of any extra data in this chunk; only present if nSize is at least 18 */
+
+	/* WAVE_FORMAT_EXTENSIBLE only, which has an nExtraSize of at least 22 */
+	uint16 nValidBits;		/* The bits of each sample that are used */
+	uint32 nChannelMask;	/* The speaker of each channel */
+	uint8 anSubFormat[16];	/* A GUID, which starts with the real format */
+};
+
+/* The first chunk of an RF64 file.  The sizes in the RIFF header & the data chunk are 0xffffffff */
+struct ds64_chunk
+{
+	char anID[4];			/* "ds64" */
+	uint32 nSize;
+	uint64 nRiffSize;
+	uint64 nDataSize;
+	uint64 nSampleCount;
+	uint32 nTableLength;	/* The sizes of any other chunks over 4GB follow, which we don't need */
 };
 
 struct chunk
@@ -46,6 +90,297 @@ struct data_chunk
 	uint32 nSize;
 };
 
+/* Parses the header as it arrives, so that the chunks before the data may span any number of packets */
+class WaveParser
+{
+	public:
+		enum parse_state
+		{
+			PARSE_RIFF,		/* Collecting the RIFF header */
+			PARSE_CHUNK,	/* Collecting the header of the next chunk */
+			PARSE_BODY,		/* Collecting a chunk we read */
+			PARSE_SKIP,		/* Skipping a chunk we don't */
+			PARSE_DATA,		/* At the start of the data */
+			PARSE_ERROR
+		};
+
+		WaveParser(){ Reset(); };
+
+		void Reset( void );
+
+		/* Parse up to nSize bytes, returning how many were used.  Parsing stops at the start of the data */
+		size_t Parse( const uint8 *pData, size_t nSize );
+
+		/* The caller has moved the stream past the rest of the chunk that is being skipped */
+		void SkipChunk( void );
+
+		parse_state GetState( void ){ return m_eState; };
+		/* The offset within the file of the next byte the parser wants */
+		uint64 GetPosition( void ){ return m_nPosition; };
+		/* The bytes that are left to skip in the current chunk */
+		uint64 GetSkip( void ){ return m_eState == PARSE_SKIP ? m_nSkip : 0; };
+
+		/* NULL until the fmt chunk has been read.  The fields are in host byte order */
+		const struct fmt_chunk * GetFormat( void ){ return m_bFormat ? &m_sFormat : NULL; };
+		/* A "RIFX" file, of Big Endian samples */
+		bool IsBigEndian( void ){ return m_bBigEndian; };
+		/* Only valid once the state is PARSE_DATA.  The size is 0 if the writer didn't know it */
+		uint64 GetDataOffset( void ){ return m_nDataOffset; };
+		uint64 GetDataSize( void ){ return m_nDataSize; };
+
+	private:
+		void NextChunk( void );
+		void StartChunk( void );
+		bool ReadChunk( void );
+
+		uint16 Swap16( uint16 n ){ return m_bBigEndian ? ( n << 8 ) | ( n >> 8 ) : n; };
+		uint32 Swap32( uint32 n ){ return m_bBigEndian ? ( (uint32)Swap16( n ) << 16 ) | Swap16( n >> 16 ) : n; };
+
+		parse_state m_eState;
+		uint64 m_nPosition;
+
+		uint64 m_anChunk[WAVE_MAX_CHUNK_SIZE / 8];	/* The chunk being collected, including its header */
+		size_t m_nHave, m_nNeed;
+		uint64 m_nSkip;
+
+		bool m_bBigEndian;
+		bool m_bRF64;
+		uint64 m_nRF64DataSize;
+
+		bool m_bFormat;
+		struct fmt_chunk m_sFormat;
+		uint64 m_nDataOffset, m_nDataSize;
+};
+
+void WaveParser::Reset( void )
+{
+	m_eState = PARSE_RIFF;
+	m_nPosition = 0;
+
+	m_nHave = 0;
+	m_nNeed = sizeof( struct wave_header );
+	m_nSkip = 0;
+
+	m_bBigEndian = false;
+	m_bRF64 = false;
+	m_nRF64DataSize = 0;
+
+	m_bFormat = false;
+	memset( &m_sFormat, 0, sizeof( m_sFormat ) );
+	m_nDataOffset = m_nDataSize = 0;
+}
+
+size_t WaveParser::Parse( const uint8 *pData, size_t nSize )
+{
+	uint8 *pChunk = (uint8 *)m_anChunk;
+	size_t nUsed = 0;
+
+	while( nUsed < nSize && m_eState != PARSE_DATA && m_eState != PARSE_ERROR )
+	{
+		if( m_eState == PARSE_SKIP )
+		{
+			size_t nCount = nSize - nUsed;
+			if( nCount > m_nSkip )
+				nCount = m_nSkip;
+
+			nUsed += nCount;
+			m_nPosition += nCount;
+			m_nSkip -= nCount;
+			if( m_nSkip == 0 )
+				NextChunk();
+			continue;
+		}
+
+		size_t nCount = m_nNeed - m_nHave;
+		if( nCount > nSize - nUsed )
+			nCount = nSize - nUsed;
+
+		memcpy( pChunk + m_nHave, pData + nUsed, nCount );
+		m_nHave += nCount;
+		nUsed += nCount;
+		m_nPosition += nCount;
+		if( m_nHave < m_nNeed )
+			break;
+
+		if( m_eState == PARSE_RIFF )
+		{
+			struct wave_header *psHeader = (struct wave_header *)pChunk;
+
+			m_bBigEndian = strncmp( psHeader->anID, "RIFX", 4 ) == 0;
+			m_bRF64 = strncmp( psHeader->anID, "RF64", 4 ) == 0 || strncmp( psHeader->anID, "BW64", 4 ) == 0;
+			if( ( false == m_bRF64 && false == m_bBigEndian && strncmp( psHeader->anID, "RIFF", 4 ) != 0 ) ||
+				strncmp( psHeader->anFormat, "WAVE", 4 ) != 0 )
+				m_eState = PARSE_ERROR;
+			else
+				NextChunk();
+		}
+		else if( m_eState == PARSE_CHUNK )
+			StartChunk();
+		else if( ReadChunk() == false )
+			m_eState = PARSE_ERROR;
+		else if( m_nSkip > 0 )
+			m_eState = PARSE_SKIP;
+		else
+			NextChunk();
+	}
+
+	return nUsed;
+}
+
+void WaveParser::SkipChunk( void )
+{
+	if( m_eState != PARSE_SKIP )
+		return;
+
+	m_nPosition += m_nSkip;
+	m_nSkip = 0;
+	NextChunk();
+}
+
+void WaveParser::NextChunk( void )
+{
+	m_eState = PARSE_CHUNK;
+	m_nHave = 0;
+	m_nNeed = sizeof( struct chunk );
+}
+
+/* We have the header of a chunk, so decide what to do with the rest of it */
+void WaveParser::StartChunk( void )
+{
+	struct chunk *psChunk = (struct chunk *)m_anChunk;
+	uint64 nSize = Swap32( psChunk->nSize );
+
+	if( strncmp( psChunk->anID, "data", 4 ) == 0 )
+	{
+		if( false == m_bFormat )
+		{
+			dbprintf( "found the data chunk before the fmt chunk\n" );
+			m_eState = PARSE_ERROR;
+			return;
+		}
+
+		m_nDataOffset = m_nPosition;
+		if( nSize == 0xffffffff )
+			nSize = m_bRF64 ? m_nRF64DataSize : 0;
+		m_nDataSize = nSize;
+
+		m_eState = PARSE_DATA;
+		return;
+	}
+
+	/* Chunks are padded to an even size */
+	nSize += nSize & 1;
+
+	if( strncmp( psChunk->anID, "fmt ", 4 ) == 0 || strncmp( psChunk->anID, "ds64", 4 ) == 0 )
+	{
+		m_nNeed = sizeof( struct chunk ) + nSize;
+		if( m_nNeed > WAVE_MAX_CHUNK_SIZE )
+			m_nNeed = WAVE_MAX_CHUNK_SIZE;
+		m_nSkip = sizeof( struct chunk ) + nSize - m_nNeed;
+		m_eState = PARSE_BODY;
+		return;
+	}
+
+	dbprintf( "skipping a chunk \"%c%c%c%c\" of %llu bytes\n", psChunk->anID[0], psChunk->anID[1], psChunk->anID[2], psChunk->anID[3], (unsigned long long)nSize );
+
+	m_nSkip = nSize;
+	if( m_nSkip > 0 )
+		m_eState = PARSE_SKIP;
+	else
+		NextChunk();
+}
+
+/* We have collected a chunk we read */
+bool WaveParser::ReadChunk( void )
+{
+	struct chunk *psChunk = (struct chunk *)m_anChunk;
+	uint32 nSize = Swap32( psChunk->nSize );
+
+	if( strncmp( psChunk->anID, "fmt ", 4 ) == 0 )
+	{
+		if( m_bFormat )
+		{
+			dbprintf( "found a second fmt chunk\n" );
+			return true;
+		}
+		if( nSize < 16 )
+			return false;
+
+		/* Whatever the chunk is too short for stays zero */
+		memcpy( &m_sFormat, m_anChunk, m_nHave < sizeof( m_sFormat ) ? m_nHave : sizeof( m_sFormat ) );
+		if( nSize < 18 )
+			m_sFormat.nExtraSize = 0;
+
+		m_sFormat.nSize = nSize;
+		m_sFormat.nFormat = Swap16( m_sFormat.nFormat );
+		m_sFormat.nChannels = Swap16( m_sFormat.nChannels );
+		m_sFormat.nSampleRate = Swap32( m_sFormat.nSampleRate );
+		m_sFormat.nByteRate = Swap32( m_sFormat.nByteRate );
+		m_sFormat.nBlockAlign = Swap16( m_sFormat.nBlockAlign );
+		m_sFormat.nBitsPerSample = Swap16( m_sFormat.nBitsPerSample );
+		m_sFormat.nExtraSize = Swap16( m_sFormat.nExtraSize );
+		m_sFormat.nValidBits = Swap16( m_sFormat.nValidBits );
+		m_sFormat.nChannelMask = Swap32( m_sFormat.nChannelMask );
+
+		/* The first three fields of a GUID are stored in the byte order of the file */
+		if( m_bBigEndian )
+		{
+			uint8 *p = m_sFormat.anSubFormat;
+			std::swap( p[0], p[3] );
+			std::swap( p[1], p[2] );
+			std::swap( p[4], p[5] );
+			std::swap( p[6], p[7] );
+		}
+		m_bFormat = true;
+	}
+	else
+	{
+		/* RF64 files are always Little Endian */
+		struct ds64_chunk *psDS64 = (struct ds64_chunk *)m_anChunk;
+		if( nSize < 24 )
+			return false;
+
+		m_nRF64DataSize = psDS64->nDataSize;
+	}
+
+	return true;
+}
+
+/* Reads one range of the data in batch mode */
+class RangeTask : public Task
+{
+	public:
+		RangeTask()
+		{
+			m_hDone = create_semaphore( "wave_range", 0, SEMSTYLE_COUNTING );
+			atomic_set( &m_nDone, 0 );
+			m_bPending = false;
+			m_pcPacket = NULL;
+		};
+		~RangeTask()
+		{
+			delete_semaphore( m_hDone );
+		};
+
+		void Run( void )
+		{
+			m_nError = m_pcSource->GetPacketAt( m_pcPacket, m_nOffset, m_nSize );
+
+			atomic_set( &m_nDone, 1 );
+			unlock_semaphore( m_hDone );
+		};
+
+		SourceInterface *m_pcSource;
+		Packet *m_pcPacket;
+		uint64 m_nOffset;
+		size_t m_nSize;
+		status_t m_nError;
+
+		sem_id m_hDone;
+		atomic_t m_nDone;		/* Lets the consumer check for a finished range without waiting */
+		bool m_bPending;		/* Scheduled & not yet collected */
+};
+
 class WaveStage : public DemuxStage
 {
 	public:
@@ -67,18 +402,57 @@ class WaveStage : public DemuxStage
 		/* We can only provide a single stream of data */
 		int GetOutputCount( void ){ return 1; };
 		status_t GetPacket( Packet **ppcPacket, int nInterface );
+		status_t GetPackets( Packet **ppcPackets, size_t nMax, size_t *pnCount, int nInterface );
 
 		status_t Connect( Buffer *pcBuffer );
 
+		status_t SetBatchMode( int nWorkers, size_t nRangeSize );
+		status_t Seek( bigtime_t nTime );
+
 	private:
+		bool SetFormat( const struct fmt_chunk *psFmt, bool bBigEndian );
+		void SetInfo( Packet *pcPacket );
+		void ResetDataEnd( void );
+		uint64 GetOffset( bigtime_t nTime );
+
+		status_t ReadHeader( void );
+		status_t MoveSource( uint64 nOffset );
+
+		status_t StartBatch( void );
+		void ScheduleRange( RangeTask *pcTask );
+		status_t GetRanges( Packet **ppcPackets, size_t nMax, size_t *pnCount );
+
 		Buffer *m_pcUpstream;
 		uint64 m_nPacketCount;	/* How many packets have we processed? */
 
-		uint32 m_nDataOffset;	/* Offset to the start of the audio data after the chunks */
+		/* The header is parsed from the stream before the first packet is delivered */
+		WaveParser m_cParser;
+		uint64 m_nPosition;		/* The offset within the file of the next byte from upstream */
+		Packet *m_pcPending;	/* The audio after the header in the packet that finished it */
+		bigtime_t m_nSeekTime;	/* A Seek() that came before the header was parsed, or -1 */
+
+		uint64 m_nDataOffset;	/* Offset to the start of the audio data after the chunks */
+		uint64 m_nDataSize;		/* Size of the data chunk, which is 0 if the writer didn't know it */
+		uint16 m_nBlockAlign;
 
 		uint16 m_nChannels;
 		uint32 m_nSampleRate;
 		uint16 m_nBitsPerSample;
+
+		AudioPacketInfo *m_pcInfo;		/* Shared by every packet we produce */
+		AudioPacketInfo *m_pcLastInfo;	/* The info attached to the last packet we produced */
+
+		/* Batch mode.  Range n is read by m_vpcRanges[n % size], & m_nNextRange is the next to deliver */
+		int m_nWorkers;
+		size_t m_nRangeSize;
+		bool m_bBatchStarted;
+		SourceInterface *m_pcSource;
+		Scheduler *m_pcScheduler;
+		std::vector <RangeTask*> m_vpcRanges;
+		uint64 m_nNextRange, m_nScheduled;
+		uint64 m_nBatchStart;	/* Where range 0 starts, which is the start of the data until a Seek() */
+		uint64 m_nDataEnd;
+		status_t m_nBatchError;	/* Why a range couldn't be read, which is reported once the ranges before it are delivered */
 };
 
 WaveStage::WaveStage()
@@ -86,15 +460,51 @@ WaveStage::WaveStage()
 	m_pcUpstream = NULL;
 	m_nPacketCount = 0;
 
+	m_nPosition = 0;
+	m_pcPending = NULL;
+	m_nSeekTime = -1;
+
 	m_nDataOffset = 0;
+	m_nDataSize = 0;
+	m_nBlockAlign = 0;
 
 	m_nChannels = 0;
 	m_nSampleRate = 0;
 	m_nBitsPerSample = 0;
+
+	m_pcInfo = NULL;
+	m_pcLastInfo = NULL;
+
+	m_nWorkers = 0;
+	m_nRangeSize = WAVE_BATCH_RANGE_SIZE;
+	m_bBatchStarted = false;
+	m_pcSource = NULL;
+	m_pcScheduler = NULL;
+	m_nNextRange = m_nScheduled = 0;
+	m_nBatchStart = 0;
+	m_nDataEnd = 0;
+	m_nBatchError = EOK;
 }
 
 WaveStage::~WaveStage()
 {
+	/* Wait for the ranges that are still being read */
+	for( size_t i = 0; i < m_vpcRanges.size(); i++ )
+	{
+		RangeTask *pcTask = m_vpcRanges[i];
+		if( pcTask->m_bPending )
+		{
+			lock_semaphore( pcTask->m_hDone );
+			m_pcPipeline->FreePacket( pcTask->m_pcPacket );
+		}
+		delete pcTask;
+	}
+	delete m_pcScheduler;
+
+	if( m_pcPending )
+		m_pcPipeline->FreePacket( m_pcPending );
+	if( m_pcInfo )
+		m_pcInfo->Release();
 }
 
 #include <iostream>
@@ -108,124 +518,480 @@ bool WaveStage::Check( Packet *pcPacket )
 		return false;
 	}
 
-	/* Is this a RIFF WAVE file? */
-	const uint8 *pData = pcPacket->GetData();
+	/* Is this a RIFF WAVE file?  The header may not all be in the first packet, so we only check what is */
+	WaveParser cParser;
+	cParser.Parse( pcPacket->GetData(), pcPacket->GetDataSize() );
+	if( cParser.GetState() == WaveParser::PARSE_ERROR || cParser.GetState() == WaveParser::PARSE_RIFF )
+		return false;
+
+	const struct fmt_chunk *psFmt = cParser.GetFormat();
+	if( psFmt && SetFormat( psFmt, cParser.IsBigEndian() ) == false )
+		return false;
+
+	/* This would appear to be a RIFF WAVE file */
+	return true;
+}
+
+bool WaveStage::SetFormat( const struct fmt_chunk *psFmt, bool bBigEndian )
+{
+	uint16 nFormat = psFmt->nFormat;
+	uint32 nValidBits = psFmt->nBitsPerSample;
+	uint32 nChannelMask = 0;
+
+	if( nFormat == WAVE_FORMAT_EXTENSIBLE )
+	{
+		if( psFmt->nExtraSize < 22 || memcmp( psFmt->anSubFormat + 2, g_anSubFormatSuffix, sizeof( g_anSubFormatSuffix ) ) != 0 )
+			return false;
+
+		nFormat = psFmt->anSubFormat[0] | ( psFmt->anSubFormat[1] << 8 );
+		nValidBits = psFmt->nValidBits;
+		nChannelMask = psFmt->nChannelMask;
+	}
 
-	struct wave_header *psHeader = (struct wave_header *)pData;
-	if( strncmp( psHeader->anID, "RIFF", 4 ) != 0 || strncmp( psHeader->anFormat, "WAVE", 4 ) != 0 )
+	if( psFmt->nChannels == 0 || psFmt->nBlockAlign == 0 || psFmt->nBlockAlign % psFmt->nChannels != 0 )
 		return false;
 
-	/* Find the chunks and check the format etc. is valid */
-	const uint8 *pNext = pData + sizeof( struct wave_header );
-	struct chunk *psChunk = NULL;
-	struct fmt_chunk *psFmt = NULL;
-	struct fact_chunk *psFact = NULL;
-	struct data_chunk *psData = NULL;
-	uint16 nExtraSize = 0;
+	/* The size of each sample comes from the block alignment, as the bits per sample may not fill it */
+	uint32 nBitsPerSample = psFmt->nBlockAlign / psFmt->nChannels * 8;
+	audio_format_t eFormat;
 
-	while( pNext < ( pData + psHeader->nSize + 8 ) )
+	switch( nFormat )
 	{
-		psChunk = (struct chunk *)pNext;
-		nExtraSize = 0;
+		case WAVE_FORMAT_PCM:
+			if( nBitsPerSample > 32 )
+				return false;
 
-		if( strncmp( psChunk->anID, "fmt ", 4 ) == 0 )
-		{
-			if( NULL == psFmt )
-			{
-				psFmt = (struct fmt_chunk *)psChunk;
-				nExtraSize = psFmt->nExtraSize;
-			}
+			/* 8bit samples are always unsigned, & the rest are always signed */
+			if( nBitsPerSample == 8 )
+				eFormat = PCM_UNSIGNED_8;
 			else
-				dbprintf( "found a second fmt chunk\n" );
+				eFormat = bBigEndian ? PCM_SIGNED_BE : PCM_SIGNED_LE;
+			break;
+		case WAVE_FORMAT_IEEE_FLOAT:
+			if( nBitsPerSample != 32 && nBitsPerSample != 64 )
+				return false;
+
+			eFormat = bBigEndian ? PCM_FLOAT_BE : PCM_FLOAT_LE;
+			nValidBits = 0;
+			break;
+		default:
+			return false;
+	}
+
+	/* Copy the important info */
+	m_nBlockAlign = psFmt->nBlockAlign;
+	m_nChannels = psFmt->nChannels;
+	m_nSampleRate = psFmt->nSampleRate;
+	m_nBitsPerSample = nBitsPerSample;
+
+	if( m_pcInfo )
+		m_pcInfo->Release();
+	m_pcInfo = AudioPacketInfo::Get( eFormat, m_nChannels, m_nSampleRate, m_nBitsPerSample, nValidBits, nChannelMask );
+
+	return true;
+}
+
+/* This should be called before the pipeline is started.  If we are already connected a range larger than
+   the source can read at once is refused, otherwise it is cut down when the batch starts */
+status_t WaveStage::SetBatchMode( int nWorkers, size_t nRangeSize )
+{
+	if( nWorkers < 0 || m_bBatchStarted )
+		return EINVAL;
+
+	if( m_pcUpstream )
+	{
+		SourceInterface *pcSource = dynamic_cast<SourceInterface*>( m_pcUpstream->GetStage() );
+		if( pcSource && pcSource->GetMaxPacketSize() > 0 && nRangeSize > pcSource->GetMaxPacketSize() )
+			return EINVAL;
+	}
+
+	m_nWorkers = nWorkers;
+	m_nRangeSize = nRangeSize ? nRangeSize : WAVE_BATCH_RANGE_SIZE;
+	return EOK;
+}
+
+void WaveStage::SetInfo( Packet *pcPacket )
+{
+	/* Every packet shares the same format descriptor.  Downstream stages only need to look at it when
+	   the packet is flagged as a format change */
+	m_pcInfo->AddRef();
+	pcPacket->SetInfo( m_pcInfo );
+	if( m_pcInfo != m_pcLastInfo )
+	{
+		pcPacket->SetFlags( pcPacket->GetFlags() | Packet::FORMAT_CHANGED );
+		m_pcLastInfo = m_pcInfo;
+	}
+}
+
+void WaveStage::ResetDataEnd( void )
+{
+	/* A writer that was streaming may not have known the size of the data */
+	if( m_nDataSize == 0 )
+		m_nDataEnd = ~(uint64)0;
+	else
+		m_nDataEnd = m_nDataOffset + m_nDataSize;
+}
+
+/* The offset of the sample nTime microseconds in.  Past the end of the data is the end of the stream */
+uint64 WaveStage::GetOffset( bigtime_t nTime )
+{
+	/* Round to the nearest sample, so that a time worked out from a sample number finds it again */
+	uint64 nSample = ( (uint64)nTime * m_nSampleRate + 500000 ) / 1000000;
+	uint64 nOffset = m_nDataOffset + nSample * m_nBlockAlign;
+
+	if( m_nDataSize != 0 && nOffset > m_nDataOffset + m_nDataSize )
+		nOffset = m_nDataOffset + m_nDataSize;
+
+	return nOffset;
+}
+
+/* Reposition the source under the upstream Buffer & throw away what it had already read */
+status_t WaveStage::MoveSource( uint64 nOffset )
+{
+	SourceInterface *pcSource = dynamic_cast<SourceInterface*>( m_pcUpstream->GetStage() );
+	if( NULL == pcSource )
+		return ENOSYS;
+
+	status_t nError = m_pcUpstream->Pause();
+	if( nError != EOK )
+		return nError;
+	m_pcUpstream->WaitPaused();
+
+	nError = pcSource->Seek( nOffset );
+	if( nError == EOK )
+		m_pcUpstream->Flush( m_pcPipeline );
+
+	m_pcUpstream->Resume();
+	return nError;
+}
+
+/* Feed the parser until it reaches the data.  A large chunk we don't read is skipped by moving the
+   source, if it can; otherwise it is read & thrown away */
+status_t WaveStage::ReadHeader( void )
+{
+	while( m_cParser.GetState() != WaveParser::PARSE_DATA )
+	{
+		if( m_cParser.GetState() == WaveParser::PARSE_ERROR )
+			return EIO;
+
+		if( m_cParser.GetSkip() > WAVE_SEEK_THRESHOLD && MoveSource( m_cParser.GetPosition() + m_cParser.GetSkip() ) == EOK )
+		{
+			m_cParser.SkipChunk();
+			continue;
 		}
-		else if( strncmp( psChunk->anID, "fact", 4 ) == 0 )
+
+		Packet *pcPacket = m_pcUpstream->GetPacket();
+		if( NULL == pcPacket )
+			return EIO;
+
+		size_t nUsed = m_cParser.Parse( pcPacket->GetData(), pcPacket->GetDataSize() );
+		if( m_cParser.GetState() == WaveParser::PARSE_DATA && nUsed < pcPacket->GetDataSize() )
 		{
-			psFact = (struct fact_chunk *)psChunk;
+			pcPacket->Trim( nUsed );
+			m_pcPending = pcPacket;
 		}
-		else if( strncmp( psChunk->anID, "data", 4 ) == 0 )
+		else
+			m_pcPipeline->FreePacket( pcPacket );
+	}
+
+	const struct fmt_chunk *psFmt = m_cParser.GetFormat();
+	if( SetFormat( psFmt, m_cParser.IsBigEndian() ) == false )
+	{
+		cerr << "unsupported format " << psFmt->nFormat << endl;
+		return EIO;
+	}
+
+	m_nDataOffset = m_cParser.GetDataOffset();
+	m_nDataSize = m_cParser.GetDataSize();
+	m_nBatchStart = m_nPosition = m_nDataOffset;
+	ResetDataEnd();
+
+	/* Pipeline::Seek() came before we knew where the data was */
+	if( m_nSeekTime >= 0 )
+	{
+		uint64 nOffset = GetOffset( m_nSeekTime );
+		m_nSeekTime = -1;
+
+		if( nOffset != m_nDataOffset )
 		{
-			psData = (struct data_chunk *)psChunk;
+			status_t nError = MoveSource( nOffset );
+			if( nError != EOK )
+				return nError;
 
-			m_nDataOffset = (pNext + 8) - pData;
-			break;
+			if( m_pcPending )
+				m_pcPipeline->FreePacket( m_pcPending );
+			m_pcPending = NULL;
+			m_nBatchStart = m_nPosition = nOffset;
 		}
-		else
-			dbprintf( "found an unknown chunk \"%c%c%c%c\"!\n", psChunk->anID[0], psChunk->anID[1], psChunk->anID[2], psChunk->anID[3] );
+	}
 
-		pNext += ( psChunk->nSize + 8 + nExtraSize );
+	return EOK;
+}
+
+/* Switch to reading ranges straight from the source.  If it can't do that we carry on streaming */
+status_t WaveStage::StartBatch( void )
+{
+	m_bBatchStarted = true;
+
+	/* The ranges are read from m_nBatchStart, so the audio we already have isn't needed */
+	if( m_pcPending )
+		m_pcPipeline->FreePacket( m_pcPending );
+	m_pcPending = NULL;
+
+	m_pcSource = dynamic_cast<SourceInterface*>( m_pcUpstream->GetStage() );
+	if( NULL == m_pcSource || m_nBlockAlign == 0 )
+	{
+		m_nWorkers = 0;
+		return EOK;
 	}
 
-	if( NULL == psData || NULL == psFmt )
-		return false;
+	/* Try a single block, which also tells us whether the source supports it */
+	Packet *pcPacket = m_pcPipeline->AllocPacket();
+	status_t nError = m_pcSource->GetPacketAt( pcPacket, m_nDataOffset, m_nBlockAlign );
+	m_pcPipeline->FreePacket( pcPacket );
+	if( nError == ENOSYS )
+	{
+		dbprintf( "%s: the source can't read ranges, so batch mode is off\n", __FUNCTION__ );
+		m_nWorkers = 0;
+		return EOK;
+	}
 
-	if( psFmt->nSize != 18 || psFmt->nFormat != 1 )
-		return false;
+	/* Nothing reads the upstream Buffer from now on.  Park its producer at a safe point first, so that
+	   nothing is still being added once we free what it has already read, & only then stop it */
+	if( m_pcUpstream->Pause() == EOK )
+	{
+		m_pcUpstream->WaitPaused();
+		m_pcUpstream->Flush( m_pcPipeline );
+	}
+	m_pcUpstream->Stop();
 
-	/* Copy the important info */
-	m_nChannels = psFmt->nChannels;
-	m_nSampleRate = psFmt->nSampleRate;
-	m_nBitsPerSample = psFmt->nBitsPerSample;
+	/* Ranges must hold whole blocks, & no more than the source can read at once */
+	size_t nMaxSize = m_pcSource->GetMaxPacketSize();
+	if( nMaxSize > 0 && m_nRangeSize > nMaxSize )
+		m_nRangeSize = nMaxSize;
+	if( m_nRangeSize < m_nBlockAlign )
+		m_nRangeSize = m_nBlockAlign;
+	m_nRangeSize -= m_nRangeSize % m_nBlockAlign;
 
-	/* This would appear to be a RIFF WAVE file */
-	return true;
+	ResetDataEnd();
+
+	/* The ranges are read on a Scheduler of our own.  We are often filled by a worker of the Scheduler
+	   of the Pipeline, which must not wait for Tasks queued behind it */
+	m_pcScheduler = new Scheduler( m_nWorkers );
+
+	m_vpcRanges.resize( m_nWorkers * WAVE_BATCH_DEPTH );
+	for( size_t i = 0; i < m_vpcRanges.size(); i++ )
+	{
+		m_vpcRanges[i] = new RangeTask();
+		m_vpcRanges[i]->m_pcSource = m_pcSource;
+	}
+	for( size_t i = 0; i < m_vpcRanges.size(); i++ )
+		ScheduleRange( m_vpcRanges[i] );
+
+	return EOK;
+}
+
+/* Start reading the next range with pcTask, if there is one */
+void WaveStage::ScheduleRange( RangeTask *pcTask )
+{
+	uint64 nOffset = m_nBatchStart + m_nScheduled * m_nRangeSize;
+	if( nOffset >= m_nDataEnd )
+		return;
+
+	pcTask->m_pcPacket = m_pcPipeline->AllocPacket();
+	if( NULL == pcTask->m_pcPacket )
+		return;
+
+	pcTask->m_nOffset = nOffset;
+	pcTask->m_nSize = m_nRangeSize;
+	if( m_nDataEnd - nOffset < m_nRangeSize )
+		pcTask->m_nSize = m_nDataEnd - nOffset;
+	atomic_set( &pcTask->m_nDone, 0 );
+	pcTask->m_bPending = true;
+
+	m_nScheduled++;
+	m_pcScheduler->Schedule( pcTask );
+}
+
+/* Deliver the ranges in order.  We wait for the next range if we have nothing yet, otherwise we only
+   take the ranges that are already finished */
+status_t WaveStage::GetRanges( Packet **ppcPackets, size_t nMax, size_t *pnCount )
+{
+	while( *pnCount < nMax )
+	{
+		RangeTask *pcTask = m_vpcRanges[m_nNextRange % m_vpcRanges.size()];
+		if( false == pcTask->m_bPending )
+			break;
+		if( *pnCount > 0 && atomic_read( &pcTask->m_nDone ) == 0 )
+			break;
+
+		lock_semaphore( pcTask->m_hDone );
+		pcTask->m_bPending = false;
+
+		Packet *pcPacket = pcTask->m_pcPacket;
+		pcTask->m_pcPacket = NULL;
+
+		if( pcTask->m_nError != EOK || pcPacket->GetDataSize() == 0 )
+		{
+			/* Nothing more is read after the end of the file or a failed range */
+			m_pcPipeline->FreePacket( pcPacket );
+			m_nDataEnd = pcTask->m_nOffset;
+			m_nBatchError = pcTask->m_nError;
+			break;
+		}
+
+		/* A short range is the end of the file */
+		if( pcPacket->GetDataSize() < pcTask->m_nSize )
+			m_nDataEnd = pcTask->m_nOffset + pcPacket->GetDataSize();
+
+		SetInfo( pcPacket );
+		ppcPackets[(*pnCount)++] = pcPacket;
+
+		m_nNextRange++;
+		ScheduleRange( pcTask );
+	}
+
+	m_nPacketCount += *pnCount;
+	if( *pnCount > 0 )
+		return EOK;
+	return m_nBatchError != EOK ? m_nBatchError : EIO;
 }
 
 status_t WaveStage::GetPacket( Packet **ppcPacket, int nInterface )
 {
+	size_t nCount;
+	return GetPackets( ppcPacket, 1, &nCount, nInterface );
+}
+
+status_t WaveStage::GetPackets( Packet **ppcPackets, size_t nMax, size_t *pnCount, int nInterface )
+{
+	*pnCount = 0;
+
 	if( nInterface > 0 || NULL == m_pcUpstream )
 	{
 		cerr << "GetPacket() early failure" << endl;
 		return EINVAL;
 	}
 
-	Packet *pcPacket;
+	if( m_cParser.GetState() != WaveParser::PARSE_DATA )
+	{
+		status_t nError = ReadHeader();
+		if( nError != EOK )
+			return nError;
+	}
+
+	if( m_nWorkers > 0 && false == m_bBatchStarted )
+		StartBatch();
+	if( m_nWorkers > 0 )
+		return GetRanges( ppcPackets, nMax, pnCount );
+
+	if( m_nPosition >= m_nDataEnd )
+		return EIO;
 
-	if( m_nPacketCount == 0 )
+	size_t nCount = 0;
+	if( m_pcPending )
 	{
-		/* We have to handle the first packet a little differently and skip the header & chunk data */
-		Packet *pcInPacket;
+		ppcPackets[nCount++] = m_pcPending;
+		m_pcPending = NULL;
+	}
+	if( nCount < nMax )
+		nCount += m_pcUpstream->GetPackets( ppcPackets + nCount, nMax - nCount, nCount > 0 );
+	if( nCount == 0 )
+	{
+		//cerr << "failed to get upstream packet" << endl;
+		return EIO;
+	}
 
-		pcInPacket = m_pcUpstream->GetPacket( false );
-		if( NULL == pcInPacket )
-		{
-			//cerr << "failed to get upstream packet" << endl;
-			return EIO;
-		}
+	/* Anything after the data chunk isn't audio */
+	for( size_t i = 0; i < nCount; i++ )
+	{
+		Packet *pcPacket = ppcPackets[i];
 
-		pcPacket = m_pcPipeline->AllocPacket();
-		if( NULL == pcPacket )
+		if( m_nPosition >= m_nDataEnd )
 		{
-			cerr << "failed to allocate packet" << endl;
-			return ENOMEM;
+			m_pcPipeline->FreePacket( pcPacket );
+			continue;
 		}
 
-		pcPacket->SetData( ( pcInPacket->GetData() + m_nDataOffset ), ( pcInPacket->GetDataSize() - m_nDataOffset ) );
+		size_t nSize = pcPacket->GetDataSize();
+		if( m_nDataEnd - m_nPosition < nSize )
+			pcPacket->SetDataSize( m_nDataEnd - m_nPosition );
+		m_nPosition += nSize;
 
-		m_pcPipeline->FreePacket( pcInPacket );
+		SetInfo( pcPacket );
+		ppcPackets[(*pnCount)++] = pcPacket;
 	}
-	else
+
+	m_nPacketCount += *pnCount;
+	return *pnCount > 0 ? EOK : EIO;
+}
+
+/* Called by Pipeline::Seek() while nothing is reading from us or from the source.  The sample is found
+   from the block alignment, so the source only has to move its position */
+status_t WaveStage::Seek( bigtime_t nTime )
+{
+	if( nTime < 0 || NULL == m_pcUpstream )
+		return EINVAL;
+
+	SourceInterface *pcSource = dynamic_cast<SourceInterface*>( m_pcUpstream->GetStage() );
+
+	/* We don't know where the data is yet, so carry on with the header & seek once we do */
+	if( m_cParser.GetState() != WaveParser::PARSE_DATA )
 	{
-		pcPacket = m_pcUpstream->GetPacket();
-		if( NULL == pcPacket )
-		{
-			//cerr << "failed to get upstream packet" << endl;
+		if( m_cParser.GetState() == WaveParser::PARSE_ERROR )
 			return EIO;
+		if( NULL == pcSource )
+			return ENOSYS;
+
+		status_t nError = pcSource->Seek( m_cParser.GetPosition() );
+		if( nError != EOK )
+			return nError;
+
+		m_nSeekTime = nTime;
+		return EOK;
+	}
+
+	uint64 nOffset = GetOffset( nTime );
+
+	if( m_nWorkers > 0 && m_bBatchStarted )
+	{
+		/* Throw away the ranges that are still being read & start again from nOffset */
+		for( size_t i = 0; i < m_vpcRanges.size(); i++ )
+		{
+			RangeTask *pcTask = m_vpcRanges[i];
+			if( false == pcTask->m_bPending )
+				continue;
+
+			lock_semaphore( pcTask->m_hDone );
+			pcTask->m_bPending = false;
+			m_pcPipeline->FreePacket( pcTask->m_pcPacket );
+			pcTask->m_pcPacket = NULL;
 		}
+
+		m_nBatchStart = nOffset;
+		m_nNextRange = m_nScheduled = 0;
+		m_nBatchError = EOK;
+		ResetDataEnd();
+
+		for( size_t i = 0; i < m_vpcRanges.size(); i++ )
+			ScheduleRange( m_vpcRanges[i] );
+
+		return EOK;
 	}
 
-	AudioPacketInfo *pcInfo = new AudioPacketInfo();
-	pcInfo->nChannels = m_nChannels;
-	pcInfo->nSampleRate = m_nSampleRate;
-	pcInfo->nBitsPerSample = m_nBitsPerSample;
-	if( m_nBitsPerSample == 8 )
-		pcInfo->eFormat = PCM_UNSIGNED_8;
-	else
-		pcInfo->eFormat = PCM_SIGNED_LE;	/* "RIFX" files are Big Endian, 16bit samples are always signed */
+	if( NULL == pcSource )
+		return ENOSYS;
 
-	pcPacket->SetInfo( pcInfo );
+	status_t nError = pcSource->Seek( nOffset );
+	if( nError != EOK )
+		return nError;
+
+	/* If batch mode hasn't started yet, it starts here too */
+	if( m_pcPending )
+		m_pcPipeline->FreePacket( m_pcPending );
+	m_pcPending = NULL;
+	m_nPosition = m_nBatchStart = nOffset;
 
-	*ppcPacket = pcPacket;
-	m_nPacketCount++;
 	return EOK;
 }
 
@@ -242,5 +1008,19 @@ extern "C"
 		return new WaveStage();
 	}
 
+	/* Only the RIFF header is checked, so that the registry doesn't need a WaveStage to recognise a file */
+	int Probe( const void *pData, size_t nSize )
+	{
+		const struct wave_header *psHeader = (const struct wave_header *)pData;
+		if( nSize < sizeof( struct wave_header ) || strncmp( psHeader->anFormat, "WAVE", 4 ) != 0 )
+			return PROBE_NONE;
+
+		if( strncmp( psHeader->anID, "RIFF", 4 ) == 0 || strncmp( psHeader->anID, "RIFX", 4 ) == 0 ||
+			strncmp( psHeader->anID, "RF64", 4 ) == 0 || strncmp( psHeader->anID, "BW64", 4 ) == 0 )
+			return PROBE_CERTAIN;
+
+		return PROBE_NONE;
+	}
+
 };
 
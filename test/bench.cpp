@@ -0,0 +1,521 @@
+
+#include <pipeline.h>
+#include <stage.h>
+#include <packet.h>
+#include <buffer.h>
+#include <scheduler.h>
+#include <trace.h>
+
+#include <atheos/image.h>
+#include <atheos/time.h>
+#include <util/thread.h>
+#include <storage/file.h>
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+using namespace os;
+using namespace media;
+
+/* Non-interactive throughput & latency benchmark.  A synthetic WAV file is generated, then
+   source -> demux/wave pipelines are run over it for every combination of packet size, Buffer
+   min/max and pipeline count given on the command line.  Each run is made in a child process & prints
+   one line of JSON.
+
+   Latency is the time the consumer spends in Buffer::GetPacket() for each packet, I.e. how long the
+   end of the pipeline keeps its consumer waiting. */
+
+struct wave_header
+{
+	char anID[4];
+	uint32 nSize;
+	char anFormat[4];
+};
+
+struct fmt_chunk
+{
+	char anID[4];
+	uint32 nSize;
+	uint16 nFormat;
+	uint16 nChannels;
+	uint32 nSampleRate;
+	uint32 nByteRate;
+	uint16 nBlockAlign;
+	uint16 nBitsPerSample;
+	uint16 nExtraSize;
+};
+
+struct data_chunk
+{
+	char anID[4];
+	uint32 nSize;
+};
+
+static Stage* (*g_pSourceInstance)( void ) = NULL;
+static Stage* (*g_pDemuxInstance)( void ) = NULL;
+
+static void usage( const char *pzName )
+{
+	fprintf( stderr, "usage: %s [options]\n", pzName );
+	fprintf( stderr, "  -S source     source plugin: file, mmap or async (default file)\n" );
+	fprintf( stderr, "  -s megabytes  size of the synthetic WAV data (default 64)\n" );
+	fprintf( stderr, "  -c channels   (default 2)\n" );
+	fprintf( stderr, "  -r rate       (default 44100)\n" );
+	fprintf( stderr, "  -b bits       8 or 16 (default 16)\n" );
+	fprintf( stderr, "  -p sizes      comma separated packet sizes (default 4096)\n" );
+	fprintf( stderr, "  -m min:max    comma separated Buffer watermarks (default 5:10)\n" );
+	fprintf( stderr, "  -n counts     comma separated number of concurrent pipelines (default 1)\n" );
+	fprintf( stderr, "  -w workers    run the Buffers on a Scheduler with this many workers (0 = per CPU)\n" );
+	fprintf( stderr, "  -f file       where to write the WAV file (default /tmp/bench.wav)\n" );
+	fprintf( stderr, "  -d            also print the statistics snapshot of each pipeline\n" );
+	fprintf( stderr, "  -t file       write a Chrome trace of each run, to file.N if there is more than one run\n" );
+	fprintf( stderr, "                (libmedia must be built with MEDIA_TRACE)\n" );
+}
+
+static vector<unsigned int> parse_list( const char *pzList )
+{
+	vector<unsigned int> vList;
+	const char *p = pzList;
+
+	while( *p )
+	{
+		vList.push_back( strtoul( p, (char**)&p, 0 ) );
+		if( *p == ',' )
+			p++;
+		else if( *p )
+			break;
+	}
+	return vList;
+}
+
+static status_t write_wave( const char *pzPath, uint64 nBytes, uint16 nChannels, uint32 nRate, uint16 nBits )
+{
+	FILE *hFile = fopen( pzPath, "wb" );
+	if( NULL == hFile )
+		return errno;
+
+	uint16 nBlockAlign = nChannels * nBits / 8;
+	nBytes -= nBytes % nBlockAlign;
+
+	struct wave_header sHeader;
+	struct fmt_chunk sFmt;
+	struct data_chunk sData;
+
+	memcpy( sHeader.anID, "RIFF", 4 );
+	sHeader.nSize = sizeof( sHeader ) - 8 + 8 + 18 + sizeof( sData ) + nBytes;
+	memcpy( sHeader.anFormat, "WAVE", 4 );
+
+	memcpy( sFmt.anID, "fmt ", 4 );
+	sFmt.nSize = 18;
+	sFmt.nFormat = 1;
+	sFmt.nChannels = nChannels;
+	sFmt.nSampleRate = nRate;
+	sFmt.nByteRate = nRate * nBlockAlign;
+	sFmt.nBlockAlign = nBlockAlign;
+	sFmt.nBitsPerSample = nBits;
+	sFmt.nExtraSize = 0;
+
+	memcpy( sData.anID, "data", 4 );
+	sData.nSize = nBytes;
+
+	fwrite( &sHeader, sizeof( sHeader ), 1, hFile );
+	fwrite( &sFmt, 8 + sFmt.nSize, 1, hFile );	/* Not sizeof(); the struct is padded */
+	fwrite( &sData, sizeof( sData ), 1, hFile );
+
+	/* A sawtooth is as good as anything */
+	uint8 anBlock[65536];
+	for( size_t i = 0; i < sizeof( anBlock ); i++ )
+		anBlock[i] = i * 7;
+
+	while( nBytes > 0 )
+	{
+		size_t nSize = nBytes > sizeof( anBlock ) ? sizeof( anBlock ) : nBytes;
+		if( fwrite( anBlock, nSize, 1, hFile ) != 1 )
+		{
+			fclose( hFile );
+			return EIO;
+		}
+		nBytes -= nSize;
+	}
+
+	fclose( hFile );
+	return EOK;
+}
+
+/* Runs one pipeline to completion on its own thread */
+class BenchThread : public Thread
+{
+	public:
+		BenchThread( const char *pzPath, size_t nPacketSize, unsigned int nMin, unsigned int nMax, Scheduler *pcScheduler, sem_id hDone ) : Thread( "bench_thread" )
+		{
+			m_pzPath = pzPath;
+			m_nPacketSize = nPacketSize;
+			m_nMin = nMin;
+			m_nMax = nMax;
+			m_pcScheduler = pcScheduler;
+			m_hDone = hDone;
+
+			m_nBytes = m_nPackets = 0;
+			m_nError = EOK;
+		};
+
+		int32 Run( void );
+
+		const char *m_pzPath;
+		size_t m_nPacketSize;
+		unsigned int m_nMin, m_nMax;
+		Scheduler *m_pcScheduler;
+		sem_id m_hDone;
+
+		uint64 m_nBytes, m_nPackets;
+		vector<bigtime_t> m_vLatency;
+		String m_cSnapshot;
+		status_t m_nError;
+};
+
+int32 BenchThread::Run( void )
+{
+	SourceStage *pcSource = static_cast<SourceStage *>( g_pSourceInstance() );
+	DemuxStage *pcDemux = static_cast<DemuxStage *>( g_pDemuxInstance() );
+	InputPipeline *pcPipeline = new InputPipeline( "bench" );
+	String cSourceIdentifier, cDemuxIdentifier;
+	Buffer *pcSourceBuffer, *pcOutputBuffer;
+	Packet *pcPacket;
+	pipeline_snapshot sSnapshot;
+
+	if( m_pcScheduler )
+		pcPipeline->SetScheduler( m_pcScheduler );
+
+	pcSource->SetPacketSize( m_nPacketSize );
+	m_nError = pcSource->OpenUri( m_pzPath );
+	if( m_nError != EOK )
+	{
+		delete pcSource;
+		delete pcDemux;
+		goto out;
+	}
+
+	pcPipeline->AddStage( pcSource, cSourceIdentifier );
+	pcPipeline->AddStage( pcDemux, cDemuxIdentifier );
+
+	pcSourceBuffer = pcPipeline->GetBuffer( cSourceIdentifier, 0 );
+	pcSourceBuffer->SetMinMax( m_nMin, m_nMax );
+
+	pcPacket = pcSourceBuffer->GetPacket( false, false );
+	if( pcDemux->Check( pcPacket ) == false )
+	{
+		m_nError = EINVAL;
+		goto out;
+	}
+
+	pcOutputBuffer = pcPipeline->GetBuffer( cDemuxIdentifier, 0 );
+	pcOutputBuffer->SetMinMax( m_nMin, m_nMax );
+	pcPipeline->Connect( cDemuxIdentifier, cSourceIdentifier, 0 );
+
+	m_vLatency.reserve( 1024 * 1024 );
+	while( true )
+	{
+		bigtime_t nStart = get_system_time();
+		pcPacket = pcOutputBuffer->GetPacket( false );
+		if( NULL == pcPacket )
+			break;
+		m_vLatency.push_back( get_system_time() - nStart );
+
+		m_nBytes += pcPacket->GetDataSize();
+		m_nPackets++;
+		pcPipeline->FreePacket( pcPacket );
+	}
+
+	pcPipeline->Stop();
+
+	if( pcPipeline->GetSnapshot( &sSnapshot ) == EOK )
+		m_cSnapshot = sSnapshot.ToJSON();
+out:
+	delete pcPipeline;
+	unlock_semaphore( m_hDone );
+
+	return 0;
+}
+
+/* The peak RSS of the calling process.  It never goes down, which is why each run has a process of its
+   own */
+static long peak_rss( void )
+{
+	struct rusage sUsage;
+	if( getrusage( RUSAGE_SELF, &sUsage ) < 0 )
+		return -1;
+	return sUsage.ru_maxrss;
+}
+
+static bigtime_t percentile( vector<bigtime_t> &vValues, double vPercent )
+{
+	if( vValues.empty() )
+		return 0;
+	size_t nIndex = (size_t)( vPercent / 100.0 * ( vValues.size() - 1 ) );
+	nth_element( vValues.begin(), vValues.begin() + nIndex, vValues.end() );
+	return vValues[nIndex];
+}
+
+/* One configuration of the benchmark */
+struct bench_run
+{
+	const char *pzSource;
+	const char *pzPath;
+	const char *pzTrace;
+	unsigned int nChannels, nRate, nBits;
+	unsigned int nPacketSize, nMin, nMax;
+	unsigned int nPipelines;
+	int nWorkers;
+	bool bSnapshots;
+};
+
+static int run_bench( const bench_run &sRun )
+{
+	status_t nError = EOK;
+
+	Scheduler *pcScheduler = NULL;
+	if( sRun.nWorkers >= 0 )
+		pcScheduler = new Scheduler( sRun.nWorkers );
+
+	sem_id hDone = create_semaphore( "bench_done", 0, SEMSTYLE_COUNTING );
+
+	if( sRun.pzTrace )
+		Trace::Enable( true );
+
+	vector<BenchThread*> vpcThreads;
+	vector<bigtime_t> vLatency;
+	uint64 nBytes = 0, nPackets = 0;
+
+	bigtime_t nStart = get_system_time();
+
+	for( unsigned int i = 0; i < sRun.nPipelines; i++ )
+		vpcThreads.push_back( new BenchThread( sRun.pzPath, sRun.nPacketSize, sRun.nMin, sRun.nMax, pcScheduler, hDone ) );
+	for( unsigned int i = 0; i < sRun.nPipelines; i++ )
+		vpcThreads[i]->Start();
+	for( unsigned int i = 0; i < sRun.nPipelines; i++ )
+		lock_semaphore( hDone );
+
+	bigtime_t nTime = get_system_time() - nStart;
+
+	for( unsigned int i = 0; i < sRun.nPipelines; i++ )
+	{
+		nBytes += vpcThreads[i]->m_nBytes;
+		nPackets += vpcThreads[i]->m_nPackets;
+		if( vpcThreads[i]->m_nError != EOK )
+			nError = vpcThreads[i]->m_nError;
+		vLatency.insert( vLatency.end(), vpcThreads[i]->m_vLatency.begin(), vpcThreads[i]->m_vLatency.end() );
+		if( sRun.bSnapshots && vpcThreads[i]->m_cSnapshot.Length() > 0 )
+			printf( "{\"snapshot\":%s}\n", vpcThreads[i]->m_cSnapshot.c_str() );
+		delete vpcThreads[i];
+	}
+
+	double vSeconds = nTime / 1000000.0;
+	printf( "{\"source\":\"%s\",\"channels\":%u,\"rate\":%u,\"bits\":%u,\"packet_size\":%u,\"min\":%u,\"max\":%u,"
+			"\"pipelines\":%u,\"workers\":%d,\"error\":%d,\"bytes\":%llu,\"packets\":%llu,\"seconds\":%.6f,"
+			"\"mb_per_s\":%.2f,\"packets_per_s\":%.1f,\"latency_p50_us\":%lld,\"latency_p99_us\":%lld,\"peak_rss_kb\":%ld}\n",
+			sRun.pzSource, sRun.nChannels, sRun.nRate, sRun.nBits, sRun.nPacketSize, sRun.nMin, sRun.nMax,
+			sRun.nPipelines, pcScheduler ? pcScheduler->GetWorkerCount() : 0, nError,
+			(unsigned long long)nBytes, (unsigned long long)nPackets, vSeconds,
+			vSeconds > 0 ? nBytes / vSeconds / ( 1024 * 1024 ) : 0.0, vSeconds > 0 ? nPackets / vSeconds : 0.0,
+			(long long)percentile( vLatency, 50 ), (long long)percentile( vLatency, 99 ), peak_rss() );
+	fflush( stdout );
+
+	if( sRun.pzTrace )
+	{
+		Trace::Enable( false );
+		if( Trace::Export( sRun.pzTrace ) != EOK )
+		{
+			cerr << "failed to write \"" << sRun.pzTrace << "\"" << endl;
+			if( nError == EOK )
+				nError = EIO;
+		}
+	}
+
+	delete_semaphore( hDone );
+	delete pcScheduler;
+
+	return nError != EOK;
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *pzSource = "file";
+	const char *pzPath = "/tmp/bench.wav";
+	const char *pzTrace = NULL;
+	unsigned int nMegabytes = 64, nChannels = 2, nRate = 44100, nBits = 16;
+	vector<unsigned int> vPacketSizes, vMinMax, vPipelines;
+	int nWorkers = -1;
+	bool bSnapshots = false;
+	int c;
+
+	vPacketSizes.push_back( 4096 );
+	vPipelines.push_back( 1 );
+	vMinMax.push_back( 5 );
+	vMinMax.push_back( 10 );
+
+	while( ( c = getopt( argc, argv, "S:s:c:r:b:p:m:n:w:f:dt:h" ) ) != -1 )
+	{
+		switch( c )
+		{
+			case 'S':
+				pzSource = optarg;
+				break;
+			case 's':
+				nMegabytes = atoi( optarg );
+				break;
+			case 'c':
+				nChannels = atoi( optarg );
+				break;
+			case 'r':
+				nRate = atoi( optarg );
+				break;
+			case 'b':
+				nBits = atoi( optarg );
+				break;
+			case 'p':
+				vPacketSizes = parse_list( optarg );
+				break;
+			case 'm':
+			{
+				/* min:max pairs */
+				vMinMax.clear();
+				for( char *p = strtok( optarg, "," ); p; p = strtok( NULL, "," ) )
+				{
+					unsigned int nMin, nMax;
+					if( sscanf( p, "%u:%u", &nMin, &nMax ) != 2 )
+					{
+						usage( argv[0] );
+						return 1;
+					}
+					vMinMax.push_back( nMin );
+					vMinMax.push_back( nMax );
+				}
+				break;
+			}
+			case 'n':
+				vPipelines = parse_list( optarg );
+				break;
+			case 'w':
+				nWorkers = atoi( optarg );
+				break;
+			case 'f':
+				pzPath = optarg;
+				break;
+			case 'd':
+				bSnapshots = true;
+				break;
+			case 't':
+				pzTrace = optarg;
+				break;
+			default:
+				usage( argv[0] );
+				return 1;
+		}
+	}
+
+	if( ( nBits != 8 && nBits != 16 ) || nChannels < 1 || vPacketSizes.empty() || vMinMax.empty() || vPipelines.empty() )
+	{
+		usage( argv[0] );
+		return 1;
+	}
+
+	if( write_wave( pzPath, (uint64)nMegabytes * 1024 * 1024, nChannels, nRate, nBits ) != EOK )
+	{
+		cerr << "failed to write \"" << pzPath << "\"" << endl;
+		return 1;
+	}
+
+	/* Load the plugins */
+	char zPlugin[256];
+	snprintf( zPlugin, sizeof( zPlugin ), "../plugins/%s", pzSource );
+	image_id hSource = load_library( zPlugin, 0 );
+	image_id hDemux = load_library( "../plugins/wave", 0 );
+	if( hSource < 0 || hDemux < 0 ||
+		get_symbol_address( hSource, "GetInstance", -1, (void**)&g_pSourceInstance ) < 0 ||
+		get_symbol_address( hDemux, "GetInstance", -1, (void**)&g_pDemuxInstance ) < 0 )
+	{
+		cerr << "failed to load the plugins" << endl;
+		return 1;
+	}
+
+	/* Each run is made in a process of its own, so that the peak RSS it reports is its own & not that of
+	   an earlier run.  The threads of a Scheduler don't survive fork(), so each run makes its own */
+	size_t nRuns = vPacketSizes.size() * ( vMinMax.size() / 2 ) * vPipelines.size();
+	size_t nRun = 0, nFailed = 0;
+
+	for( size_t p = 0; p < vPacketSizes.size(); p++ )
+	for( size_t m = 0; m + 1 < vMinMax.size(); m += 2 )
+	for( size_t n = 0; n < vPipelines.size(); n++, nRun++ )
+	{
+		String cTrace;
+		if( pzTrace && nRuns > 1 )
+			cTrace.Format( "%s.%u", pzTrace, (unsigned int)nRun );
+		else if( pzTrace )
+			cTrace = pzTrace;
+
+		bench_run sRun;
+		sRun.pzSource = pzSource;
+		sRun.pzPath = pzPath;
+		sRun.pzTrace = pzTrace ? cTrace.c_str() : NULL;
+		sRun.nChannels = nChannels;
+		sRun.nRate = nRate;
+		sRun.nBits = nBits;
+		sRun.nPacketSize = vPacketSizes[p];
+		sRun.nMin = vMinMax[m];
+		sRun.nMax = vMinMax[m + 1];
+		sRun.nPipelines = vPipelines[n];
+		sRun.nWorkers = nWorkers;
+		sRun.bSnapshots = bSnapshots;
+
+		fflush( stdout );
+		pid_t hChild = fork();
+		if( hChild < 0 )
+		{
+			/* None of the runs that are left can be made either */
+			cerr << "failed to fork: " << strerror( errno ) << endl;
+			nFailed += nRuns - nRun;
+			goto done;
+		}
+		if( 0 == hChild )
+			_exit( run_bench( sRun ) );
+
+		int nStatus;
+		pid_t hWaited;
+		while( ( hWaited = waitpid( hChild, &nStatus, 0 ) ) < 0 && errno == EINTR )
+			;
+
+		if( hWaited < 0 )
+			cerr << "failed to wait for run " << nRun << ": " << strerror( errno ) << endl;
+		else if( WIFSIGNALED( nStatus ) )
+			cerr << "run " << nRun << " was killed by signal " << WTERMSIG( nStatus ) << endl;
+		else if( WEXITSTATUS( nStatus ) != 0 )
+			cerr << "run " << nRun << " failed" << endl;
+
+		if( hWaited < 0 || false == WIFEXITED( nStatus ) || WEXITSTATUS( nStatus ) != 0 )
+			nFailed++;
+	}
+
+done:
+	unload_library( hSource );
+	unload_library( hDemux );
+	unlink( pzPath );
+
+	if( nFailed > 0 )
+	{
+		cerr << nFailed << " of " << nRuns << " runs failed" << endl;
+		return 1;
+	}
+	return 0;
+}
+
@@ -0,0 +1,310 @@
+#include <pipeline.h>
+#include <stage.h>
+#include <packet.h>
+#include <buffer.h>
+#include <registry.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+#include <iostream>
+
+using namespace std;
+using namespace os;
+using namespace media;
+
+/* Non-interactive check of the WAV header parser.  Each header is fed to demux/wave split into two
+   packets at every byte boundary, & once a byte at a time.  The format of the packets that come out must
+   match the header, & they must hold exactly the data chunk, which shows that the data offset & size
+   were found */
+
+#define DATA_SIZE	96		/* A whole number of blocks for every case */
+
+/* Feeds a block of memory into the pipeline, nFirst bytes & then nRest bytes at a time */
+class MemorySource : public SourceStage
+{
+	public:
+		MemorySource( const vector<uint8> &vData, size_t nFirst, size_t nRest )
+		{
+			m_vData = vData;
+			m_nFirst = nFirst;
+			m_nRest = nRest;
+			m_nPosition = 0;
+		};
+
+		String GetName( void ){ return "source/memory"; };
+
+		interface_t GetInputInterface( void ){ return SOURCE; };
+		interface_t GetOutputInterface( void ){ return DEMUX; };
+
+		int GetOutputCount( void ){ return 1; };
+
+		status_t GetPacket( Packet **ppcPacket, int nInterface )
+		{
+			if( nInterface > 0 || m_nPosition >= m_vData.size() )
+				return EIO;
+
+			size_t nSize = m_nPosition == 0 ? m_nFirst : m_nRest;
+			if( nSize > m_vData.size() - m_nPosition )
+				nSize = m_vData.size() - m_nPosition;
+
+			Packet *pcPacket = m_pcPipeline->AllocPacket();
+			if( NULL == pcPacket )
+				return ENOMEM;
+
+			uint8 *pData = pcPacket->AllocData( nSize );
+			if( NULL == pData )
+			{
+				m_pcPipeline->FreePacket( pcPacket );
+				return ENOMEM;
+			}
+			memcpy( pData, &m_vData[m_nPosition], nSize );
+			pcPacket->SetDataSize( nSize );
+			m_nPosition += nSize;
+
+			*ppcPacket = pcPacket;
+			return EOK;
+		};
+
+	private:
+		vector<uint8> m_vData;
+		size_t m_nFirst, m_nRest;
+		size_t m_nPosition;
+};
+
+/* Writes the fields of a header in the byte order of the file */
+class HeaderWriter
+{
+	public:
+		HeaderWriter( bool bBigEndian ){ m_bBigEndian = bBigEndian; };
+
+		void Id( const char *pzID ){ m_vData.insert( m_vData.end(), pzID, pzID + 4 ); };
+		void Bytes( const uint8 *pData, size_t nSize ){ m_vData.insert( m_vData.end(), pData, pData + nSize ); };
+		void U16( uint16 n ){ Put( n, 2 ); };
+		void U32( uint32 n ){ Put( n, 4 ); };
+		/* ds64 sizes are always Little Endian */
+		void U64( uint64 n ){ for( int i = 0; i < 8; i++ ) m_vData.push_back( ( n >> ( i * 8 ) ) & 0xff ); };
+
+		vector<uint8> & GetData( void ){ return m_vData; };
+
+	private:
+		void Put( uint32 n, int nBytes )
+		{
+			for( int i = 0; i < nBytes; i++ )
+				m_vData.push_back( ( n >> ( ( m_bBigEndian ? nBytes - 1 - i : i ) * 8 ) ) & 0xff );
+		};
+
+		vector<uint8> m_vData;
+		bool m_bBigEndian;
+};
+
+struct header_case
+{
+	const char *pzName;
+
+	/* The header */
+	const char *pzRiff;		/* "RIFF", "RIFX", "RF64" or "BW64" */
+	uint32 nFmtSize;		/* 16, 18 or 40 */
+	uint16 nFormat;			/* 1, 3 or 0xfffe */
+	uint16 nSubFormat;		/* The real format of an extensible file */
+	uint16 nChannels;
+	uint32 nSampleRate;
+	uint16 nBlockAlign;
+	uint16 nBitsPerSample;
+	uint16 nValidBits;		/* Extensible only */
+	uint32 nChannelMask;	/* Extensible only */
+	bool bExtraChunks;		/* Add a "fact" & an odd sized "LIST" chunk before the data */
+
+	/* What the packets should say */
+	audio_format_t eFormat;
+	uint32 nBits, nValid, nMask;
+};
+
+static const header_case g_asCases[] =
+{
+	{ "pcm16",			"RIFF", 16, 0x0001, 0,      2, 44100, 4, 16,  0, 0,     false, PCM_SIGNED_LE,   16, 16, 0 },
+	{ "pcm8 chunks",	"RIFF", 18, 0x0001, 0,      1, 22050, 1,  8,  0, 0,     true,  PCM_UNSIGNED_8,   8,  8, 0 },
+	{ "float32",		"RIFF", 18, 0x0003, 0,      2, 48000, 8, 32,  0, 0,     true,  PCM_FLOAT_LE,    32, 32, 0 },
+	{ "ext s24",		"RIFF", 40, 0xfffe, 0x0001, 2, 96000, 6, 24, 20, 0x003, true,  PCM_SIGNED_LE,   24, 20, 0x003 },
+	{ "ext f64",		"RIFF", 40, 0xfffe, 0x0003, 1, 44100, 8, 64, 64, 0x004, false, PCM_FLOAT_LE,    64, 64, 0x004 },
+	{ "rifx16",			"RIFX", 16, 0x0001, 0,      2, 44100, 4, 16,  0, 0,     true,  PCM_SIGNED_BE,   16, 16, 0 },
+	{ "rifx ext s24",	"RIFX", 40, 0xfffe, 0x0001, 2, 48000, 6, 24, 24, 0x003, false, PCM_SIGNED_BE,   24, 24, 0x003 },
+	{ "rf64",			"RF64", 16, 0x0001, 0,      2, 44100, 4, 16,  0, 0,     true,  PCM_SIGNED_LE,   16, 16, 0 },
+	{ "bw64 float32",	"BW64", 18, 0x0003, 0,      2, 48000, 8, 32,  0, 0,     false, PCM_FLOAT_LE,    32, 32, 0 },
+};
+
+static uint8 data_byte( size_t i )
+{
+	return ( i * 7 + 3 ) & 0xff;
+}
+
+/* Build the file, returning the size of the header */
+static size_t make_file( const header_case &sCase, vector<uint8> &vFile )
+{
+	bool bBigEndian = strcmp( sCase.pzRiff, "RIFX" ) == 0;
+	bool bRF64 = strcmp( sCase.pzRiff, "RF64" ) == 0 || strcmp( sCase.pzRiff, "BW64" ) == 0;
+	HeaderWriter cWriter( bBigEndian );
+
+	cWriter.Id( sCase.pzRiff );
+	cWriter.U32( bRF64 ? 0xffffffff : 0 );	/* The RIFF size isn't used */
+	cWriter.Id( "WAVE" );
+
+	if( bRF64 )
+	{
+		cWriter.Id( "ds64" );
+		cWriter.U32( 28 );
+		cWriter.U64( 0 );
+		cWriter.U64( DATA_SIZE );
+		cWriter.U64( DATA_SIZE / sCase.nBlockAlign );
+		cWriter.U32( 0 );
+	}
+
+	cWriter.Id( "fmt " );
+	cWriter.U32( sCase.nFmtSize );
+	cWriter.U16( sCase.nFormat );
+	cWriter.U16( sCase.nChannels );
+	cWriter.U32( sCase.nSampleRate );
+	cWriter.U32( sCase.nSampleRate * sCase.nBlockAlign );
+	cWriter.U16( sCase.nBlockAlign );
+	cWriter.U16( sCase.nBitsPerSample );
+	if( sCase.nFmtSize >= 18 )
+		cWriter.U16( sCase.nFmtSize - 18 );
+	if( sCase.nFmtSize >= 40 )
+	{
+		cWriter.U16( sCase.nValidBits );
+		cWriter.U32( sCase.nChannelMask );
+
+		/* The first three fields of the GUID are in the byte order of the file */
+		cWriter.U32( sCase.nSubFormat );
+		cWriter.U16( 0x0000 );
+		cWriter.U16( 0x0010 );
+		static const uint8 anRest[8] = { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
+		cWriter.Bytes( anRest, sizeof( anRest ) );
+	}
+
+	if( sCase.bExtraChunks )
+	{
+		cWriter.Id( "fact" );
+		cWriter.U32( 4 );
+		cWriter.U32( DATA_SIZE / sCase.nBlockAlign );
+
+		/* An odd size is padded to an even one */
+		static const uint8 anList[6] = { 'I', 'N', 'F', 'O', 'x', 0 };
+		cWriter.Id( "LIST" );
+		cWriter.U32( 5 );
+		cWriter.Bytes( anList, sizeof( anList ) );
+	}
+
+	cWriter.Id( "data" );
+	cWriter.U32( bRF64 ? 0xffffffff : DATA_SIZE );
+
+	vFile = cWriter.GetData();
+	size_t nHeaderSize = vFile.size();
+
+	for( size_t i = 0; i < DATA_SIZE; i++ )
+		vFile.push_back( data_byte( i ) );
+
+	/* Anything after the data chunk isn't audio */
+	static const uint8 anTrailer[8] = { 'j', 'u', 'n', 'k', 0, 0, 0, 0 };
+	vFile.insert( vFile.end(), anTrailer, anTrailer + sizeof( anTrailer ) );
+
+	return nHeaderSize;
+}
+
+/* Run the file through the pipeline & check what comes out.  Returns false & says why if it is wrong */
+static bool run_case( PluginRegistry &cRegistry, const header_case &sCase, const vector<uint8> &vFile, size_t nFirst, size_t nRest )
+{
+	InputPipeline *pcPipeline = new InputPipeline( "header" );
+	MemorySource *pcSource = new MemorySource( vFile, nFirst, nRest );
+	InputStage *pcDemux = static_cast<InputStage *>( cRegistry.CreateStage( "demux/wave" ) );
+	String cSourceIdentifier, cDemuxIdentifier;
+	String cError;
+	size_t nBytes = 0;
+	AudioPacketInfo *pcInfo = NULL;
+	Packet *pcPacket;
+
+	pcPipeline->AddStage( pcSource, cSourceIdentifier );
+	pcPipeline->AddStage( pcDemux, cDemuxIdentifier );
+	pcPipeline->Connect( cDemuxIdentifier, cSourceIdentifier, 0 );
+
+	Buffer *pcOutputBuffer = pcPipeline->GetBuffer( cDemuxIdentifier, 0 );
+	while( ( pcPacket = pcOutputBuffer->GetPacket( false ) ) != NULL )
+	{
+		if( NULL == pcInfo && pcPacket->GetInfo() )
+		{
+			pcInfo = static_cast<AudioPacketInfo *>( pcPacket->GetInfo() );
+			pcInfo->AddRef();
+		}
+
+		const uint8 *pData = pcPacket->GetData();
+		for( size_t i = 0; i < pcPacket->GetDataSize() && cError == ""; i++, nBytes++ )
+			if( nBytes >= DATA_SIZE || pData[i] != data_byte( nBytes ) )
+				cError.Format( "wrong data at byte %u", (unsigned int)nBytes );
+
+		pcPipeline->FreePacket( pcPacket );
+	}
+
+	pcPipeline->Stop();
+	delete pcPipeline;
+
+	if( cError == "" && nBytes != DATA_SIZE )
+		cError.Format( "%u bytes of data instead of %u", (unsigned int)nBytes, DATA_SIZE );
+	if( cError == "" && NULL == pcInfo )
+		cError = "no format";
+	if( cError == "" && ( pcInfo->eFormat != sCase.eFormat || pcInfo->nChannels != sCase.nChannels ||
+		pcInfo->nSampleRate != sCase.nSampleRate || pcInfo->nBitsPerSample != sCase.nBits ||
+		pcInfo->nValidBits != sCase.nValid || pcInfo->nChannelMask != sCase.nMask ) )
+	{
+		cError.Format( "format %d, %u channels, %u Hz, %u bits, %u valid, mask 0x%x",
+					   pcInfo->eFormat, pcInfo->nChannels, pcInfo->nSampleRate, pcInfo->nBitsPerSample,
+					   pcInfo->nValidBits, pcInfo->nChannelMask );
+	}
+	if( pcInfo )
+		pcInfo->Release();
+
+	if( cError != "" )
+	{
+		printf( "FAIL %s, split at %u then every %u bytes: %s\n", sCase.pzName, (unsigned int)nFirst, (unsigned int)nRest, cError.c_str() );
+		return false;
+	}
+	return true;
+}
+
+int main( void )
+{
+	PluginRegistry cRegistry;
+	if( cRegistry.Scan( "../plugins" ) != EOK || NULL == cRegistry.FindByName( "demux/wave" ) )
+	{
+		cerr << "failed to load the wave plugin" << endl;
+		return 1;
+	}
+
+	int nRuns = 0, nFailures = 0;
+
+	for( size_t n = 0; n < sizeof( g_asCases ) / sizeof( g_asCases[0] ); n++ )
+	{
+		const header_case &sCase = g_asCases[n];
+		vector<uint8> vFile;
+		size_t nHeaderSize = make_file( sCase, vFile );
+		int nCaseFailures = 0;
+
+		/* Every split in the header, & a few in the data */
+		for( size_t nFirst = 1; nFirst <= nHeaderSize + 8; nFirst++ )
+		{
+			nRuns++;
+			if( run_case( cRegistry, sCase, vFile, nFirst, vFile.size() ) == false )
+				nCaseFailures++;
+		}
+
+		nRuns++;
+		if( run_case( cRegistry, sCase, vFile, 1, 1 ) == false )
+			nCaseFailures++;
+
+		printf( "%-16s %3u byte header: %s\n", sCase.pzName, (unsigned int)nHeaderSize, nCaseFailures ? "FAILED" : "ok" );
+		nFailures += nCaseFailures;
+	}
+
+	printf( "%d of %d runs failed\n", nFailures, nRuns );
+	return nFailures > 0 ? 1 : 0;
+}
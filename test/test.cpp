@@ -2,8 +2,8 @@
 #include <stage.h>
 #include <packet.h>
 #include <buffer.h>
+#include <registry.h>
 
-#include <atheos/image.h>
 #include <storage/file.h>
 
 #include <iostream>
@@ -14,45 +14,31 @@ using namespace media;
 
 int main( void )
 {
-	Stage* (*pGetInstance)(void) = NULL;
-
-	/* Load the file plugin */
-	image_id hSourceFile = load_library( "../plugins/file", 0 );
-	if( hSourceFile < 0 )
-	{
-		cerr << "failed to load file plugin" << endl;
-		return 1;
-	}
-
-	if( get_symbol_address( hSourceFile, "GetInstance", -1, (void**)&pGetInstance ) < 0 )
+	/* Load every plugin, once */
+	PluginRegistry cRegistry;
+	if( cRegistry.Scan( "../plugins" ) != EOK || cRegistry.GetPluginCount() == 0 )
 	{
-		cerr << "failed to find GetInstance()" << endl;
-		unload_library( hSourceFile );
+		cerr << "failed to load any plugins" << endl;
 		return 1;
 	}
 
-	SourceStage *pcSource = static_cast<SourceStage *>( pGetInstance() );
-	printf( "pcSource at 0x%p is \"%s\"\n", pcSource, pcSource->GetName().c_str() );
-
-	/* Load the wave plugin */
-	image_id hDemuxWave = load_library( "../plugins/wave", 0 );
-	if( hDemuxWave < 0 )
+	for( int i = 0; i < cRegistry.GetPluginCount(); i++ )
 	{
-		cerr << "failed to load wave plugin" << endl;
-		unload_library( hSourceFile );
-		return 1;
+		const plugin_info *psInfo = cRegistry.GetPlugin( i );
+		printf( "found \"%s\" (%s)%s\n", psInfo->cName.c_str(), psInfo->cMimeType.c_str(), psInfo->pfProbe ? " with Probe()" : "" );
 	}
 
-	if( get_symbol_address( hDemuxWave, "GetInstance", -1, (void**)&pGetInstance ) < 0 )
+	SourceStage *pcSource = static_cast<SourceStage *>( cRegistry.CreateStage( "source/file" ) );
+	if( NULL == pcSource )
 	{
-		cerr << "failed to find GetInstance()" << endl;
-		unload_library( hSourceFile );
-		unload_library( hDemuxWave );
+		cerr << "failed to find the file plugin" << endl;
 		return 1;
 	}
+	printf( "pcSource at 0x%p is \"%s\"\n", pcSource, pcSource->GetName().c_str() );
 
-	DemuxStage *pcDemux = static_cast<DemuxStage *>( pGetInstance() );
-	printf( "pcDemux at 0x%p is \"%s\"\n", pcDemux, pcDemux->GetName().c_str() );
+	DemuxStage *pcDemux = NULL;
+	const plugin_info *psDemux;
+	Packet *pcPacket;
 
 	String cSourceIdentifier, cDemuxIdentifier;
 	InputPipeline *pcPipeline;
@@ -91,8 +77,6 @@ int main( void )
 
 	pcPipeline->AddStage( pcSource, cSourceIdentifier );
 	cout << "Source added as \"" << cSourceIdentifier.const_str() << "\"" << endl;
-	pcPipeline->AddStage( pcDemux, cDemuxIdentifier );
-	cout << "Demux added as \"" << cDemuxIdentifier.const_str() << "\"" << endl;
 
 	/* Get the source buffer */
 	pcSourceBuffer = pcPipeline->GetBuffer( cSourceIdentifier, 0 );
@@ -102,14 +86,27 @@ int main( void )
 		goto out;
 	}
 
-	/* Check that the Demux plugin can handle the input */
-	Packet *pcPacket = pcSourceBuffer->GetPacket( false, false );
+	/* Find a Demux plugin that can handle the input */
+	pcPacket = pcSourceBuffer->GetPacket( false, false );
+	psDemux = cRegistry.Probe( pcPacket, DEMUX );
+	if( NULL == psDemux )
+	{
+		cerr << "\"" << cInfile << "\" is not a recognised format" << endl;
+		goto out;
+	}
+
+	pcDemux = static_cast<DemuxStage *>( cRegistry.CreateStage( psDemux ) );
+	printf( "pcDemux at 0x%p is \"%s\"\n", pcDemux, pcDemux->GetName().c_str() );
 	if( pcDemux->Check( pcPacket ) == false )
 	{
-		cerr << "\"" << cInfile << "\" is not a RIFF WAVE file" << endl;
+		cerr << "\"" << cInfile << "\" is not a " << psDemux->cMimeType.c_str() << " file" << endl;
+		delete pcDemux;
 		goto out;
 	}
 
+	pcPipeline->AddStage( pcDemux, cDemuxIdentifier );
+	cout << "Demux added as \"" << cDemuxIdentifier.const_str() << "\"" << endl;
+
 	/* Connect the file source to the wave demux */
 	pcPipeline->Connect( cDemuxIdentifier, cSourceIdentifier, 0 );
 
@@ -162,8 +159,6 @@ int main( void )
 out:
 	/* Clean up & exit */
 	delete pcPipeline;
-	unload_library( hSourceFile );
-	unload_library( hDemuxWave );
 
 	return 0;
 }